@@ -0,0 +1,146 @@
+/**
+ * @file bench_packet.c
+ * @brief Channel max packet benchmark: download a file from the in-process
+ * server and upload it back with both ends agreeing on each channel max
+ * packet size in turn, and report the throughput of each.
+ * usage: bench_packet [file size MB] [max packet KB ...]
+ * The sizes default to 16 32 64 128 256.
+ * @version 0.1
+ * @date 2022-10-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "fake_server.h"
+#include "libsftp/libsftp.h"
+#include "libsftp/session.h"
+
+#define IO_SIZE (256 << 10)
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Download or upload a file of `srv->opts.file_size` bytes against a
+ * new server and print the throughput.
+ *
+ * @param srv           server options set, counters filled on return
+ * @param max_packet    channel max packet of both ends
+ * @param upload
+ * @param buf           IO_SIZE bytes
+ * @return 0 on success, 1 on error.
+ */
+static int run(struct fake_server *srv, uint32_t max_packet, int upload,
+               uint8_t *buf) {
+    ssh_session session;
+    sftp_session sftp;
+    sftp_file file;
+    uint64_t done = 0;
+    double start, elapsed;
+    int32_t n;
+    uint32_t i;
+    int fd;
+
+    srv->opts.max_packet = max_packet;
+    if (fake_server_start(srv, &fd) < 0) {
+        fprintf(stderr, "can not start server\n");
+        return 1;
+    }
+    session = ssh_new();
+    if (session == NULL) return 1;
+    ssh_socket_set_fd(session->socket, fd);
+    if (ssh_options_set(session, SSH_OPTIONS_MAX_PACKET, &max_packet) !=
+        SSH_OK) {
+        fprintf(stderr, "max packet %u: %s\n", max_packet, ssh_get_error());
+        return 1;
+    }
+
+    sftp = sftp_new(session);
+    if (sftp == NULL || sftp_init(sftp) != SSH_OK) {
+        fprintf(stderr, "sftp setup failed: %s\n", ssh_get_error());
+        return 1;
+    }
+    file = sftp_open(sftp, "bench", upload ? O_WRONLY | O_CREAT : O_RDONLY,
+                     0644);
+    if (file == NULL) {
+        fprintf(stderr, "open failed: %s\n", ssh_get_error());
+        return 1;
+    }
+
+    start = now();
+    if (upload) {
+        for (i = 0; i < IO_SIZE; i++) buf[i] = (uint8_t)i;
+        while (done < srv->opts.file_size) {
+            n = sftp_write(file, buf, IO_SIZE);
+            if (n < 0) break;
+            done += n;
+        }
+    } else {
+        while ((n = sftp_read(file, buf, IO_SIZE)) > 0) {
+            if (buf[0] != fake_server_byte(done)) {
+                fprintf(stderr, "corrupt data at offset %lu\n",
+                        (unsigned long)done);
+                return 1;
+            }
+            done += n;
+        }
+    }
+    if (n < 0 || sftp_close(file) != SSH_OK) {
+        fprintf(stderr, "%s failed: %s\n", upload ? "upload" : "download",
+                ssh_get_error());
+        return 1;
+    }
+    elapsed = now() - start;
+
+    sftp_free(sftp);
+    fake_server_join(srv);
+    ssh_free(session);
+
+    if ((upload ? srv->bytes_written : srv->bytes_sent) !=
+        srv->opts.file_size) {
+        fprintf(stderr, "%s moved %lu bytes, expected %lu\n",
+                upload ? "upload" : "download",
+                (unsigned long)(upload ? srv->bytes_written : srv->bytes_sent),
+                (unsigned long)srv->opts.file_size);
+        return 1;
+    }
+    printf("%3u KB packets %-9s %.3f s (%.1f MB/s)\n", max_packet >> 10,
+           upload ? "upload" : "download", elapsed,
+           done / elapsed / 1e6);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    static const uint32_t sizes_kb[] = {16, 32, 64, 128, 256};
+    struct fake_server srv = {0};
+    uint64_t file_mb = argc > 1 ? strtoull(argv[1], NULL, 10) : 256;
+    uint32_t count = argc > 2 ? argc - 2 : sizeof(sizes_kb) / sizeof(*sizes_kb);
+    uint32_t max_packet;
+    uint8_t *buf;
+    uint32_t i;
+    int rc = 0;
+
+    srv.opts.file_size = file_mb << 20;
+    srv.opts.limits_io = IO_SIZE;
+    buf = malloc(IO_SIZE);
+    if (buf == NULL) return 1;
+
+    for (i = 0; rc == 0 && i < count; i++) {
+        max_packet = (argc > 2 ? strtoul(argv[i + 2], NULL, 10)
+                               : sizes_kb[i]) << 10;
+        rc = run(&srv, max_packet, 0, buf);
+        if (rc == 0) rc = run(&srv, max_packet, 1, buf);
+    }
+
+    free(buf);
+    return rc;
+}
@@ -0,0 +1,113 @@
+/**
+ * @file bench_recv.c
+ * @brief Receive path benchmark: download a file from the in-process server
+ * and report how many bytes the client copies per byte delivered.
+ * usage: bench_recv [file size MB] [read size KB] [read depth]
+ *                   [limits@openssh.com max-read KB, 0 for none]
+ * @version 0.1
+ * @date 2022-10-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "fake_server.h"
+#include "libsftp/libsftp.h"
+#include "libsftp/session.h"
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    struct fake_server srv = {0};
+    ssh_session session = NULL;
+    sftp_session sftp = NULL;
+    sftp_file file = NULL;
+    uint64_t file_mb = argc > 1 ? strtoull(argv[1], NULL, 10) : 256;
+    uint32_t read_kb = argc > 2 ? strtoul(argv[2], NULL, 10) : 1024;
+    uint32_t depth = argc > 3 ? strtoul(argv[3], NULL, 10) : 16;
+    uint32_t limits_kb = argc > 4 ? strtoul(argv[4], NULL, 10) : 0;
+    struct sftp_limits_struct limits;
+    uint64_t delivered = 0;
+    uint64_t socket_bytes, copied_bytes;
+    uint8_t *buf;
+    int32_t nread;
+    int32_t i;
+    double start, elapsed;
+    int fd;
+
+    srv.opts.file_size = file_mb << 20;
+    srv.opts.limits_io = limits_kb << 10;
+    buf = malloc(read_kb << 10);
+    if (buf == NULL || fake_server_start(&srv, &fd) < 0) {
+        fprintf(stderr, "can not start server\n");
+        return 1;
+    }
+
+    session = ssh_new();
+    if (session == NULL) return 1;
+    ssh_socket_set_fd(session->socket, fd);
+
+    sftp = sftp_new(session);
+    if (sftp == NULL || sftp_init(sftp) != SSH_OK ||
+        sftp_set_read_depth(sftp, depth) != SSH_OK) {
+        fprintf(stderr, "sftp setup failed: %s\n", ssh_get_error());
+        return 1;
+    }
+
+    file = sftp_open(sftp, "bench", O_RDONLY, 0);
+    if (file == NULL) {
+        fprintf(stderr, "open failed: %s\n", ssh_get_error());
+        return 1;
+    }
+
+    /* count the download only */
+    socket_bytes = session->stats.socket_bytes;
+    copied_bytes = session->stats.copied_bytes;
+
+    start = now();
+    while ((nread = sftp_read(file, buf, read_kb << 10)) > 0) {
+        for (i = 0; i < nread; i += 4096) {
+            if (buf[i] != fake_server_byte(delivered + i)) {
+                fprintf(stderr, "corrupt data at offset %lu\n",
+                        (unsigned long)(delivered + i));
+                return 1;
+            }
+        }
+        delivered += nread;
+    }
+    elapsed = now() - start;
+    if (nread < 0) {
+        fprintf(stderr, "read failed: %s\n", ssh_get_error());
+        return 1;
+    }
+
+    socket_bytes = session->stats.socket_bytes - socket_bytes;
+    copied_bytes = session->stats.copied_bytes - copied_bytes;
+
+    sftp_get_limits(sftp, &limits);
+    printf("request size   %lu bytes\n",
+           (unsigned long)limits.max_read_length);
+    printf("delivered      %lu bytes in %.3f s (%.1f MB/s)\n",
+           (unsigned long)delivered, elapsed, delivered / elapsed / 1e6);
+    printf("socket bytes   %.4f per byte delivered\n",
+           (double)socket_bytes / delivered);
+    printf("copied bytes   %.4f per byte delivered\n",
+           (double)copied_bytes / delivered);
+
+    sftp_close(file);
+    sftp_free(sftp);
+    fake_server_join(&srv);
+    ssh_free(session);
+    free(buf);
+
+    return delivered == srv.opts.file_size ? 0 : 1;
+}
@@ -0,0 +1,894 @@
+/**
+ * @file fake_server.c
+ * @brief In-process SSH/SFTP peer for benchmarks.
+ * Only what the client needs is implemented: channel open and requests,
+ * window accounting, and SFTP INIT, OPEN, READ, WRITE, CLOSE, directory
+ * listing and the STAT family, fsync, and hashing through check-file or
+ * exec.
+ * @version 0.1
+ * @date 2022-10-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#include "fake_server.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+#include "libsftp/libsftp.h"
+#include "libsftp/libssh.h"
+
+#define SERVER_WINDOW 0x40000000
+/* server channel numbers of the SFTP channel and of the exec channel */
+#define SFTP_CHANNEL 0
+#define EXEC_CHANNEL 1
+#define MAX_DIRS 256
+#define NAMES_PER_BATCH 100
+
+/* a growable byte queue */
+struct bytes {
+    uint8_t *data;
+    size_t head;
+    size_t len;
+    size_t alloc;
+};
+
+struct server_state {
+    struct fake_server *srv;
+    uint32_t remote_channel;
+    uint32_t window;    /* bytes the client lets us send */
+    uint32_t maxpacket; /* client channel max packet */
+    struct bytes in;    /* SFTP bytes received, not processed yet */
+    struct bytes out;   /* outgoing SSH payload */
+    struct bytes pkt;   /* incoming SSH packet */
+    struct bytes frame; /* outgoing SSH packet */
+    struct bytes msg;   /* outgoing SFTP packet */
+    struct bytes raw;   /* bytes read while blocked on writing */
+    bool opened;        /* the SFTP channel is open */
+    bool closed;
+    uint32_t exec_channel; /* client number of the exec channel */
+    uint32_t handles;      /* open file handles "h<number>" */
+
+    /* open directory handles "D<index>" */
+    struct {
+        bool used;
+        uint32_t pos;
+        uint32_t subdirs;
+    } dirs[MAX_DIRS];
+};
+
+static int bytes_reserve(struct bytes *b, size_t len) {
+    uint8_t *data;
+    size_t alloc;
+
+    if (b->head > 0 && b->head + b->len + len > b->alloc) {
+        memmove(b->data, b->data + b->head, b->len);
+        b->head = 0;
+    }
+    if (b->len + len <= b->alloc) return 0;
+
+    alloc = b->alloc ? b->alloc : 4096;
+    while (alloc < b->len + len) alloc *= 2;
+    data = realloc(b->data, alloc);
+    if (data == NULL) return -1;
+    b->data = data;
+    b->alloc = alloc;
+    return 0;
+}
+
+static int bytes_add(struct bytes *b, const void *data, size_t len) {
+    if (bytes_reserve(b, len) < 0) return -1;
+    memcpy(b->data + b->head + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+static int bytes_u8(struct bytes *b, uint8_t v) { return bytes_add(b, &v, 1); }
+
+static int bytes_u32(struct bytes *b, uint32_t v) {
+    v = htonl(v);
+    return bytes_add(b, &v, sizeof(v));
+}
+
+static int bytes_str(struct bytes *b, const void *data, uint32_t len) {
+    if (bytes_u32(b, len) < 0) return -1;
+    return bytes_add(b, data, len);
+}
+
+static void bytes_clear(struct bytes *b) { b->head = b->len = 0; }
+
+static void bytes_free(struct bytes *b) {
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
+
+/* a read cursor */
+struct cursor {
+    const uint8_t *p;
+    size_t left;
+    bool bad;
+};
+
+static uint8_t get_u8(struct cursor *c) {
+    if (c->left < 1) {
+        c->bad = true;
+        return 0;
+    }
+    c->left--;
+    return *c->p++;
+}
+
+static uint32_t get_u32(struct cursor *c) {
+    uint32_t v;
+    if (c->left < sizeof(v)) {
+        c->bad = true;
+        return 0;
+    }
+    memcpy(&v, c->p, sizeof(v));
+    c->p += sizeof(v);
+    c->left -= sizeof(v);
+    return ntohl(v);
+}
+
+static uint64_t get_u64(struct cursor *c) {
+    uint64_t hi = get_u32(c);
+    return (hi << 32) | get_u32(c);
+}
+
+static const uint8_t *get_str(struct cursor *c, uint32_t *len) {
+    const uint8_t *p;
+
+    *len = get_u32(c);
+    if (c->bad || c->left < *len) {
+        c->bad = true;
+        return NULL;
+    }
+    p = c->p;
+    c->p += *len;
+    c->left -= *len;
+    return p;
+}
+
+/**
+ * @brief Read exactly `len` bytes, taking what `write_full` stashed first.
+ */
+static int read_full(struct server_state *st, void *buf, size_t len) {
+    size_t n = st->raw.len < len ? st->raw.len : len;
+    struct pollfd pfd;
+    bool idle;
+    ssize_t r;
+
+    memcpy(buf, st->raw.data + st->raw.head, n);
+    st->raw.head += n;
+    st->raw.len -= n;
+    buf = (uint8_t *)buf + n;
+    len -= n;
+
+    while (len > 0) {
+        pfd.fd = st->srv->fd;
+        pfd.events = POLLIN;
+        idle = st->srv->opts.rtt_us > 0 && poll(&pfd, 1, 0) == 0;
+        r = read(st->srv->fd, buf, len);
+        if (r <= 0) return -1;
+        if (idle) usleep(st->srv->opts.rtt_us);
+        buf = (uint8_t *)buf + r;
+        len -= r;
+    }
+    return 0;
+}
+
+/**
+ * @brief Write all of `buf`. While the client does not take it, whatever
+ * the client sends is stashed for `read_full`, as a real server keeps
+ * reading while its output is blocked; otherwise a client writing with
+ * replies in flight would deadlock with us.
+ */
+static int write_full(struct server_state *st, const void *buf, size_t len) {
+    struct pollfd pfd;
+    uint8_t chunk[65536];
+    ssize_t n;
+
+    while (len > 0) {
+        n = send(st->srv->fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n > 0) {
+            buf = (const uint8_t *)buf + n;
+            len -= n;
+            continue;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+
+        pfd.fd = st->srv->fd;
+        pfd.events = POLLIN | POLLOUT;
+        if (poll(&pfd, 1, -1) < 0) return -1;
+        if ((pfd.revents & POLLIN) && !(pfd.revents & POLLOUT)) {
+            n = read(st->srv->fd, chunk, sizeof(chunk));
+            if (n <= 0) return -1;
+            if (bytes_add(&st->raw, chunk, n) < 0) return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Send `st->out` as an unencrypted SSH binary packet.
+ */
+static int send_packet(struct server_state *st) {
+    uint8_t header[5];
+    uint8_t padding[16] = {0};
+    uint32_t len = st->out.len;
+    uint8_t pad = 8 - (len + sizeof(header)) % 8;
+
+    if (pad < 4) pad += 8;
+    *(uint32_t *)header = htonl(len + 1 + pad);
+    header[4] = pad;
+
+    /* one write per packet, small writes cost much more socket buffer than
+     * their bytes */
+    bytes_clear(&st->frame);
+    if (bytes_add(&st->frame, header, sizeof(header)) < 0 ||
+        bytes_add(&st->frame, st->out.data + st->out.head, len) < 0 ||
+        bytes_add(&st->frame, padding, pad) < 0 ||
+        write_full(st, st->frame.data, st->frame.len) < 0) {
+        return -1;
+    }
+    bytes_clear(&st->out);
+    return 0;
+}
+
+/**
+ * @brief Receive an SSH binary packet into `st->pkt`.
+ */
+static int recv_packet(struct server_state *st, struct cursor *c) {
+    uint32_t len;
+    uint8_t pad;
+
+    if (read_full(st, &len, sizeof(len)) < 0) return -1;
+    len = ntohl(len);
+    if (len < 5 || len > 0x100000) return -1;
+
+    bytes_clear(&st->pkt);
+    if (bytes_reserve(&st->pkt, len) < 0) return -1;
+    if (read_full(st, st->pkt.data, len) < 0) return -1;
+
+    pad = st->pkt.data[0];
+    if (pad + 1u > len) return -1;
+    c->p = st->pkt.data + 1;
+    c->left = len - 1 - pad;
+    c->bad = false;
+    return 0;
+}
+
+/**
+ * @brief The served content at `offset`, `fake_server_byte` outside of the
+ * holes of `opts.hole_size`.
+ */
+static uint8_t served_byte(const struct fake_server *srv, uint64_t offset) {
+    uint64_t hole = srv->opts.hole_size;
+
+    if (hole > 0 && (offset / hole) % 2 == 1) return 0;
+    return fake_server_byte(offset);
+}
+
+/**
+ * @brief Digest of the served content from `offset` on, `len` bytes or up
+ * to the end of file if `len` is 0.
+ */
+static int fake_digest(struct fake_server *srv, const char *algorithm,
+                       uint64_t offset, uint64_t len, uint8_t *md,
+                       unsigned int *md_len) {
+    const EVP_MD *type = EVP_get_digestbyname(algorithm);
+    EVP_MD_CTX *ctx;
+    uint8_t chunk[4096];
+    uint64_t end = srv->opts.file_size;
+    uint32_t n;
+    uint32_t i;
+    int rc;
+
+    if (type == NULL) return -1;
+    if (len > 0 && offset < end && len < end - offset) end = offset + len;
+
+    ctx = EVP_MD_CTX_new();
+    if (ctx == NULL) return -1;
+    rc = EVP_DigestInit_ex(ctx, type, NULL) == 1 ? 0 : -1;
+    while (rc == 0 && offset < end) {
+        n = end - offset < sizeof(chunk) ? end - offset : sizeof(chunk);
+        for (i = 0; i < n; i++) chunk[i] = served_byte(srv, offset + i);
+        EVP_DigestUpdate(ctx, chunk, n);
+        offset += n;
+    }
+    if (rc == 0 && EVP_DigestFinal_ex(ctx, md, md_len) != 1) rc = -1;
+    EVP_MD_CTX_free(ctx);
+    srv->hashes++;
+    return rc;
+}
+
+/**
+ * @brief Run a hash command on the exec channel: acknowledge the request,
+ * send the `<algorithm>sum` output, then EOF and CLOSE. Anything else
+ * produces no output.
+ */
+static int run_exec(struct server_state *st, struct cursor *c, bool want) {
+    const uint8_t *data;
+    uint8_t md[EVP_MAX_MD_SIZE];
+    unsigned int md_len;
+    char cmd[4096];
+    char out[2 * EVP_MAX_MD_SIZE + 4];
+    char *p;
+    uint64_t offset = 0;
+    uint64_t len = 0;
+    uint32_t n;
+    unsigned int i;
+    int out_len = 0;
+
+    data = get_str(c, &n);
+    if (c->bad || n >= sizeof(cmd)) return -1;
+    memcpy(cmd, data, n);
+    cmd[n] = '\0';
+
+    if (want) {
+        bytes_u8(&st->out, SSH_MSG_CHANNEL_SUCCESS);
+        bytes_u32(&st->out, st->exec_channel);
+        if (send_packet(st) < 0) return -1;
+    }
+
+    if ((p = strstr(cmd, "tail -c +")) != NULL) {
+        offset = strtoull(p + 9, NULL, 10) - 1;
+    }
+    if ((p = strstr(cmd, "head -c ")) != NULL) {
+        len = strtoull(p + 8, NULL, 10);
+    }
+    p = strrchr(cmd, ' ');
+    n = p == NULL ? 0 : strlen(p + 1);
+    if (n > 3 && strcmp(p + 1 + n - 3, "sum") == 0) {
+        p[1 + n - 3] = '\0';
+        if (fake_digest(st->srv, p + 1, offset, len, md, &md_len) == 0) {
+            for (i = 0; i < md_len; i++) {
+                out_len += sprintf(out + out_len, "%02x", md[i]);
+            }
+            out_len += sprintf(out + out_len, "  -\n");
+        }
+    }
+
+    if (out_len > 0) {
+        bytes_u8(&st->out, SSH_MSG_CHANNEL_DATA);
+        bytes_u32(&st->out, st->exec_channel);
+        bytes_str(&st->out, out, out_len);
+        if (send_packet(st) < 0) return -1;
+    }
+    bytes_u8(&st->out, SSH_MSG_CHANNEL_EOF);
+    bytes_u32(&st->out, st->exec_channel);
+    if (send_packet(st) < 0) return -1;
+    bytes_u8(&st->out, SSH_MSG_CHANNEL_CLOSE);
+    bytes_u32(&st->out, st->exec_channel);
+    return send_packet(st);
+}
+
+/**
+ * @brief Handle one connection layer message. Channel data is queued in
+ * `st->in` for `process_sftp`.
+ */
+static int handle_message(struct server_state *st, struct cursor *c) {
+    uint8_t type = get_u8(c);
+    uint32_t recipient;
+    uint32_t sender;
+    uint32_t len;
+    const uint8_t *data;
+    uint8_t want;
+
+    switch (type) {
+        case SSH_MSG_CHANNEL_OPEN:
+            get_str(c, &len);
+            sender = get_u32(c);
+            if (c->bad) return -1;
+            if (st->opened) {
+                if (!st->srv->opts.exec) {
+                    bytes_u8(&st->out, SSH_MSG_CHANNEL_OPEN_FAILURE);
+                    bytes_u32(&st->out, sender);
+                    bytes_u32(&st->out, 1); /* administratively prohibited */
+                    bytes_str(&st->out, "", 0);
+                    bytes_str(&st->out, "", 0);
+                    return send_packet(st);
+                }
+                st->exec_channel = sender;
+                recipient = EXEC_CHANNEL;
+            } else {
+                st->remote_channel = sender;
+                st->window = get_u32(c);
+                st->maxpacket = get_u32(c);
+                if (c->bad) return -1;
+                st->opened = true;
+                recipient = SFTP_CHANNEL;
+            }
+            bytes_u8(&st->out, SSH_MSG_CHANNEL_OPEN_CONFIRMATION);
+            bytes_u32(&st->out, sender);
+            bytes_u32(&st->out, recipient);
+            bytes_u32(&st->out, SERVER_WINDOW);
+            bytes_u32(&st->out, st->srv->opts.max_packet);
+            return send_packet(st);
+        case SSH_MSG_CHANNEL_REQUEST:
+            recipient = get_u32(c);
+            get_str(c, &len);
+            want = get_u8(c);
+            if (c->bad) return -1;
+            if (recipient == EXEC_CHANNEL) return run_exec(st, c, want);
+            if (!want) return 0;
+            bytes_u8(&st->out, SSH_MSG_CHANNEL_SUCCESS);
+            bytes_u32(&st->out, st->remote_channel);
+            return send_packet(st);
+        case SSH_MSG_CHANNEL_WINDOW_ADJUST:
+            recipient = get_u32(c);
+            len = get_u32(c);
+            if (recipient == SFTP_CHANNEL) st->window += len;
+            return c->bad ? -1 : 0;
+        case SSH_MSG_CHANNEL_DATA:
+            recipient = get_u32(c);
+            data = get_str(c, &len);
+            if (c->bad) return -1;
+            if (recipient != SFTP_CHANNEL) return 0;
+            return bytes_add(&st->in, data, len);
+        case SSH_MSG_CHANNEL_EOF:
+            return 0;
+        case SSH_MSG_CHANNEL_CLOSE:
+            /* the exec channel is closed from here once the output is out */
+            if (get_u32(c) == EXEC_CHANNEL) return 0;
+            bytes_u8(&st->out, SSH_MSG_CHANNEL_CLOSE);
+            bytes_u32(&st->out, st->remote_channel);
+            st->closed = true;
+            return send_packet(st);
+        default:
+            fprintf(stderr, "fake server: unexpected message %u\n", type);
+            return -1;
+    }
+}
+
+/**
+ * @brief Send SFTP bytes on the channel, split at the client's max packet
+ * and within its window.
+ */
+static int channel_send(struct server_state *st, const uint8_t *data,
+                        uint32_t len) {
+    struct cursor c;
+    uint32_t n;
+
+    while (len > 0) {
+        while (st->window == 0) {
+            /* queue whatever arrives until the client opens its window */
+            if (recv_packet(st, &c) < 0 || handle_message(st, &c) < 0) {
+                return -1;
+            }
+        }
+
+        n = len;
+        if (n > st->window) n = st->window;
+        if (n > st->maxpacket) n = st->maxpacket;
+
+        bytes_u8(&st->out, SSH_MSG_CHANNEL_DATA);
+        bytes_u32(&st->out, st->remote_channel);
+        bytes_str(&st->out, data, n);
+        if (send_packet(st) < 0) return -1;
+
+        st->window -= n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int send_reply(struct server_state *st, struct bytes *reply,
+                      uint8_t type) {
+    uint8_t header[5];
+
+    *(uint32_t *)header = htonl(reply->len + 1);
+    header[4] = type;
+    bytes_clear(&st->msg);
+    if (bytes_add(&st->msg, header, sizeof(header)) < 0 ||
+        bytes_add(&st->msg, reply->data + reply->head, reply->len) < 0) {
+        return -1;
+    }
+    return channel_send(st, st->msg.data, st->msg.len);
+}
+
+static int send_status(struct server_state *st, struct bytes *reply,
+                       uint32_t id, uint32_t code) {
+    bytes_u32(reply, id);
+    bytes_u32(reply, code);
+    bytes_str(reply, "", 0);
+    bytes_str(reply, "", 0);
+    return send_reply(st, reply, SSH_FXP_STATUS);
+}
+
+/**
+ * @brief Index of a directory handle "D<index>", which is not NUL terminated
+ * in the packet.
+ */
+static uint32_t dir_index(const uint8_t *data, uint32_t len) {
+    uint32_t i = 0;
+    uint32_t k;
+
+    for (k = 1; k < len && data[k] >= '0' && data[k] <= '9'; k++) {
+        i = i * 10 + data[k] - '0';
+    }
+    return i % MAX_DIRS;
+}
+
+static uint32_t memchr_count(const uint8_t *data, uint32_t len, uint8_t c) {
+    uint32_t n = 0;
+    uint32_t i;
+
+    for (i = 0; i < len; i++) n += data[i] == c;
+    return n;
+}
+
+/**
+ * @brief Answer SSH_FXP_READDIR with the next batch of directory `i`.
+ */
+static int send_names(struct server_state *st, struct bytes *reply,
+                      uint32_t id, uint32_t i) {
+    struct fake_server *srv = st->srv;
+    uint32_t total = st->dirs[i].subdirs + srv->opts.dir_files;
+    uint32_t count = total - st->dirs[i].pos;
+    uint32_t pos;
+    bool isdir;
+    char name[16];
+    int len;
+
+    if (count == 0) return send_status(st, reply, id, SSH_FX_EOF);
+    if (count > NAMES_PER_BATCH) count = NAMES_PER_BATCH;
+
+    bytes_u32(reply, id);
+    bytes_u32(reply, count);
+    for (pos = st->dirs[i].pos; pos < st->dirs[i].pos + count; pos++) {
+        isdir = pos < st->dirs[i].subdirs;
+        len = snprintf(name, sizeof(name), "%c%07u", isdir ? 'd' : 'f',
+                       isdir ? pos : pos - st->dirs[i].subdirs);
+        bytes_str(reply, name, len);
+        bytes_str(reply, name, len);
+        bytes_u32(reply, SSH_FILEXFER_ATTR_SIZE |
+                             SSH_FILEXFER_ATTR_PERMISSIONS);
+        bytes_u32(reply, isdir ? 0 : srv->opts.file_size >> 32);
+        bytes_u32(reply, isdir ? 4096 : srv->opts.file_size);
+        bytes_u32(reply, isdir ? 040755 : 0100644);
+    }
+    st->dirs[i].pos += count;
+
+    return send_reply(st, reply, SSH_FXP_NAME);
+}
+
+/**
+ * @brief Answer check-file-handle or check-file-name, the same way for every
+ * file.
+ */
+static int send_check_file(struct server_state *st, struct cursor *c,
+                           struct bytes *reply, uint32_t id) {
+    const uint8_t *data;
+    uint8_t md[EVP_MAX_MD_SIZE];
+    unsigned int md_len;
+    char algorithm[32];
+    uint64_t offset;
+    uint64_t len;
+    uint64_t end;
+    uint32_t block_size;
+    uint32_t n;
+
+    get_str(c, &n);
+    data = get_str(c, &n);
+    offset = get_u64(c);
+    len = get_u64(c);
+    block_size = get_u32(c);
+    if (c->bad) return -1;
+    if (n >= sizeof(algorithm)) n = sizeof(algorithm) - 1;
+    memcpy(algorithm, data, n);
+    algorithm[n] = '\0';
+
+    if (EVP_get_digestbyname(algorithm) == NULL) {
+        return send_status(st, reply, id, SSH_FX_OP_UNSUPPORTED);
+    }
+    bytes_u32(reply, id);
+    bytes_str(reply, "check-file", 10);
+    bytes_str(reply, algorithm, n);
+    if (block_size == 0) {
+        if (fake_digest(st->srv, algorithm, offset, len, md, &md_len) < 0) {
+            return -1;
+        }
+        bytes_add(reply, md, md_len);
+        return send_reply(st, reply, SSH_FXP_EXTENDED_REPLY);
+    }
+
+    /* a hash of each block, up to the end of file */
+    end = st->srv->opts.file_size;
+    if (len > 0 && offset < end && len < end - offset) end = offset + len;
+    for (; offset < end; offset += block_size) {
+        if (fake_digest(st->srv, algorithm, offset,
+                        end - offset < block_size ? end - offset : block_size,
+                        md, &md_len) < 0) {
+            return -1;
+        }
+        bytes_add(reply, md, md_len);
+    }
+    return send_reply(st, reply, SSH_FXP_EXTENDED_REPLY);
+}
+
+/**
+ * @brief Answer one SFTP request.
+ */
+static int handle_sftp(struct server_state *st, uint8_t type,
+                       struct cursor *c, struct bytes *reply) {
+    struct fake_server *srv = st->srv;
+    uint32_t id = get_u32(c);
+    uint64_t offset;
+    uint64_t size;
+    uint32_t len;
+    uint32_t i;
+    uint8_t *data;
+    char handle[16];
+
+    bytes_clear(reply);
+
+    switch (type) {
+        case SSH_FXP_INIT:
+            bytes_u32(reply, LIBSFTP_VERSION);
+            if (srv->opts.limits_io > 0) {
+                bytes_str(reply, "limits@openssh.com", 18);
+                bytes_str(reply, "1", 1);
+            }
+            if (srv->opts.copy_data) {
+                bytes_str(reply, "copy-data", 9);
+                bytes_str(reply, "1", 1);
+            }
+            if (srv->opts.fsync) {
+                bytes_str(reply, "fsync@openssh.com", 17);
+                bytes_str(reply, "1", 1);
+            }
+            if (srv->opts.check_file) {
+                bytes_str(reply, "check-file-handle", 17);
+                bytes_str(reply, "1", 1);
+                bytes_str(reply, "check-file-name", 15);
+                bytes_str(reply, "1", 1);
+            }
+            return send_reply(st, reply, SSH_FXP_VERSION);
+        case SSH_FXP_EXTENDED:
+            data = (uint8_t *)get_str(c, &len);
+            if (c->bad) return -1;
+            if (srv->opts.copy_data && len == 9 &&
+                memcmp(data, "copy-data", 9) == 0) {
+                get_str(c, &len);
+                offset = get_u64(c);
+                size = get_u64(c);
+                get_str(c, &len);
+                get_u64(c);
+                if (c->bad) return -1;
+                if (offset < srv->opts.file_size &&
+                    (size == 0 || size > srv->opts.file_size - offset)) {
+                    size = srv->opts.file_size - offset;
+                }
+                if (offset < srv->opts.file_size) srv->bytes_copied += size;
+                return send_status(st, reply, id, SSH_FX_OK);
+            }
+            if (srv->opts.fsync && len == 17 &&
+                memcmp(data, "fsync@openssh.com", 17) == 0) {
+                get_str(c, &len);
+                if (c->bad) return -1;
+                srv->fsyncs++;
+                srv->bytes_synced = srv->bytes_written;
+                return send_status(st, reply, id, SSH_FX_OK);
+            }
+            if (srv->opts.check_file &&
+                ((len == 17 && memcmp(data, "check-file-handle", 17) == 0) ||
+                 (len == 15 && memcmp(data, "check-file-name", 15) == 0))) {
+                return send_check_file(st, c, reply, id);
+            }
+            if (srv->opts.limits_io == 0 || len != 18 ||
+                memcmp(data, "limits@openssh.com", 18) != 0) {
+                return send_status(st, reply, id, SSH_FX_OP_UNSUPPORTED);
+            }
+            bytes_u32(reply, id);
+            bytes_u32(reply, 0);
+            bytes_u32(reply, srv->opts.limits_io + 1024); /* packet */
+            for (i = 0; i < 2; i++) {
+                bytes_u32(reply, 0);
+                bytes_u32(reply, srv->opts.limits_io); /* read, write */
+            }
+            bytes_u32(reply, 0);
+            bytes_u32(reply, srv->opts.max_handles); /* open handles */
+            return send_reply(st, reply, SSH_FXP_EXTENDED_REPLY);
+        case SSH_FXP_OPEN:
+            if (srv->opts.max_handles > 0 &&
+                st->handles >= srv->opts.max_handles) {
+                return send_status(st, reply, id, SSH_FX_FAILURE);
+            }
+            if (++st->handles > srv->handles_peak) {
+                srv->handles_peak = st->handles;
+            }
+            srv->files_opened++;
+            bytes_u32(reply, id);
+            len = snprintf(handle, sizeof(handle), "h%lu",
+                           (unsigned long)srv->files_opened);
+            bytes_str(reply, handle, len);
+            return send_reply(st, reply, SSH_FXP_HANDLE);
+        case SSH_FXP_READ:
+            get_str(c, &len);
+            offset = get_u64(c);
+            len = get_u32(c);
+            if (c->bad) return -1;
+            if (offset >= srv->opts.file_size) {
+                return send_status(st, reply, id, SSH_FX_EOF);
+            }
+            if (len > srv->opts.file_size - offset) {
+                len = srv->opts.file_size - offset;
+            }
+            if (srv->opts.max_read > 0 && len > srv->opts.max_read) {
+                len = srv->opts.max_read;
+            }
+            bytes_u32(reply, id);
+            bytes_u32(reply, len);
+            if (bytes_reserve(reply, len) < 0) return -1;
+            data = reply->data + reply->head + reply->len;
+            for (i = 0; i < len; i++) data[i] = served_byte(srv, offset + i);
+            reply->len += len;
+            srv->bytes_sent += len;
+            return send_reply(st, reply, SSH_FXP_DATA);
+        case SSH_FXP_WRITE:
+            get_str(c, &len);
+            offset = get_u64(c);
+            get_str(c, &len);
+            if (c->bad) return -1;
+            if (srv->opts.fail_writes) {
+                return send_status(st, reply, id, SSH_FX_FAILURE);
+            }
+            srv->bytes_written += len;
+            if (offset + len > srv->write_end) srv->write_end = offset + len;
+            return send_status(st, reply, id, SSH_FX_OK);
+        case SSH_FXP_STAT:
+        case SSH_FXP_LSTAT:
+        case SSH_FXP_FSTAT:
+            bytes_u32(reply, id);
+            bytes_u32(reply, SSH_FILEXFER_ATTR_SIZE |
+                                 SSH_FILEXFER_ATTR_PERMISSIONS);
+            bytes_u32(reply, srv->opts.file_size >> 32);
+            bytes_u32(reply, srv->opts.file_size);
+            bytes_u32(reply, 0100644);
+            return send_reply(st, reply, SSH_FXP_ATTRS);
+        case SSH_FXP_OPENDIR:
+            data = (uint8_t *)get_str(c, &len);
+            if (c->bad) return -1;
+            for (i = 0; i < MAX_DIRS && st->dirs[i].used; i++) continue;
+            if (i == MAX_DIRS) return send_status(st, reply, id, SSH_FX_FAILURE);
+            st->dirs[i].used = true;
+            st->dirs[i].pos = 0;
+            /* subdirectories only above the depth limit */
+            st->dirs[i].subdirs = 0;
+            if (memchr_count(data, len, '/') < srv->opts.dir_depth) {
+                st->dirs[i].subdirs = srv->opts.dir_subdirs;
+            }
+            bytes_u32(reply, id);
+            len = snprintf(handle, sizeof(handle), "D%u", i);
+            bytes_str(reply, handle, len);
+            return send_reply(st, reply, SSH_FXP_HANDLE);
+        case SSH_FXP_READDIR:
+            data = (uint8_t *)get_str(c, &len);
+            if (c->bad || len < 2 || data[0] != 'D') return -1;
+            i = dir_index(data, len);
+            return send_names(st, reply, id, i);
+        case SSH_FXP_CLOSE:
+            data = (uint8_t *)get_str(c, &len);
+            if (!c->bad && len > 1 && data[0] == 'D') {
+                st->dirs[dir_index(data, len)].used = false;
+            } else if (!c->bad && len > 1 && data[0] == 'h' &&
+                       st->handles > 0) {
+                st->handles--;
+            }
+            return send_status(st, reply, id, SSH_FX_OK);
+        case SSH_FXP_REMOVE:
+        case SSH_FXP_RENAME:
+        case SSH_FXP_RMDIR:
+        case SSH_FXP_SETSTAT:
+            srv->paths_changed++;
+            return send_status(st, reply, id, SSH_FX_OK);
+        case SSH_FXP_FSETSTAT:
+            return send_status(st, reply, id, SSH_FX_OK);
+        case SSH_FXP_MKDIR:
+            srv->dirs_created++;
+            return send_status(st, reply, id, SSH_FX_OK);
+        default:
+            return send_status(st, reply, id, SSH_FX_OP_UNSUPPORTED);
+    }
+}
+
+/**
+ * @brief Answer every complete SFTP request queued in `st->in`.
+ */
+static int process_sftp(struct server_state *st, struct bytes *request,
+                        struct bytes *reply) {
+    struct cursor c;
+    uint32_t size;
+    uint8_t *p;
+
+    while (st->in.len >= 5) {
+        p = st->in.data + st->in.head;
+        size = ntohl(*(uint32_t *)p);
+        if (size < 1) return -1;
+        if (st->in.len < 4 + (size_t)size) break;
+
+        /* sending the reply may queue more requests and move `st->in` */
+        bytes_clear(request);
+        if (bytes_add(request, p + 4, size) < 0) return -1;
+        st->in.head += 4 + size;
+        st->in.len -= 4 + size;
+
+        c.p = request->data + 1;
+        c.left = size - 1;
+        c.bad = false;
+        if (handle_sftp(st, request->data[0], &c, reply) < 0) return -1;
+    }
+    return 0;
+}
+
+static void *server_main(void *arg) {
+    struct server_state st;
+    struct bytes request = {0};
+    struct bytes reply = {0};
+    struct cursor c;
+
+    memset(&st, 0, sizeof(st));
+    st.srv = arg;
+
+    while (!st.closed) {
+        if (recv_packet(&st, &c) < 0) break;
+        if (handle_message(&st, &c) < 0) break;
+        if (process_sftp(&st, &request, &reply) < 0) break;
+    }
+
+    bytes_free(&st.in);
+    bytes_free(&st.out);
+    bytes_free(&st.pkt);
+    bytes_free(&st.frame);
+    bytes_free(&st.msg);
+    bytes_free(&st.raw);
+    bytes_free(&request);
+    bytes_free(&reply);
+    close(st.srv->fd);
+    return NULL;
+}
+
+int fake_server_start(struct fake_server *srv, int *client_fd) {
+    int fds[2];
+
+    if (srv->opts.max_packet == 0) srv->opts.max_packet = 32768;
+    srv->bytes_sent = 0;
+    srv->bytes_written = 0;
+    srv->write_end = 0;
+    srv->paths_changed = 0;
+    srv->files_opened = 0;
+    srv->handles_peak = 0;
+    srv->dirs_created = 0;
+    srv->bytes_copied = 0;
+    srv->hashes = 0;
+    srv->fsyncs = 0;
+    srv->bytes_synced = 0;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) return -1;
+    srv->fd = fds[1];
+    if (pthread_create(&srv->thread, NULL, server_main, srv) != 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    *client_fd = fds[0];
+    return 0;
+}
+
+void fake_server_join(struct fake_server *srv) {
+    pthread_join(srv->thread, NULL);
+}
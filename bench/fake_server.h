@@ -0,0 +1,98 @@
+/**
+ * @file fake_server.h
+ * @brief In-process SSH/SFTP peer for benchmarks.
+ * The server talks unencrypted SSH binary packets over a socketpair, as a
+ * real server does before key exchange, and serves virtual files whose
+ * content is a function of the offset (see `fake_server_byte`), and
+ * virtual directory trees of them.
+ * @version 0.1
+ * @date 2022-10-05
+ *
+ * @copyright Copyright (c) 2022
+ *
+ */
+
+#ifndef FAKE_SERVER_H
+#define FAKE_SERVER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct fake_server_opts {
+    uint64_t file_size; /* size of every file served */
+    uint32_t max_read;  /* cap on SSH_FXP_DATA length, 0 for none */
+    uint32_t max_packet; /* channel max packet advertised to the client */
+    /* max-read and max-write of limits@openssh.com, 0 to not offer it */
+    uint32_t limits_io;
+    bool copy_data; /* offer the copy-data extension */
+    bool check_file; /* offer check-file-handle and check-file-name */
+    bool fsync;      /* offer fsync@openssh.com */
+    bool fail_writes; /* answer every WRITE with SSH_FX_FAILURE */
+    /* accept session channels besides the SFTP one that exec
+     * `test ... && tail -c +N ... [| head -c L] | <algorithm>sum` */
+    bool exec;
+    /* microseconds added each time the server has to wait for the client,
+     * as a round trip would; requests sent together pay it once */
+    uint32_t rtt_us;
+    /* max-open-handles of limits@openssh.com, beyond which file OPENs fail,
+     * 0 for none */
+    uint32_t max_handles;
+    /* served files read as zeros in every second run of `hole_size` bytes,
+     * 0 for none */
+    uint64_t hole_size;
+
+    /* every directory holds `dir_files` files named f0000000, f0000001, ...
+     * and, above `dir_depth` levels of slashes in its path, `dir_subdirs`
+     * directories named d0000000, ... */
+    uint32_t dir_files;
+    uint32_t dir_subdirs;
+    uint32_t dir_depth;
+};
+
+struct fake_server {
+    struct fake_server_opts opts;
+    int fd;
+    pthread_t thread;
+
+    /* counters, valid after `fake_server_join` */
+    uint64_t bytes_sent;    /* SFTP file data sent */
+    uint64_t bytes_written; /* SFTP file data received */
+    uint64_t write_end;     /* end of the furthest WRITE */
+    uint64_t files_opened;
+    uint64_t handles_peak;  /* file handles open at once at most */
+    uint64_t dirs_created;
+    uint64_t paths_changed; /* REMOVE, RENAME, RMDIR and SETSTAT requests */
+    uint64_t bytes_copied;  /* SFTP file data copied with copy-data */
+    uint64_t hashes;        /* check-file requests and hash commands */
+    uint64_t fsyncs;
+    uint64_t bytes_synced;  /* bytes_written as of the last fsync */
+};
+
+/**
+ * @brief Start the server in a thread.
+ *
+ * @param srv
+ * @param client_fd the client end of the connection
+ * @return 0 on success, -1 on error.
+ */
+int fake_server_start(struct fake_server *srv, int *client_fd);
+
+/**
+ * @brief Wait until the client has closed the channel or the connection.
+ *
+ * @param srv
+ */
+void fake_server_join(struct fake_server *srv);
+
+/**
+ * @brief The content of every served file at `offset`.
+ *
+ * @param offset
+ * @return uint8_t
+ */
+static inline uint8_t fake_server_byte(uint64_t offset) {
+    return (uint8_t)(offset ^ (offset >> 8) ^ (offset >> 16));
+}
+
+#endif /* FAKE_SERVER_H */
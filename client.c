@@ -17,7 +17,10 @@
 #include <unistd.h>
 #include "libsftp/libsftp.h"
 
-#define MAX_BUF_SIZE 16384
+/* the fscanf() widths below are MAX_PATH_LEN - 1 */
+#define MAX_PATH_LEN 4096
+/* block hash of delta_put_file() where the server offers check-file */
+#define DELTA_HASH "sha1"
 
 void prompt() {
     fprintf(stdout, "%s", "sftp> ");
@@ -32,17 +35,16 @@ char* strip_filename(char* filename) {
     return filename;
 }
 
-int get_file(sftp_session sftp) {
-    char filename[51];
+int get_file(sftp_session sftp, int resume) {
+    char filename[MAX_PATH_LEN];
     char* stripped_name = NULL;
     sftp_file file = NULL;
-    char buffer[MAX_BUF_SIZE];
-    int nbytes, nwritten, rc;
+    int rc;
     int fd;
 
     fprintf(stdout, "%s", "Enter filename: ");
     fflush(stdout);
-    fscanf(stdin, "%50s", filename);
+    fscanf(stdin, "%4095s", filename);
     stripped_name = strip_filename(filename);
 
     file = sftp_open(sftp, filename, O_RDONLY, 0);
@@ -52,31 +54,28 @@ int get_file(sftp_session sftp) {
     }
 
 
-    fd = open(stripped_name, O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    fd = open(stripped_name, O_RDWR | O_CREAT | (resume ? 0 : O_TRUNC),
+              S_IRWXU);
     if (fd < 0) {
         sftp_close(file);
         fprintf(stderr, "Can't open file for writing: %s\n", strerror(errno));
         return -1;
     }
 
-    while (1) {
-        nbytes = sftp_read(file, buffer, sizeof(buffer));
-        if (nbytes == 0) {
-            break; /* EOF */
-        } else if (nbytes < 0) {
-            fprintf(stderr, "Error while reading file: %s\n", ssh_get_error());
-            sftp_close(file);
-            close(fd);
-            return -1;
-        }
+    if (resume && sftp_resume_get(file, fd, SFTP_RESUME_VERIFY) < 0) {
+        fprintf(stderr, "Can't resume download: %s\n", ssh_get_error());
+        sftp_close(file);
+        close(fd);
+        return -1;
+    }
 
-        nwritten = write(fd, buffer, nbytes);
-        if (nwritten != nbytes) {
-            fprintf(stderr, "Error writing: %s\n", strerror(errno));
-            sftp_close(file);
-            close(fd);
-            return -1;
-        }
+    /* zero blocks become holes instead of written zeros */
+    if (sftp_get_file(file, fd, 0, SFTP_GET_SPARSE) < 0) {
+        fprintf(stderr, "Error while downloading file: %s\n",
+                ssh_get_error());
+        sftp_close(file);
+        close(fd);
+        return -1;
     }
 
     fprintf(stdout, "%s downloaded to the current working direcrtory\n", stripped_name);
@@ -91,20 +90,22 @@ int get_file(sftp_session sftp) {
     return 0;
 }
 
-int put_file(sftp_session sftp) {
-    char filename[51];
+int put_file(sftp_session sftp, int resume) {
+    char filename[MAX_PATH_LEN];
     char* stripped_name = NULL;
     sftp_file file = NULL;
-    char buffer[MAX_BUF_SIZE];
-    int nbytes, nwritten, rc;
+    int rc;
     int fd;
 
     fprintf(stdout, "%s", "Enter filename: ");
     fflush(stdout);
-    fscanf(stdin, "%50s", filename);
+    fscanf(stdin, "%4095s", filename);
     stripped_name = strip_filename(filename);
 
-    file = sftp_open(sftp, stripped_name, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
+    /* resuming keeps the remote data, and reads it back to verify it */
+    file = sftp_open(sftp, stripped_name,
+                     resume ? O_RDWR | O_CREAT : O_WRONLY | O_CREAT | O_TRUNC,
+                     S_IRWXU);
     if (file == NULL) {
         fprintf(stderr, "Can not open remote file %s", stripped_name);
         return -1;
@@ -117,24 +118,20 @@ int put_file(sftp_session sftp) {
         return -1;
     }
 
-    while (1) {
-        nbytes = read(fd, buffer, sizeof(buffer));
-        if (nbytes == 0) {
-            break; /* EOF */
-        } else if (nbytes < 0) {
-            fprintf(stderr, "Error while reading file: %s\n", strerror(errno));
-            sftp_close(file);
-            close(fd);
-            return -1;
-        }
+    if (resume && sftp_resume_put(file, fd, SFTP_RESUME_VERIFY) < 0) {
+        fprintf(stderr, "Can't resume upload: %s\n", ssh_get_error());
+        sftp_close(file);
+        close(fd);
+        return -1;
+    }
 
-        nwritten = sftp_write(file, buffer, nbytes);
-        if (nwritten != nbytes) {
-            fprintf(stderr, "Error writing: %s\n", ssh_get_error());
-            sftp_close(file);
-            close(fd);
-            return -1;
-        }
+    /* holes and zero blocks are not sent; the remote file is new or
+     * truncated, or past the resume offset, so they read as zeros there */
+    if (sftp_put_file(file, fd, 0, SFTP_PUT_SPARSE) < 0) {
+        fprintf(stderr, "Error while uploading file: %s\n", ssh_get_error());
+        sftp_close(file);
+        close(fd);
+        return -1;
     }
 
     fprintf(stdout, "%s uploaded to the remote home directory\n", stripped_name);
@@ -149,6 +146,96 @@ int put_file(sftp_session sftp) {
     return 0;
 }
 
+int delta_put_file(sftp_session sftp) {
+    char filename[MAX_PATH_LEN];
+    char* stripped_name = NULL;
+    sftp_file file = NULL;
+    int64_t sent;
+    int rc;
+    int fd;
+
+    fprintf(stdout, "%s", "Enter filename: ");
+    fflush(stdout);
+    fscanf(stdin, "%4095s", filename);
+    stripped_name = strip_filename(filename);
+
+    /* the remote copy is compared block by block, then updated in place */
+    file = sftp_open(sftp, stripped_name, O_RDWR | O_CREAT, S_IRWXU);
+    if (file == NULL) {
+        fprintf(stderr, "Can not open remote file %s", stripped_name);
+        return -1;
+    }
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Can't open file for reading: %s\n", strerror(errno));
+        sftp_close(file);
+        return -1;
+    }
+
+    sent = sftp_put_delta(file, fd, DELTA_HASH, 0);
+    if (sent < 0) {
+        fprintf(stderr, "Error while updating file: %s\n", ssh_get_error());
+        sftp_close(file);
+        close(fd);
+        return -1;
+    }
+
+    fprintf(stdout, "%s updated in the remote home directory, %ld bytes sent\n",
+            stripped_name, (long)sent);
+
+    rc = sftp_close(file);
+    if (rc != SSH_OK) {
+        fprintf(stderr, "Can't close the remote file: %s\n", ssh_get_error());
+        return -1;
+    }
+    close(fd);
+
+    return 0;
+}
+
+int get_dir(sftp_session sftp) {
+    char dirname[MAX_PATH_LEN];
+    char* stripped_name = NULL;
+
+    fprintf(stdout, "%s", "Enter directory: ");
+    fflush(stdout);
+    fscanf(stdin, "%4095s", dirname);
+    stripped_name = strip_filename(dirname);
+    if (*stripped_name == '\0') stripped_name = dirname;
+
+    if (sftp_get_tree(sftp, dirname, stripped_name) != SSH_OK) {
+        fprintf(stderr, "Can't download directory %s: %s\n", dirname,
+                ssh_get_error());
+        return -1;
+    }
+
+    fprintf(stdout, "%s downloaded to the current working direcrtory\n",
+            stripped_name);
+    return 0;
+}
+
+int put_dir(sftp_session sftp) {
+    char dirname[MAX_PATH_LEN];
+    char* stripped_name = NULL;
+
+    fprintf(stdout, "%s", "Enter directory: ");
+    fflush(stdout);
+    fscanf(stdin, "%4095s", dirname);
+    stripped_name = strip_filename(dirname);
+    if (*stripped_name == '\0') stripped_name = dirname;
+
+    if (sftp_put_tree(sftp, dirname, stripped_name) != SSH_OK) {
+        fprintf(stderr, "Can't upload directory %s: %s\n", dirname,
+                ssh_get_error());
+        return -1;
+    }
+
+    fprintf(stdout, "%s uploaded to the remote home directory\n",
+            stripped_name);
+    return 0;
+}
+
 int main(int argc, char** argv) {
     int rc;
     char password[100];
@@ -213,22 +300,32 @@ int main(int argc, char** argv) {
     while (1) {
         prompt();
         fscanf(stdin, "%10s", cmd);
-        if (strcmp(cmd, "get") == 0) {
-            if (get_file(sftp) != 0) {
+        if (strcmp(cmd, "get") == 0 || strcmp(cmd, "reget") == 0) {
+            if (get_file(sftp, cmd[0] == 'r') != 0) {
+                fprintf(stderr, "%s", ssh_get_error());
+                break;
+            }
+        } else if (strcmp(cmd, "put") == 0 || strcmp(cmd, "reput") == 0) {
+            if (put_file(sftp, cmd[0] == 'r') != 0) {
                 fprintf(stderr, "%s", ssh_get_error());
                 break;
             }
-        } else if (strcmp(cmd, "put") == 0) {
-            if (put_file(sftp) != 0) {
+        } else if (strcmp(cmd, "dput") == 0) {
+            if (delta_put_file(sftp) != 0) {
                 fprintf(stderr, "%s", ssh_get_error());
                 break;
             }
+        } else if (strcmp(cmd, "rget") == 0) {
+            if (get_dir(sftp) != 0) break;
+        } else if (strcmp(cmd, "rput") == 0) {
+            if (put_dir(sftp) != 0) break;
         } else if (strcmp(cmd, "bye") == 0) {
             fprintf(stdout, "%s", "Disconnect\n");
             break;
         } else {
             fprintf(stderr,
-                    "Unsupported command: %s. Only supports 'get' and 'put'\n",
+                    "Unsupported command: %s. Only supports 'get', 'put', "
+                    "'reget', 'reput', 'dput', 'rget' and 'rput'\n",
                     cmd);
         }
     }
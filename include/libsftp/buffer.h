@@ -29,6 +29,8 @@ int ssh_buffer_validate_length(struct ssh_buffer_struct *buffer, size_t len);
 
 void *ssh_buffer_allocate(struct ssh_buffer_struct *buffer, uint32_t len);
 int ssh_buffer_allocate_size(struct ssh_buffer_struct *buffer, uint32_t len);
+int ssh_buffer_reinit_size(struct ssh_buffer_struct *buffer, uint32_t size,
+                           uint32_t headroom);
 int ssh_buffer_pack_va(struct ssh_buffer_struct *buffer,
                        const char *format,
                        size_t argc,
@@ -26,6 +26,30 @@ struct ssh_channel_struct {
     int remote_eof; /* end of file received */
     uint32_t remote_maxpacket;
     ssh_buffer out_buffer;
+
+    /* data received but not read yet, except for the data still in the
+     * session's in_buffer (see `ssh_session_struct.in_pending`): a ring of
+     * `ring_size` bytes, as many as the local window lets the peer send */
+    uint8_t *ring;
+    uint32_t ring_size;
+    uint32_t ring_head;
+    uint32_t ring_len;
+    /* reply to the last SSH_MSG_CHANNEL_OPEN or SSH_MSG_CHANNEL_REQUEST,
+     * 0 while it is awaited */
+    uint8_t reply;
+    int local_close; /* SSH_MSG_CHANNEL_CLOSE sent */
+    int remote_close; /* SSH_MSG_CHANNEL_CLOSE received */
+
+    /* window autotuning, see `channel_autotune` */
+    uint32_t window_size; /* unread data plus local window to keep granted */
+    uint32_t window_max;
+    uint64_t rx_bytes;   /* channel data received so far */
+    uint64_t probe_edge; /* rx_bytes the peer could send before the last
+                            WINDOW_ADJUST, whose send time is probe_us */
+    uint64_t probe_us;   /* 0 while no round trip is being measured */
+    uint64_t rtt_us;     /* shortest round trip measured, 0 until then */
+    uint64_t rate_us;    /* start of the delivery rate interval, and */
+    uint64_t rate_bytes; /* rx_bytes then */
 };
 
 typedef struct ssh_channel_struct *ssh_channel;
@@ -33,8 +57,11 @@ typedef struct ssh_channel_struct *ssh_channel;
 ssh_channel ssh_channel_new(ssh_session session);
 int ssh_channel_open_session(ssh_channel channel);
 int ssh_channel_request_sftp(ssh_channel channel);
+int ssh_channel_request_exec(ssh_channel channel, const char *cmd);
 int ssh_channel_write(ssh_channel channel, const void *data, uint32_t len);
 int ssh_channel_read(ssh_channel channel, void *dest, uint32_t count);
+int ssh_channel_grow_window(ssh_channel channel, uint32_t minimum_size);
+int ssh_channel_poll(ssh_channel channel);
 int ssh_channel_eof(ssh_channel channel);
 int ssh_channel_close(ssh_channel channel);
 void ssh_channel_free(ssh_channel channel);
@@ -110,13 +110,105 @@
 /** No media in remote drive */
 #define SSH_FX_NO_MEDIA 13
 
+/* READ and WRITE size unless the server tells its limits, see
+ * sftp_get_limits() */
 #define SSH_FXP_MAXLEN 32768
 
+/* sftp_get_file() flags */
+/** Allocate the local file up front; the local size then no longer tells
+ * the progress of an interrupted download, see sftp_resume_get() */
+#define SFTP_GET_PREALLOCATE 0x01
+/** Leave holes in the local file where the remote file has zero blocks */
+#define SFTP_GET_SPARSE 0x02
+
+/* sftp_put_file() flags */
+/** Skip holes and zero blocks of the local file */
+#define SFTP_PUT_SPARSE 0x01
+
+/* sftp_resume_get() and sftp_resume_put() flags */
+/** Compare the last bytes both ends have before resuming */
+#define SFTP_RESUME_VERIFY 0x01
+/** Bytes compared by SFTP_RESUME_VERIFY */
+#define SFTP_RESUME_TAIL 65536
+
+/* sftp_batch() operations */
+/** SSH_FXP_REMOVE of `path` */
+#define SFTP_BATCH_REMOVE 1
+/** SSH_FXP_RENAME of `path` to `target` */
+#define SFTP_BATCH_RENAME 2
+/** SSH_FXP_MKDIR of `path` with permissions `mode` */
+#define SFTP_BATCH_MKDIR 3
+/** SSH_FXP_RMDIR of `path` */
+#define SFTP_BATCH_RMDIR 4
+/** SSH_FXP_SETSTAT of `path` to `attr` */
+#define SFTP_BATCH_SETSTAT 5
+
+/** sftp_set_fsync_interval() interval that only syncs on sftp_close() */
+#define SFTP_FSYNC_ON_CLOSE UINT64_MAX
+
+/** Largest digest of sftp_hash(), sftp_fhash() and sftp_hash_local() */
+#define SFTP_HASH_MAX 64
+
 typedef struct sftp_session_struct* sftp_session;
 typedef struct sftp_file_struct* sftp_file;
 typedef struct sftp_packet_struct* sftp_packet;
 typedef struct sftp_attributes_struct* sftp_attributes;
 typedef struct sftp_status_struct* sftp_status;
+typedef struct sftp_request_struct* sftp_request;
+typedef struct sftp_dir_struct* sftp_dir;
+
+/**
+ * File attributes, see sftp_stat(). Fields are only valid when their
+ * SSH_FILEXFER_ATTR_* bit is set in `flags`; `type` is derived from the
+ * permissions.
+ */
+/**
+ * Server limits, see sftp_get_limits(). 0 means unknown or unlimited.
+ */
+struct sftp_limits_struct {
+    uint64_t max_packet_length;
+    uint64_t max_read_length;
+    uint64_t max_write_length;
+    uint64_t max_open_handles;
+};
+
+/**
+ * An operation of sftp_batch(), one of SFTP_BATCH_*. `status` is set to the
+ * SSH_FX_* code the server answered with.
+ */
+struct sftp_batch_item {
+    int op;
+    const char *path;
+    const char *target;   /* new path of SFTP_BATCH_RENAME */
+    mode_t mode;          /* permissions of SFTP_BATCH_MKDIR */
+    sftp_attributes attr; /* attributes set by SFTP_BATCH_SETSTAT */
+    uint32_t status;
+};
+
+struct sftp_attributes_struct {
+    char *name;
+    char *longname; /* ls -l output on openssh, not reliable else */
+    uint32_t flags;
+    uint8_t type;
+    uint64_t size;
+    uint32_t uid;
+    uint32_t gid;
+    char *owner; /* set if openssh and version 4 */
+    char *group; /* set if openssh and version 4 */
+    uint32_t permissions;
+    uint64_t atime64;
+    uint32_t atime;
+    uint32_t atime_nseconds;
+    uint64_t createtime;
+    uint32_t createtime_nseconds;
+    uint64_t mtime64;
+    uint32_t mtime;
+    uint32_t mtime_nseconds;
+    ssh_string acl;
+    uint32_t extended_count;
+    ssh_string extended_type;
+    ssh_string extended_data;
+};
 
 
 /**
@@ -126,6 +218,11 @@ typedef struct sftp_status_struct* sftp_status;
  * with the server inside of the provided ssh session. This function call is
  * usually followed by the sftp_init(), which initializes SFTP protocol itself.
  *
+ * The sftp functions wait for the server and need the session to block:
+ * sftp_new() and sftp_init() fail on a session made non-blocking with
+ * ssh_set_blocking(), and so does any sftp call that has to wait for a reply
+ * while it is. Switch the session back before using sftp on it again.
+ *
  * @param session       The ssh session to use.
  *
  * @return              A new sftp session or NULL on error.
@@ -139,6 +236,10 @@ API sftp_session sftp_new(ssh_session session);
  * @brief Close and deallocate a sftp session.
  * Internally, it close the underlying SSH channel.
  *
+ * Request tickets still outstanding are freed with the session: they become
+ * invalid, and must not be passed to sftp_async_*_result(),
+ * sftp_request_poll() or sftp_request_cancel() afterwards.
+ *
  * @param sftp          The sftp session handle to free.
  */
 API void sftp_free(sftp_session sftp);
@@ -157,6 +258,73 @@ API void sftp_free(sftp_session sftp);
  */
 API int sftp_init(sftp_session sftp);
 
+/**
+ * @brief Get the number of extensions the server announced in sftp_init().
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @return              The number of extensions.
+ */
+API unsigned int sftp_extensions_get_count(sftp_session sftp);
+
+/**
+ * @brief Get the name of an extension.
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @param idx           The index of the extension, from 0.
+ *
+ * @return              The name, owned by the session; NULL if `idx` is out
+ *                      of range.
+ */
+API const char *sftp_extensions_get_name(sftp_session sftp,
+                                         unsigned int idx);
+
+/**
+ * @brief Get the data of an extension, usually its version.
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @param idx           The index of the extension, from 0.
+ *
+ * @return              The data, owned by the session; NULL if `idx` is out
+ *                      of range.
+ */
+API const char *sftp_extensions_get_data(sftp_session sftp,
+                                         unsigned int idx);
+
+/**
+ * @brief Check whether the server announced an extension.
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @param name          The name of the extension, e.g. "fsync@openssh.com".
+ *
+ * @param data          The data it must come with, NULL for any.
+ *
+ * @return              1 if supported, 0 otherwise.
+ */
+API int sftp_extension_supported(sftp_session sftp, const char *name,
+                                 const char *data);
+
+/**
+ * @brief Get the limits the session works with.
+ *
+ * If the server offers limits@openssh.com, sftp_init() asks for its limits
+ * and raises the READ and WRITE sizes of the session from SSH_FXP_MAXLEN to
+ * what the server accepts, up to 256 KB, so bulk transfers need fewer
+ * requests. Otherwise they stay at SSH_FXP_MAXLEN.
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @param limits        Set to the limits of the server, except that
+ *                      `max_read_length` and `max_write_length` are the
+ *                      READ and WRITE sizes in use.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+API int sftp_get_limits(sftp_session sftp, struct sftp_limits_struct *limits);
+
 /**
  * @brief Close an open file handle.
  *
@@ -185,6 +353,9 @@ API int sftp_close(sftp_file file);
  *                      exists it is an error and the open will fail.
  *                      O_TRUNC - If the file already exists it will be
  *                      truncated.
+ *                      Without O_TRUNC and O_APPEND an existing file keeps
+ *                      its data and writes go to the file offset, which is
+ *                      how an upload is resumed, see sftp_resume_put().
  *
  * @param mode          Mode specifies the permissions to use if a new file is
  *                      created.  It  is  modified  by  the process's umask in
@@ -201,21 +372,231 @@ API sftp_file sftp_open(sftp_session sftp, const char* file, int accesstype,
 
 /**
  * @brief Get information about a file or directory.
- * @todo Not implemented
+ *
+ * Results, including "no such file", are kept in the attribute cache of the
+ * session for a while, so repeated checks of a path do not cost a round
+ * trip each. Writes, closes and renames made through the session drop the
+ * cached entries of their path.
+ *
  * @param session       The sftp session handle.
  * @param path          The path to the file or directory to obtain the
  *                      information.
  *
  * @return              The sftp attributes structure of the file or directory,
- *                      NULL on error with ssh and sftp error set.
+ *                      NULL on error with ssh and sftp error set. Free it
+ *                      with sftp_attributes_free().
  *
  * @see sftp_get_error()
+ * @see sftp_set_attr_cache()
  */
 API sftp_attributes sftp_stat(sftp_session session, const char *path);
 
+/**
+ * @brief Get information about a file or directory without following
+ * symbolic links.
+ *
+ * @param session       The sftp session handle.
+ * @param path          The path to the file or directory to obtain the
+ *                      information.
+ *
+ * @return              The sftp attributes structure of the file or directory,
+ *                      NULL on error with ssh and sftp error set.
+ *
+ * @see sftp_stat()
+ */
+API sftp_attributes sftp_lstat(sftp_session session, const char *path);
+
+/**
+ * @brief Get information about an opened file. The attribute cache is not
+ * used, the server is always asked.
+ *
+ * @param file          The opened sftp file handle.
+ *
+ * @return              The sftp attributes structure of the file, NULL on
+ *                      error with ssh and sftp error set.
+ *
+ * @see sftp_stat()
+ */
+API sftp_attributes sftp_fstat(sftp_file file);
+
+/**
+ * @brief Free a sftp attributes structure.
+ *
+ * @param attr          The sftp attributes structure to free, may be NULL.
+ */
+API void sftp_attributes_free(sftp_attributes attr);
+
+/**
+ * @brief Open a directory for listing.
+ *
+ * The first SSH_FXP_READDIR is sent right away, and every later one as soon
+ * as the batch before it is taken up, so the next batch is in flight while
+ * the caller goes through the current one. At most two batches are held at a
+ * time, and entries are decoded into storage owned by the directory, so
+ * memory does not grow with the size of the directory.
+ *
+ * @param session       The sftp session handle.
+ *
+ * @param path          The directory to list.
+ *
+ * @return              A directory handle, NULL on error with ssh and sftp
+ *                      error set.
+ *
+ * @see sftp_readdir()
+ * @see sftp_closedir()
+ */
+API sftp_dir sftp_opendir(sftp_session session, const char *path);
+
+/**
+ * @brief Get the next entry of a directory.
+ *
+ * @param dir           The directory handle.
+ *
+ * @return              The entry with `name` and `longname` set. It is owned
+ *                      by the directory and valid until the next call on
+ *                      it; do not free it. NULL at the end of the directory
+ *                      or on error, see sftp_dir_eof().
+ */
+API sftp_attributes sftp_readdir(sftp_dir dir);
+
+/**
+ * @brief Tell the end of a directory from an error of sftp_readdir().
+ *
+ * @param dir           The directory handle.
+ *
+ * @return              1 if every entry has been returned, 0 otherwise.
+ */
+API int sftp_dir_eof(sftp_dir dir);
+
+/**
+ * @brief Close a directory handle and free it.
+ *
+ * @param dir           The directory handle.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+API int sftp_closedir(sftp_dir dir);
+
+/**
+ * @brief Create a directory.
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @param path          The directory to create.
+ *
+ * @param mode          Permissions of the new directory.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error with ssh and
+ *                      sftp error set. An existing directory is an error.
+ */
+API int sftp_mkdir(sftp_session sftp, const char *path, mode_t mode);
+
+/**
+ * @brief Remove a file.
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @param path          The file to remove.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error with ssh and
+ *                      sftp error set.
+ */
+API int sftp_unlink(sftp_session sftp, const char *path);
+
+/**
+ * @brief Remove an empty directory.
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @param path          The directory to remove.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error with ssh and
+ *                      sftp error set.
+ */
+API int sftp_rmdir(sftp_session sftp, const char *path);
+
+/**
+ * @brief Rename a file or directory.
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @param original      The path to rename.
+ *
+ * @param newname       The new path. Most servers fail if it exists.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error with ssh and
+ *                      sftp error set.
+ */
+API int sftp_rename(sftp_session sftp, const char *original,
+                    const char *newname);
+
+/**
+ * @brief Change the attributes of a file or directory.
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @param path          The path to change.
+ *
+ * @param attr          The attributes to set, as flagged in `attr->flags`:
+ *                      size, uid and gid, permissions, access and
+ *                      modification times.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error with ssh and
+ *                      sftp error set.
+ */
+API int sftp_setstat(sftp_session sftp, const char *path,
+                     sftp_attributes attr);
+
+/**
+ * @brief Run many remove, rename, mkdir, rmdir and setstat operations with
+ * up to 256 requests in flight.
+ *
+ * Requests are sent in the order of `items` while earlier ones are
+ * answered, so an operation may depend on an earlier one only if the server
+ * handles requests in order, as OpenSSH does. A failed operation does not
+ * stop the batch. Cached attributes of every path changed, and of the paths
+ * under it, are dropped.
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @param items         The operations, each with its status set on return.
+ *
+ * @param count         Number of items.
+ *
+ * @return              Number of failed operations, with the ssh and sftp
+ *                      error set for the first one, SSH_ERROR on a session
+ *                      error.
+ */
+API int sftp_batch(sftp_session sftp, struct sftp_batch_item *items,
+                   uint32_t count);
+
+/**
+ * @brief Configure the attribute cache of a session.
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @param entries       Maximum number of cached paths, at most 1024. 0
+ *                      disables the cache. The oldest entry is evicted when
+ *                      the cache is full.
+ *
+ * @param ttl_ms        Milliseconds an entry stays valid.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+API int sftp_set_attr_cache(sftp_session sftp, uint32_t entries,
+                            uint32_t ttl_ms);
+
 /**
  * @brief Read from a file using an opened sftp file handle.
  *
+ * With read-ahead on the file, see sftp_set_read_ahead(), the bytes come
+ * from the prefetched chunks. Otherwise, when the read depth of the session
+ * is greater than 1 and `count` exceeds the read size of the session, see
+ * sftp_get_limits(), the read is split into requests of that size of which
+ * up to read depth are kept in flight. In both cases short replies are
+ * requested again, so the call only returns less than `count` bytes at the
+ * end of the file.
+ *
  * @param file          The opened sftp file handle to be read from.
  *
  * @param buf           Pointer to buffer to recieve read data.
@@ -226,9 +607,141 @@ API sftp_attributes sftp_stat(sftp_session session, const char *path);
  *                      error set.
  *
  * @see sftp_get_error()
+ * @see sftp_set_read_depth()
  */
 API int32_t sftp_read(sftp_file file, void* buf, uint32_t count);
 
+/**
+ * @brief Set the number of outstanding SSH_FXP_READ requests sftp_read()
+ * keeps in flight on a session.
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @param depth         Number of outstanding reads, between 1 and 256. 1
+ *                      (the default) sends one request at a time.
+ *
+ * @return              SSH_OK on success, SSH_ERROR if depth is out of range.
+ *
+ * @see sftp_read()
+ */
+API int sftp_set_read_depth(sftp_session sftp, uint32_t depth);
+
+/**
+ * @brief Get the number of outstanding SSH_FXP_READ requests of a session.
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @return              The read depth, 0 if sftp is NULL.
+ */
+API uint32_t sftp_get_read_depth(sftp_session sftp);
+
+/**
+ * @brief Set up read-ahead for sequential sftp_read() calls on a file.
+ *
+ * The file keeps READ requests in flight for up to `window` bytes past its
+ * offset, in chunks of the session read size, and asks for the next chunk
+ * as soon as one is consumed. Small sequential reads are then served from
+ * memory without a round trip each. A read at another offset than where the
+ * last one ended, after sftp_seek() or otherwise, cancels the prefetched
+ * chunks and starts over from there. sftp_write() on the file cancels them
+ * as well.
+ *
+ * @param file          The sftp file handle, opened for reading.
+ *
+ * @param window        Bytes to prefetch, rounded up to whole chunks and
+ *                      capped at 256 chunks, 0 to turn read-ahead off.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+API int sftp_set_read_ahead(sftp_file file, uint32_t window);
+
+/**
+ * @brief Set the offset of the next sftp_read() or sftp_write() on a file.
+ *
+ * @param file          The sftp file handle.
+ *
+ * @param offset        The new file offset.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+API int sftp_seek(sftp_file file, uint64_t offset);
+
+/**
+ * @brief Get the current offset of a file.
+ *
+ * @param file          The sftp file handle.
+ *
+ * @return              The file offset.
+ */
+API uint64_t sftp_tell(sftp_file file);
+
+/**
+ * @brief Download a file into a local file descriptor with several ranges in
+ * flight.
+ *
+ * The file is read from its current offset to the end in ranges of the read
+ * size of the session, with up to the read depth of the session
+ * outstanding. Each reply is written with pwrite() at its own offset as soon
+ * as it arrives, so replies may complete in any order. On success the offset
+ * of `file` is at the end of the file. On error, the local file is truncated
+ * below the first range that did not complete, so that its size is a
+ * complete prefix for sftp_resume_get().
+ *
+ * @param file          The opened sftp file handle to be read from.
+ *
+ * @param fd            Local file to write to, at the same offsets as the
+ *                      remote file.
+ *
+ * @param size          Expected size of the remote file, 0 if unknown. No
+ *                      range past it is requested before the end is
+ *                      confirmed.
+ *
+ * @param flags         SFTP_GET_PREALLOCATE to allocate `size` bytes of the
+ *                      local file before writing, so that out of order
+ *                      writes do not fragment it. The file is truncated if
+ *                      the remote file turns out shorter. Until the
+ *                      download ends, the size of the local file does not
+ *                      tell how far it got; if the process dies meanwhile,
+ *                      sftp_resume_get() can not be used on it.
+ *                      SFTP_GET_SPARSE to skip blocks of zeros past the end
+ *                      of the local file and punch holes for those before
+ *                      it, where the file system can.
+ *
+ * @return              Number of bytes downloaded, < 0 on error with ssh and
+ *                      sftp error set.
+ *
+ * @see sftp_set_read_depth()
+ */
+API int64_t sftp_get_file(sftp_file file, int fd, uint64_t size, int flags);
+
+/**
+ * @brief Upload a local file descriptor with several writes in flight.
+ *
+ * The local file is read with pread() from the current offset of `file` to
+ * its end, and written at the same offsets of the remote file in writes of
+ * the write size of the session, pipelined as with sftp_set_write_behind().
+ * On success the offset of `file` is at the end of the file.
+ *
+ * @param file          The opened sftp file handle to write to.
+ *
+ * @param fd            Local file to read from.
+ *
+ * @param size          Bytes to upload at most, 0 for all of the file.
+ *
+ * @param flags         SFTP_PUT_SPARSE to skip the holes of the local file,
+ *                      found with SEEK_DATA and SEEK_HOLE where supported,
+ *                      and its blocks of zeros. Skipped ranges must read as
+ *                      zeros on the server, which holds for a new or
+ *                      truncated file. The last byte is always written so
+ *                      that the remote file gets its full size.
+ *
+ * @return              Number of bytes uploaded, holes included, < 0 on
+ *                      error with ssh and sftp error set.
+ *
+ * @see sftp_set_write_behind()
+ */
+API int64_t sftp_put_file(sftp_file file, int fd, uint64_t size, int flags);
+
 /**
  * @brief Write to a file using an opened sftp file handle.
  *
@@ -247,4 +760,535 @@ API int32_t sftp_read(sftp_file file, void* buf, uint32_t count);
  */
 API int32_t sftp_write(sftp_file file, const void* buf, uint32_t count);
 
+/**
+ * @brief Enable write-behind on a session.
+ *
+ * With write-behind, sftp_write() returns once its SSH_FXP_WRITE requests
+ * are sent and their statuses are collected later. At most `max_inflight`
+ * bytes of unacknowledged data are outstanding on the session; a write that
+ * would exceed it first waits for older statuses. A failed request is
+ * reported by the next sftp_write(), sftp_flush() or sftp_close() on its
+ * file, see sftp_get_write_error().
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @param max_inflight  Bytes allowed in flight, 0 (the default) waits for
+ *                      the status of every request.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+API int sftp_set_write_behind(sftp_session sftp, uint32_t max_inflight);
+
+/**
+ * @brief Wait for the statuses of all outstanding writes.
+ *
+ * @param file          The sftp file handle.
+ *
+ * @return              SSH_OK if every write to the file succeeded,
+ *                      SSH_ERROR otherwise.
+ *
+ * @see sftp_set_write_behind()
+ */
+API int sftp_flush(sftp_file file);
+
+/**
+ * @brief Get the first failed write-behind request of a file.
+ *
+ * @param file          The sftp file handle.
+ *
+ * @param offset        Set to the lowest file offset of a failed write.
+ *                      May be NULL.
+ *
+ * @return              The SSH_FX_* status of the failed write, SSH_FX_OK
+ *                      if no collected write failed.
+ */
+API int sftp_get_write_error(sftp_file file, uint64_t* offset);
+
+/**
+ * @brief Have the server flush a file to stable storage with the
+ * fsync@openssh.com extension.
+ *
+ * The request is sent behind the outstanding write-behind requests, which
+ * the server handles first, so the durability point covers every write sent
+ * before it. Then all statuses are collected.
+ *
+ * @param file          The sftp file handle, opened for writing.
+ *
+ * @return              SSH_OK if the file is on stable storage and every
+ *                      write to it succeeded, SSH_ERROR otherwise with ssh
+ *                      error set. SSH_REQUEST_DENIED if the server lacks the
+ *                      extension.
+ */
+API int sftp_fsync(sftp_file file);
+
+/**
+ * @brief Make sftp_write() set durability points as it goes.
+ *
+ * Each time `interval` bytes have been written to a file with sftp_write(),
+ * and on sftp_close() if anything was written since, an fsync@openssh.com
+ * request is sent. With write-behind it is pipelined behind the outstanding
+ * writes rather than waited for, and a failure is reported like a failed
+ * write, at the file offset of the durability point. Without write-behind
+ * every write is waited for anyway, and so is the fsync.
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @param interval      Bytes between durability points, SFTP_FSYNC_ON_CLOSE
+ *                      for one on close only, 0 (the default) for none.
+ *
+ * @return              SSH_OK on success, SSH_ERROR with ssh error set if
+ *                      the server lacks fsync@openssh.com.
+ */
+API int sftp_set_fsync_interval(sftp_session sftp, uint64_t interval);
+
+/**
+ * @brief Gather small sftp_write() calls on a file into full WRITE requests.
+ *
+ * Adjacent writes are copied into a buffer of the file, which is sent as one
+ * SSH_FXP_WRITE request once full, without waiting for its status. Writes
+ * at least the buffer size skip it when it is empty. The status is
+ * collected as with write-behind, see sftp_set_write_behind(); on a session
+ * without write-behind up to 1 MB is kept in flight. The buffer is sent
+ * before a write at another offset and by sftp_read(), sftp_fstat(),
+ * sftp_flush(), sftp_fsync() and sftp_close() on the file; a failed request
+ * is reported by the next sftp_write(), sftp_flush() or sftp_close().
+ * sftp_async_close() does not send it.
+ *
+ * @param file          The sftp file handle, opened for writing.
+ *
+ * @param size          Buffer size, capped at the session write size, see
+ *                      sftp_get_limits(). 0 sends what is buffered and turns
+ *                      the buffer off.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error.
+ */
+API int sftp_set_write_buffer(sftp_file file, uint32_t size);
+
+/**
+ * @brief Prepare to resume an interrupted download.
+ *
+ * The local file is taken to hold a prefix of the remote file: the resume
+ * offset comes from its size, which is only valid if every byte below it
+ * was written. That holds for downloads written in order, with sftp_read(),
+ * and for sftp_get_file() failing with an error, which truncates the local
+ * file to the complete prefix; it does not hold for a process that died
+ * during an sftp_get_file() with a read depth above 1 or with
+ * SFTP_GET_PREALLOCATE. Both sizes are compared and, with SFTP_RESUME_VERIFY, the last SFTP_RESUME_TAIL bytes
+ * of the prefix are read from both ends and compared too. If the local file
+ * is longer than the remote file or the tails differ, the download restarts
+ * from 0. The local file is truncated to the resume offset, and both the
+ * offset of `file` and the file offset of `fd` are set to it, so the
+ * download continues with sftp_read() or sftp_get_file().
+ *
+ * @param file          The remote file, opened for reading.
+ *
+ * @param fd            The local file, opened for reading and writing.
+ *
+ * @param flags         0 or SFTP_RESUME_VERIFY.
+ *
+ * @return              The offset to resume from, < 0 on error with ssh and
+ *                      sftp error set.
+ */
+API int64_t sftp_resume_get(sftp_file file, int fd, int flags);
+
+/**
+ * @brief Prepare to resume an interrupted upload.
+ *
+ * The remote file must be opened without O_TRUNC and O_APPEND, so that it
+ * keeps its data and writes go to the file offset. It is taken to hold a
+ * prefix of the local file, verified as in sftp_resume_get(). On a mismatch
+ * the remote file is truncated and the upload restarts from 0. Both the
+ * offset of `file` and the file offset of `fd` are set to the resume
+ * offset, so the upload continues with sftp_write().
+ *
+ * @param file          The remote file, opened for writing and, with
+ *                      SFTP_RESUME_VERIFY, reading.
+ *
+ * @param fd            The local file, opened for reading.
+ *
+ * @param flags         0 or SFTP_RESUME_VERIFY.
+ *
+ * @return              The offset to resume from, < 0 on error with ssh and
+ *                      sftp error set.
+ */
+API int64_t sftp_resume_put(sftp_file file, int fd, int flags);
+
+/**
+ * @brief Copy data between two remote files without a local copy.
+ *
+ * If the server supports the copy-data extension, it copies the data
+ * itself and nothing but the request crosses the network. Otherwise the
+ * data is relayed through the client with reads and writes pipelined, so
+ * it crosses the network twice but without a round trip per block.
+ *
+ * @param from          The file to copy from, opened for reading.
+ *
+ * @param to            The file to copy to, opened for writing.
+ *
+ * @param len           Number of bytes to copy, 0 to copy up to the end of
+ *                      `from`.
+ *
+ * @return              Bytes copied, starting at the offset of each file,
+ *                      whose offsets are advanced by this count. Less than
+ *                      `len` if `from` ends first. < 0 on error with ssh
+ *                      and sftp error set.
+ */
+API int64_t sftp_copy(sftp_file from, sftp_file to, uint64_t len);
+
+/**
+ * @brief Copy a remote file to another remote path with sftp_copy(). The
+ * target is created with the permissions of the source, or truncated.
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @param from_path     The file to copy.
+ *
+ * @param to_path       The copy.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error with ssh and
+ *                      sftp error set.
+ */
+API int sftp_copy_file(sftp_session sftp, const char *from_path,
+                       const char *to_path);
+
+/**
+ * @brief Hash a range of a remote file on the server.
+ *
+ * The check-file-name extension is used if the server offers it. Otherwise
+ * `<algorithm>sum` is run on the server in a session channel of its own,
+ * which needs a POSIX shell there. Requests in flight on the SFTP channel
+ * meanwhile are not disturbed.
+ * The digest is the plain digest of the bytes in range, to be compared with
+ * sftp_hash_local() of the local copy.
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @param path          The remote file.
+ *
+ * @param algorithm     "md5", "sha1", "sha224", "sha256", "sha384" or
+ *                      "sha512".
+ *
+ * @param offset        Where the range starts.
+ *
+ * @param len           Length of the range, 0 to hash up to the end of file.
+ *
+ * @param digest        A buffer of SFTP_HASH_MAX bytes for the digest.
+ *
+ * @param digest_len    Set to the digest length.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error with ssh and
+ *                      sftp error set.
+ */
+API int sftp_hash(sftp_session sftp, const char *path, const char *algorithm,
+                  uint64_t offset, uint64_t len, unsigned char *digest,
+                  size_t *digest_len);
+
+/**
+ * @brief Hash a range of an open remote file on the server, like
+ * sftp_hash() but with check-file-handle if the server offers it. Writes
+ * still in flight are collected first, so the digest covers them.
+ *
+ * @param file          The remote file, opened for reading.
+ *
+ * @param algorithm     As in sftp_hash().
+ *
+ * @param offset        Where the range starts, independent of the file
+ *                      offset.
+ *
+ * @param len           Length of the range, 0 to hash up to the end of file.
+ *
+ * @param digest        A buffer of SFTP_HASH_MAX bytes for the digest.
+ *
+ * @param digest_len    Set to the digest length.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error with ssh and
+ *                      sftp error set.
+ */
+API int sftp_fhash(sftp_file file, const char *algorithm, uint64_t offset,
+                   uint64_t len, unsigned char *digest, size_t *digest_len);
+
+/**
+ * @brief Hash a range of a local file the way sftp_hash() does on the
+ * server. The file offset of `fd` is left as it is.
+ *
+ * @param fd            The local file, opened for reading.
+ *
+ * @param algorithm     As in sftp_hash().
+ *
+ * @param offset        Where the range starts.
+ *
+ * @param len           Length of the range, 0 to hash up to the end of file.
+ *
+ * @param digest        A buffer of SFTP_HASH_MAX bytes for the digest.
+ *
+ * @param digest_len    Set to the digest length.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error with ssh error
+ *                      set.
+ */
+API int sftp_hash_local(int fd, const char *algorithm, uint64_t offset,
+                        uint64_t len, unsigned char *digest,
+                        size_t *digest_len);
+
+/**
+ * @brief Update a remote file to the content of a local file, sending only
+ * the blocks that differ.
+ *
+ * Each block of the part both files have is compared by its hash, taken by
+ * the server with the check-file extension and locally with the same
+ * algorithm. Without check-file, or with a NULL `algorithm`, the remote
+ * blocks are read and compared instead, which moves the data the other way
+ * but sends only what differs. Blocks are compared at the same offsets, so
+ * data shifted by an insertion counts as changed. The rest of a longer local
+ * file is uploaded as with sftp_put_file() and a longer remote file is
+ * truncated. On success the offset of `file` is at the end of the file.
+ *
+ * @param file          The sftp file handle, opened for reading and
+ *                      writing.
+ *
+ * @param fd            The local file, opened for reading.
+ *
+ * @param algorithm     As in sftp_hash(), for the block hashes, or NULL to
+ *                      compare the data itself.
+ *
+ * @param block_size    Size of the compared blocks, at least 256 bytes, or
+ *                      0 for the write size of the session.
+ *
+ * @return              Number of bytes written to the remote file, < 0 on
+ *                      error with ssh and sftp error set.
+ *
+ * @see sftp_put_file()
+ */
+API int64_t sftp_put_delta(sftp_file file, int fd, const char *algorithm,
+                           uint32_t block_size);
+
+/**
+ * @brief Download a directory tree.
+ *
+ * Regular files and directories are copied; other entries are skipped.
+ * Several files are in transfer at once, each with its own window of
+ * pipelined reads, and the next files are opened while the current ones
+ * move data, so the session is kept busy across small files as well. Local
+ * directories are created as the listing finds them; existing ones are
+ * reused and existing files overwritten.
+ *
+ * Files are copied to their end rather than to the size the listing
+ * reported, so a file that grew or shrunk since it was listed is copied
+ * whole; the same holds for sftp_put_tree().
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @param remote_dir    The directory to download.
+ *
+ * @param local_dir     Where to put it, created if needed.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error with ssh and
+ *                      sftp error set. Files already copied are kept.
+ */
+API int sftp_get_tree(sftp_session sftp, const char *remote_dir,
+                      const char *local_dir);
+
+/**
+ * @brief Upload a directory tree, the counterpart of sftp_get_tree().
+ *
+ * Remote directories are created with SSH_FXP_MKDIR as soon as the walk
+ * finds them, while files found earlier are still in transfer.
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @param local_dir     The directory to upload.
+ *
+ * @param remote_dir    Where to put it, created if needed.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error with ssh and
+ *                      sftp error set. Files already copied are kept.
+ */
+API int sftp_put_tree(sftp_session sftp, const char *local_dir,
+                      const char *remote_dir);
+
+/**
+ * Asynchronous requests
+ *
+ * An sftp_async_*() call sends a request and returns a ticket without
+ * waiting for the reply. Every ticket is recorded in a pending table of the
+ * session keyed by request id, so replies may arrive in any order and
+ * requests on many handles can be in flight at once. The reply is obtained
+ * with the matching sftp_async_*_result() call, which waits for it if needed
+ * and frees the ticket. sftp_request_poll() checks for a reply without
+ * waiting for replies that have not started to arrive, and
+ * sftp_request_cancel() abandons a ticket.
+ */
+
+/**
+ * @brief Send an SSH_FXP_OPEN request.
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @param file          The file to be opened.
+ *
+ * @param accesstype    See sftp_open().
+ *
+ * @param mode          See sftp_open().
+ *
+ * @return              A request ticket, NULL on error with ssh error set.
+ *
+ * @see sftp_async_open_result()
+ */
+API sftp_request sftp_async_open(sftp_session sftp, const char* file,
+                                 int accesstype, mode_t mode);
+
+/**
+ * @brief Get the file handle opened by an sftp_async_open() request.
+ *
+ * @param req           The request ticket, freed by this call.
+ *
+ * @return              A sftp file handle, NULL on error with ssh error set.
+ */
+API sftp_file sftp_async_open_result(sftp_request req);
+
+/**
+ * @brief Send an SSH_FXP_READ request. The file offset is not changed.
+ *
+ * @param file          The opened sftp file handle to be read from.
+ *
+ * @param offset        File offset to read at.
+ *
+ * @param len           Number of bytes to read.
+ *
+ * @return              A request ticket, NULL on error with ssh error set.
+ *
+ * @see sftp_async_read_result()
+ */
+API sftp_request sftp_async_read(sftp_file file, uint64_t offset,
+                                 uint32_t len);
+
+/**
+ * @brief Get the data read by an sftp_async_read() request.
+ *
+ * @param req           The request ticket, freed by this call.
+ *
+ * @param buf           Pointer to buffer to recieve read data.
+ *
+ * @param count         Size of the buffer in bytes.
+ *
+ * @return              Number of bytes read, which may be less than
+ *                      requested, 0 on EOF, < 0 on error with ssh error set.
+ */
+API int32_t sftp_async_read_result(sftp_request req, void* buf,
+                                   uint32_t count);
+
+/**
+ * @brief Send an SSH_FXP_WRITE request. The file offset is not changed.
+ *
+ * @param file          Open sftp file handle to write to.
+ *
+ * @param offset        File offset to write at.
+ *
+ * @param buf           Data to write, it may be reused once this returns.
+ *
+ * @param len           Number of bytes to write, at most the write size of
+ *                      the session, see sftp_get_limits().
+ *
+ * @return              A request ticket, NULL on error with ssh error set.
+ *
+ * @see sftp_async_write_result()
+ */
+API sftp_request sftp_async_write(sftp_file file, uint64_t offset,
+                                  const void* buf, uint32_t len);
+
+/**
+ * @brief Get the status of an sftp_async_write() request.
+ *
+ * @param req           The request ticket, freed by this call.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error with ssh error
+ *                      set.
+ */
+API int sftp_async_write_result(sftp_request req);
+
+/**
+ * @brief Send an SSH_FXP_CLOSE request.
+ *
+ * @param file          The open sftp file handle to close.
+ *
+ * @return              A request ticket, NULL on error with ssh error set.
+ *
+ * @see sftp_async_close_result()
+ */
+API sftp_request sftp_async_close(sftp_file file);
+
+/**
+ * @brief Get the status of an sftp_async_close() request. The file handle is
+ * freed by this call, on error too.
+ *
+ * @param req           The request ticket, freed by this call.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error with ssh error
+ *                      set.
+ */
+API int sftp_async_close_result(sftp_request req);
+
+/**
+ * @brief Send an SSH_FXP_MKDIR request.
+ *
+ * @param sftp          The sftp session handle.
+ *
+ * @param path          The directory to create.
+ *
+ * @param mode          Permissions of the new directory.
+ *
+ * @return              A request ticket, NULL on error with ssh error set.
+ *
+ * @see sftp_async_mkdir_result()
+ */
+API sftp_request sftp_async_mkdir(sftp_session sftp, const char* path,
+                                  mode_t mode);
+
+/**
+ * @brief Get the status of an sftp_async_mkdir() request.
+ *
+ * @param req           The request ticket, freed by this call.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error with ssh error
+ *                      set.
+ */
+API int sftp_async_mkdir_result(sftp_request req);
+
+/**
+ * @brief Process the replies that already arrived, without waiting for new
+ * ones, and check whether a request is answered.
+ *
+ * Any byte of a reply that has arrived counts: a reply that has only partly
+ * arrived, such as a large SSH_FXP_DATA, is read to its end, so the call
+ * may block until the rest of that reply is in. It never waits for a reply
+ * of which nothing has arrived.
+ *
+ * @param req           The request ticket.
+ *
+ * @return              SSH_OK if the reply is there, SSH_AGAIN if not yet,
+ *                      SSH_ERROR on error with ssh error set.
+ */
+API int sftp_request_poll(sftp_request req);
+
+/**
+ * @brief Wait until a request is answered. Replies to other requests that
+ * arrive in the meantime are stored with their tickets.
+ *
+ * @param req           The request ticket.
+ *
+ * @return              SSH_OK on success, SSH_ERROR on error with ssh error
+ *                      set.
+ */
+API int sftp_request_wait(sftp_request req);
+
+/**
+ * @brief Abandon a request. The ticket must not be used afterwards; its
+ * reply is dropped when it arrives. SFTP can not revoke a request, so the
+ * server still performs it; the handle an abandoned open gets is closed
+ * when the reply arrives.
+ *
+ * @param req           The request ticket.
+ */
+API void sftp_request_cancel(sftp_request req);
+
 #endif /* SFTP_H */
\ No newline at end of file
@@ -115,6 +115,11 @@ enum ssh_options_e {
     SSH_OPTIONS_HOST,
     SSH_OPTIONS_PORT,
     SSH_OPTIONS_USER,
+    /* uint32_t: bytes a channel window may grow to, see channel.c */
+    SSH_OPTIONS_MAX_WINDOW,
+    /* uint32_t: largest channel data packet, both ways, up to
+     * SSH_CHANNEL_MAX_PACKET_LIMIT */
+    SSH_OPTIONS_MAX_PACKET,
 };
 
 
@@ -125,6 +130,11 @@ API int ssh_options_set(ssh_session session, enum ssh_options_e type, const void
 API int ssh_connect(ssh_session session);
 API void ssh_disconnect(ssh_session session);
 API void ssh_free(ssh_session session);
+API int ssh_set_blocking(ssh_session session, int blocking);
+API int ssh_is_blocking(ssh_session session);
+API int ssh_get_fd(ssh_session session);
+API int ssh_get_poll_events(ssh_session session);
+API int ssh_flush(ssh_session session);
 
 /* Authentication API */
 API int ssh_userauth_password(ssh_session session, const char *password);
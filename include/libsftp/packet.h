@@ -15,6 +15,12 @@
 #include "libssh.h"
 #include "crypto.h"
 
+/* largest channel max packet, see SSH_OPTIONS_MAX_PACKET */
+#define SSH_CHANNEL_MAX_PACKET_LIMIT (256 * 1024)
+/* what a packet adds to a channel max packet of data: the channel data
+ * header, the length fields, the padding and the MAC */
+#define SSH_PACKET_OVERHEAD 1024
+
 int ssh_packet_send(ssh_session session);
 int ssh_packet_receive(ssh_session session);
 
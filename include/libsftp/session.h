@@ -36,6 +36,11 @@ struct ssh_session_struct {
     /* IO buffer */
     ssh_buffer in_buffer;
     ssh_buffer out_buffer;
+    /* bytes of the packet in in_buffer read from the socket so far, 0 between
+     * packets, and its size from the first block to the MAC, once the first
+     * block is read: a non-blocking receive goes on where the last stopped */
+    uint32_t in_packet_read;
+    uint32_t in_packet_size;
 
     /*
      * RFC 4253, 7.1: if the first_kex_packet_follows flag was set in
@@ -52,8 +57,21 @@ struct ssh_session_struct {
     struct ssh_crypto_struct *current_crypto; /* currently used crypto */
     struct ssh_crypto_struct *next_crypto;  /* next_crypto is going to be used after a SSH_MSG_NEWKEYS */
 
-    /* we only support one channel per session now */
-    ssh_channel channel;
+    /* channels by local channel number, NULL for unused numbers; the
+     * number of a freed channel whose close the peer has not answered yet
+     * is taken by a placeholder, see `ssh_channel_free` */
+    ssh_channel *channels;
+    uint32_t channel_count;
+    /* the channel the data of the SSH_MSG_CHANNEL_DATA in in_buffer is for,
+     * and how much of it is not read yet */
+    ssh_channel in_channel;
+    uint32_t in_pending;
+
+    /* receive path accounting */
+    struct {
+        uint64_t socket_bytes; /* bytes read from the socket */
+        uint64_t copied_bytes; /* channel data bytes copied after decryption */
+    } stats;
 
     /* Some options set by user */
     struct {
@@ -64,6 +82,9 @@ struct ssh_session_struct {
         char *pubkey_accepted_types;
         char *custombanner;
         unsigned int port;
+        uint32_t max_window; /* cap on autotuned channel windows, 0 for the
+                                default */
+        uint32_t max_packet; /* channel max packet, 0 for the default */
     } opts;
 };
 
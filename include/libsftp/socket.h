@@ -18,6 +18,9 @@
 struct ssh_socket_struct {
     int fd;
     ssh_buffer in_buffer;
+    /* bytes written but not taken by the socket yet, in non-blocking mode */
+    ssh_buffer out_buffer;
+    int nonblocking;
 };
 
 typedef struct ssh_socket_struct *ssh_socket;
@@ -33,8 +36,18 @@ void ssh_socket_close(ssh_socket s);
 
 void ssh_socket_set_fd(ssh_socket s, int fd);
 
+int ssh_socket_set_blocking(ssh_socket s, int blocking);
+
 int ssh_socket_write(ssh_socket s, const void *buffer, size_t len);
 
+int ssh_socket_flush(ssh_socket s);
+
 int ssh_socket_read(ssh_socket s, void *buffer, size_t len);
 
+int ssh_socket_read_nonblocking(ssh_socket s, void *buffer, size_t len);
+
+int ssh_socket_poll(ssh_socket s);
+
+int ssh_socket_wait(ssh_socket s);
+
 #endif /* SOCKET_H */
\ No newline at end of file
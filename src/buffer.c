@@ -153,6 +153,30 @@ static void buffer_shift(ssh_buffer buffer) {
  * @return              0 on success, < 0 on error.
  */
 int ssh_buffer_reinit(struct ssh_buffer_struct *buffer) {
+    /* If the buffer is bigger then 64K, reset it to 64K */
+    return ssh_buffer_reinit_size(buffer, 65536, 0);
+}
+
+/**
+ * @internal
+ *
+ * @brief Empty a buffer that is reused for data of a known size, such as
+ * packets.
+ *
+ * @param[in]  buffer   The buffer to empty.
+ *
+ * @param[in]  size     Bytes to keep allocated at most, rounded up to a
+ *                      power of two.
+ *
+ * @param[in]  headroom Bytes left free in front of the data, so that as many
+ *                      can be prepended without moving it.
+ *
+ * @return              0 on success, -1 on error.
+ */
+int ssh_buffer_reinit_size(struct ssh_buffer_struct *buffer, uint32_t size,
+                           uint32_t headroom) {
+    int rc;
+
     if (buffer == NULL) {
         return -1;
     }
@@ -160,16 +184,19 @@ int ssh_buffer_reinit(struct ssh_buffer_struct *buffer) {
     buffer->used = 0;
     buffer->pos = 0;
 
-    /* If the buffer is bigger then 64K, reset it to 64K */
-    if (buffer->allocated > 65536) {
-        int rc;
-
+    if (buffer->allocated > size) {
         /* -1 for realloc_buffer magic */
-        rc = realloc_buffer(buffer, 65536 - 1);
+        rc = realloc_buffer(buffer, size - 1);
         if (rc != 0) {
             return -1;
         }
     }
+    if (headroom > 0) {
+        if (ssh_buffer_allocate(buffer, headroom) == NULL) {
+            return -1;
+        }
+        buffer->pos = headroom;
+    }
 
     return 0;
 }
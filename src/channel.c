@@ -12,11 +12,14 @@
 
 #include "libsftp/channel.h"
 
+#include <time.h>
+
 #include "libsftp/error.h"
 #include "libsftp/libssh.h"
 #include "libsftp/logger.h"
 #include "libsftp/packet.h"
 #include "libsftp/session.h"
+#include "libsftp/socket.h"
 
 /**
  * RFC4253 section 6.1
@@ -28,17 +31,508 @@
 
 #define CHANNEL_MAX_PACKET 32768
 #define CHANNEL_INITIAL_WINDOW 64000
+/* default cap of an autotuned window, see `channel_autotune` */
+#define CHANNEL_MAX_WINDOW (16 * 1024 * 1024)
+
+/* stands in the channel table for a freed channel whose
+ * SSH_MSG_CHANNEL_CLOSE the peer has not answered yet, see
+ * `ssh_channel_free` */
+static struct ssh_channel_struct channel_closing;
+#define CHANNEL_CLOSING (&channel_closing)
+
+static uint64_t channel_now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
 /**
- * @brief Get a new channel id.
- * @todo Since we only support one channel per session, returning 1 meets the
- * need. This function needs to be updated if we want to support arbitrary
- * number of channels in the future.
+ * @brief Bytes of a channel received but not read yet.
  *
- * @param session
+ * @param channel
  * @return uint32_t
  */
-static uint32_t channel_new_id(ssh_session session) { return 1; }
+static uint32_t channel_queued(ssh_channel channel) {
+    ssh_session session = channel->session;
+
+    if (session->in_channel != channel) return channel->ring_len;
+    return channel->ring_len + session->in_pending;
+}
+
+/**
+ * @brief Make the receive ring of a channel hold at least `size` bytes. Only
+ * called when the local window grows past the ring, the queued data is
+ * moved to the start of the new ring then.
+ *
+ * @param channel
+ * @param size
+ * @return int
+ */
+static int channel_ring_reserve(ssh_channel channel, uint32_t size) {
+    uint8_t *ring;
+    uint32_t first;
+
+    if (size <= channel->ring_size) return SSH_OK;
+
+    ring = malloc(size);
+    if (ring == NULL) {
+        ssh_set_error(SSH_FATAL, "out of memory");
+        return SSH_ERROR;
+    }
+    first = MIN(channel->ring_len, channel->ring_size - channel->ring_head);
+    if (channel->ring_len > 0) {
+        memcpy(ring, channel->ring + channel->ring_head, first);
+        memcpy(ring + first, channel->ring, channel->ring_len - first);
+    }
+    SAFE_FREE(channel->ring);
+    channel->ring = ring;
+    channel->ring_size = size;
+    channel->ring_head = 0;
+    return SSH_OK;
+}
+
+/**
+ * @brief Append data to the receive ring of a channel, which the local
+ * window keeps from overflowing.
+ *
+ * @param channel
+ * @param data
+ * @param len
+ * @return int
+ */
+static int channel_ring_put(ssh_channel channel, const uint8_t *data,
+                            uint32_t len) {
+    uint32_t tail;
+    uint32_t first;
+
+    if (len > channel->ring_size - channel->ring_len) {
+        ssh_set_error(SSH_FATAL, "channel %d received more than its window",
+                      channel->local_channel);
+        return SSH_ERROR;
+    }
+
+    tail = channel->ring_head + channel->ring_len;
+    if (tail >= channel->ring_size) tail -= channel->ring_size;
+    first = MIN(len, channel->ring_size - tail);
+    memcpy(channel->ring + tail, data, first);
+    memcpy(channel->ring, data + first, len - first);
+    channel->ring_len += len;
+    return SSH_OK;
+}
+
+/**
+ * @brief Take up to `len` bytes from the receive ring of a channel.
+ *
+ * @param channel
+ * @param dest
+ * @param len
+ * @return bytes taken.
+ */
+static uint32_t channel_ring_get(ssh_channel channel, uint8_t *dest,
+                                 uint32_t len) {
+    uint32_t first;
+
+    len = MIN(len, channel->ring_len);
+    first = MIN(len, channel->ring_size - channel->ring_head);
+    memcpy(dest, channel->ring + channel->ring_head, first);
+    memcpy(dest + first, channel->ring, len - first);
+
+    channel->ring_head += len;
+    if (channel->ring_head >= channel->ring_size) {
+        channel->ring_head -= channel->ring_size;
+    }
+    channel->ring_len -= len;
+    if (channel->ring_len == 0) channel->ring_head = 0;
+    return len;
+}
+
+/**
+ * @brief Move unread channel data out of session->in_buffer, into the ring
+ * of its channel, before another packet is received into it.
+ *
+ * @param session
+ * @return int
+ */
+static int channel_stash(ssh_session session) {
+    ssh_channel channel = session->in_channel;
+    int rc;
+
+    if (session->in_pending == 0) return SSH_OK;
+
+    rc = channel_ring_put(channel, ssh_buffer_get(session->in_buffer),
+                          session->in_pending);
+    if (rc != SSH_OK) return SSH_ERROR;
+    session->stats.copied_bytes += session->in_pending;
+
+    ssh_buffer_pass_bytes(session->in_buffer, session->in_pending);
+    session->in_pending = 0;
+    session->in_channel = NULL;
+    return SSH_OK;
+}
+
+/**
+ * @brief Send SSH_MSG_CHANNEL_WINDOW_ADJUST for `bytes` more. Unless a round
+ * trip is being measured already, the time is taken for `channel_autotune`.
+ *
+ * @param channel
+ * @param bytes
+ * @return int
+ */
+static int channel_send_adjust(ssh_channel channel, uint32_t bytes) {
+    ssh_session session = channel->session;
+    int rc;
+
+    rc = ssh_buffer_pack(session->out_buffer, "bdd",
+                         SSH_MSG_CHANNEL_WINDOW_ADJUST, channel->remote_channel,
+                         bytes);
+    if (rc != SSH_OK) {
+        LOG_ERROR("can not pack buffer");
+        ssh_buffer_reinit(session->out_buffer);
+        return SSH_ERROR;
+    }
+
+    if (ssh_packet_send(session) != SSH_OK) return SSH_ERROR;
+
+    if (channel->probe_us == 0) {
+        /* data past the current edge can only come after the adjust */
+        channel->probe_edge = channel->rx_bytes + channel->local_window;
+        channel->probe_us = channel_now_us();
+    }
+    channel->local_window += bytes;
+    return SSH_OK;
+}
+
+/**
+ * @brief Grow local channel window to at least `minimum_size`.
+ * This function sends SSH_MSG_CHANNEL_WINDOW_ADJUST.
+ *
+ * @param channel
+ * @param minimum_size
+ * @return int
+ */
+static int grow_window(ssh_channel channel, uint32_t minimum_size) {
+    if (channel == NULL) return SSH_ERROR;
+
+    if (channel->local_window >= minimum_size) return SSH_OK;
+
+    /* room for what is queued and all the peer may send */
+    if (channel_ring_reserve(channel, channel_queued(channel) +
+                                          minimum_size) != SSH_OK) {
+        return SSH_ERROR;
+    }
+
+    return channel_send_adjust(channel, minimum_size - channel->local_window);
+}
+
+/**
+ * @brief Top the local window up to `window_size` as soon as half of it is
+ * free again, that is read by the application, instead of waiting for a
+ * read to find it exhausted: the peer keeps sending while the adjust is on
+ * its way.
+ *
+ * @param channel
+ * @return int
+ */
+static int channel_window_update(ssh_channel channel) {
+    uint64_t used = (uint64_t)channel_queued(channel) + channel->local_window;
+    uint32_t free;
+
+    if (channel->remote_eof || channel->local_close) return SSH_OK;
+    if (used >= channel->window_size) return SSH_OK;
+
+    free = channel->window_size - used;
+    if (free < channel->window_size / 2) return SSH_OK;
+    return channel_send_adjust(channel, free);
+}
+
+/**
+ * @brief Account channel data received and grow `window_size` toward the
+ * bandwidth-delay product of the path.
+ *
+ * The round trip is the time from a WINDOW_ADJUST to the first byte the
+ * peer could only send once it had it; the shortest one seen is kept, as
+ * the peer may also have been idle. Every round trip, the data received in
+ * it is compared with the window: a peer held back by the window delivers
+ * about one window per round trip and the window doubles, up to
+ * `window_max`, while a peer that is not delivers less and the window
+ * settles at twice the bandwidth-delay product.
+ *
+ * @param channel
+ * @param len      bytes of channel data just received
+ * @return int
+ */
+static int channel_autotune(ssh_channel channel, uint32_t len) {
+    uint64_t now = channel_now_us();
+    uint64_t bytes;
+    uint64_t target;
+
+    channel->rx_bytes += len;
+
+    if (channel->probe_us != 0 && channel->rx_bytes > channel->probe_edge) {
+        bytes = MAX(now - channel->probe_us, 1);
+        if (channel->rtt_us == 0 || bytes < channel->rtt_us) {
+            channel->rtt_us = bytes;
+        }
+        channel->probe_us = 0;
+    }
+    if (channel->rtt_us == 0) return SSH_OK;
+
+    if (channel->rate_us == 0) {
+        channel->rate_us = now;
+        channel->rate_bytes = channel->rx_bytes;
+        return SSH_OK;
+    }
+    if (now - channel->rate_us < channel->rtt_us) return SSH_OK;
+
+    /* bytes delivered per round trip */
+    bytes = (channel->rx_bytes - channel->rate_bytes) * channel->rtt_us /
+            (now - channel->rate_us);
+    channel->rate_us = now;
+    channel->rate_bytes = channel->rx_bytes;
+
+    target = MIN(2 * bytes, channel->window_max);
+    if (target <= channel->window_size) return SSH_OK;
+
+    if (channel_ring_reserve(channel, target) != SSH_OK) return SSH_ERROR;
+    LOG_DEBUG("channel %d window %lu, round trip %lu us",
+              channel->local_channel, (unsigned long)target,
+              (unsigned long)channel->rtt_us);
+    channel->window_size = target;
+    return SSH_OK;
+}
+
+/**
+ * @brief Get a new channel id: the lowest number no channel of the session
+ * uses, the channel table grows when all are taken. The number of a freed
+ * channel is only reused once the peer answered its close.
+ *
+ * @param session
+ * @return uint32_t, UINT32_MAX on error.
+ */
+static uint32_t channel_new_id(ssh_session session) {
+    ssh_channel *channels;
+    uint32_t count;
+    uint32_t id;
+
+    for (id = 0; id < session->channel_count; id++) {
+        if (session->channels[id] == NULL) return id;
+    }
+
+    count = MAX(4, 2 * session->channel_count);
+    channels = realloc(session->channels, count * sizeof(ssh_channel));
+    if (channels == NULL) return UINT32_MAX;
+    memset(channels + id, 0, (count - id) * sizeof(ssh_channel));
+    session->channels = channels;
+    session->channel_count = count;
+    return id;
+}
+
+/**
+ * @brief Send SSH_MSG_CHANNEL_FAILURE or SSH_MSG_REQUEST_FAILURE for a
+ * request the peer wants a reply to.
+ *
+ * @param session
+ * @param channel  NULL for a global request
+ * @return int
+ */
+static int channel_refuse(ssh_session session, ssh_channel channel) {
+    int rc;
+
+    if (channel != NULL) {
+        rc = ssh_buffer_pack(session->out_buffer, "bd",
+                             SSH_MSG_CHANNEL_FAILURE, channel->remote_channel);
+    } else {
+        rc = ssh_buffer_pack(session->out_buffer, "b",
+                             SSH_MSG_REQUEST_FAILURE);
+    }
+    if (rc != SSH_OK) {
+        LOG_ERROR("can not create buffer");
+        ssh_buffer_reinit(session->out_buffer);
+        return SSH_ERROR;
+    }
+    return ssh_packet_send(session);
+}
+
+/**
+ * @brief Receive one packet and hand it to the channel it is for: data is
+ * queued for `ssh_channel_read`, and window, EOF, close and reply messages
+ * update the channel state. Callers wait on their own channel by calling it
+ * until that state changes, so messages for the other channels of the
+ * session are never lost meanwhile.
+ * Data queued on the socket goes out first, as the peer may be waiting for
+ * it.
+ *
+ * @param session
+ * @return SSH_OK on success, SSH_AGAIN if no full packet has arrived on a
+ * non-blocking session, SSH_ERROR on error.
+ */
+static int channel_dispatch(ssh_session session) {
+    ssh_channel channel = NULL;
+    uint8_t type;
+    uint32_t recipient_channel;
+    uint32_t bytes_to_add;
+    uint32_t data_len;
+    ssh_string req = NULL;
+    bool want;
+    int rc;
+
+    if (ssh_socket_flush(session->socket) == SSH_ERROR) return SSH_ERROR;
+    if (channel_stash(session) != SSH_OK) return SSH_ERROR;
+    rc = ssh_packet_receive(session);
+    if (rc != SSH_OK) return rc;
+    if (ssh_buffer_get_u8(session->in_buffer, &type) != sizeof(uint8_t)) {
+        return SSH_ERROR;
+    }
+
+    if (type == SSH_MSG_GLOBAL_REQUEST) {
+        /**
+         * RFC 4254 Section 4
+         * There are several kinds of requests that affect the state of
+         * the remote end globally, independent of any channels.  An
+         * example is a request to start TCP/IP forwarding for a
+         * specific port.  Note that both the client and server MAY send
+         * global requests at any time, and the receiver MUST respond
+         * appropriately.  All such requests use the following format.
+         *      byte      SSH_MSG_GLOBAL_REQUEST
+         *      string    request name in US-ASCII only
+         *      boolean   want reply
+         *      ....      request-specific data follows
+         *
+         * The value of 'request name' follows the DNS extensibility
+         * naming convention outlined in [SSH-ARCH].
+         *
+         */
+        // LAB(PT5): insert your code here.
+        rc = ssh_buffer_unpack(session->in_buffer, "Sb", &req, &want);
+        ssh_string_free(req);
+        if (rc == SSH_OK && want) return channel_refuse(session, NULL);
+        return SSH_OK;
+    }
+    if (type < SSH_MSG_CHANNEL_OPEN_CONFIRMATION ||
+        type > SSH_MSG_CHANNEL_FAILURE) {
+        LOG_DEBUG("SSH message type %d not supported yet", type);
+        return SSH_OK;
+    }
+
+    if (ssh_buffer_unpack(session->in_buffer, "d", &recipient_channel) !=
+        SSH_OK) {
+        return SSH_ERROR;
+    }
+    if (recipient_channel < session->channel_count) {
+        channel = session->channels[recipient_channel];
+    }
+    if (channel == NULL) {
+        LOG_ERROR("message type %d for unknown channel %d", type,
+                  recipient_channel);
+        return SSH_OK;
+    }
+    if (channel == CHANNEL_CLOSING) {
+        /* freed already: drop what the peer sent before its close, whose
+         * arrival makes the number free for a new channel */
+        if (type == SSH_MSG_CHANNEL_CLOSE) {
+            session->channels[recipient_channel] = NULL;
+        }
+        LOG_DEBUG("message type %d for freed channel %d", type,
+                  recipient_channel);
+        return SSH_OK;
+    }
+
+    switch (type) {
+        case SSH_MSG_CHANNEL_OPEN_CONFIRMATION:
+            // LAB(PT5): insert your code here.
+            rc = ssh_buffer_unpack(session->in_buffer, "ddd",
+                                   &channel->remote_channel,
+                                   &channel->remote_window,
+                                   &channel->remote_maxpacket);
+            if (rc != SSH_OK) return SSH_ERROR;
+            LOG_DEBUG("local window = %d", channel->local_window);
+            LOG_DEBUG("remote window = %d", channel->remote_window);
+            LOG_DEBUG("local channel number = %d", channel->local_channel);
+            LOG_DEBUG("remote channel number = %d", channel->remote_channel);
+            channel->reply = type;
+            return SSH_OK;
+        case SSH_MSG_CHANNEL_OPEN_FAILURE:
+            // LAB(PT5): insert your code here.
+            channel->reply = type;
+            return SSH_OK;
+        case SSH_MSG_CHANNEL_SUCCESS:
+        case SSH_MSG_CHANNEL_FAILURE:
+            channel->reply = type;
+            return SSH_OK;
+        case SSH_MSG_CHANNEL_WINDOW_ADJUST:
+            /* window adjust message could happen here */
+            // LAB(PT5): insert your code here.
+            if (ssh_buffer_unpack(session->in_buffer, "d", &bytes_to_add) !=
+                SSH_OK) {
+                return SSH_ERROR;
+            }
+            channel->remote_window += bytes_to_add;
+            LOG_NOTICE("remote window grows: +%d", bytes_to_add);
+            return SSH_OK;
+        case SSH_MSG_CHANNEL_DATA:
+            // LAB(PT5): insert your code here.
+            if (ssh_buffer_unpack(session->in_buffer, "d", &data_len) !=
+                    SSH_OK ||
+                data_len > ssh_buffer_get_len(session->in_buffer)) {
+                LOG_ERROR("channel %d received malformed data",
+                          channel->local_channel);
+                return SSH_ERROR;
+            }
+            /* leave the data where it is, see `in_pending` */
+            session->in_channel = channel;
+            session->in_pending = data_len;
+            /* the peer has consumed this much of our window */
+            channel->local_window -= MIN(channel->local_window, data_len);
+            return channel_autotune(channel, data_len);
+        case SSH_MSG_CHANNEL_EOF:
+            // LAB(PT5): insert your code here.
+            channel->remote_eof = 1;
+            return SSH_OK;
+        case SSH_MSG_CHANNEL_CLOSE:
+            // LAB(PT5): insert your code here.
+            channel->remote_eof = 1;
+            channel->remote_close = 1;
+            if (channel->local_close) return SSH_OK;
+            rc = ssh_buffer_pack(session->out_buffer, "bd",
+                                 SSH_MSG_CHANNEL_CLOSE,
+                                 channel->remote_channel);
+            if (rc != SSH_OK) {
+                LOG_ERROR("can not create buffer");
+                ssh_buffer_reinit(session->out_buffer);
+                return SSH_ERROR;
+            }
+            if (ssh_packet_send(session) != SSH_OK) return SSH_ERROR;
+            channel->local_close = 1;
+            return SSH_OK;
+        case SSH_MSG_CHANNEL_REQUEST:
+            // LAB(PT5): insert your code here.
+            rc = ssh_buffer_unpack(session->in_buffer, "Sb", &req, &want);
+            ssh_string_free(req);
+            if (rc == SSH_OK && want) return channel_refuse(session, channel);
+            return SSH_OK;
+        default:
+            // LAB(PT5): insert your code here.
+            LOG_DEBUG("SSH message type %d not supported yet", type);
+            return SSH_OK;
+    }
+}
+
+/**
+ * @brief Receive one packet as `channel_dispatch` does, but wait for it on a
+ * non-blocking session too, for the calls that always wait for the peer.
+ *
+ * @param session
+ * @return int
+ */
+static int channel_dispatch_wait(ssh_session session) {
+    int rc;
+
+    while ((rc = channel_dispatch(session)) == SSH_AGAIN) {
+        if (ssh_socket_wait(session->socket) != SSH_OK) return SSH_ERROR;
+    }
+    return rc;
+}
 
 /**
  * @brief Open a channel by sending a SSH_CHANNEL_OPEN message and
@@ -61,18 +555,17 @@ static uint32_t channel_new_id(ssh_session session) { return 1; }
 static int channel_open(ssh_channel channel, const char *type, uint32_t window,
                         uint32_t maxpacket, ssh_buffer payload) {
     ssh_session session = channel->session;
-    uint8_t reply_type;
-    uint32_t recipient_channel;
-    uint32_t reason_code;
-    char *description = NULL;
-    char *language = NULL;
-    ssh_string req;
-    bool want;
     int rc;
 
-    channel->local_channel = channel_new_id(session);
     channel->local_maxpacket = maxpacket;
     channel->local_window = window;
+    channel->window_size = window;
+    channel->window_max = session->opts.max_window > 0
+                              ? session->opts.max_window
+                              : CHANNEL_MAX_WINDOW;
+    channel->window_max = MAX(channel->window_max, window);
+    channel->reply = 0;
+    if (channel_ring_reserve(channel, window) != SSH_OK) return SSH_ERROR;
 
     rc = ssh_buffer_pack(session->out_buffer, "bsddd", SSH_MSG_CHANNEL_OPEN,
                          type, channel->local_channel, channel->local_window,
@@ -92,79 +585,18 @@ static int channel_open(ssh_channel channel, const char *type, uint32_t window,
         return SSH_ERROR;
     }
 
-    while (1) {
-        /* wait until the channel is opened or an error occurs */
-        rc = ssh_packet_receive(session);
-        if (rc != SSH_OK) return SSH_ERROR;
-
-        rc = ssh_buffer_get_u8(session->in_buffer, &reply_type);
-        switch (reply_type) {
-            case SSH_MSG_CHANNEL_OPEN_CONFIRMATION:
-                // LAB(PT5): insert your code here.
-                rc = ssh_buffer_unpack(session->in_buffer, "dddd", &recipient_channel, 
-                    &channel->remote_channel, &channel->remote_window, &channel->remote_maxpacket);
-                LOG_DEBUG("local window = %d", channel->local_window);
-                LOG_DEBUG("remote window = %d", channel->remote_window);
-                LOG_DEBUG("local channel number = %d", recipient_channel);
-                LOG_DEBUG("remote channel number = %d", channel->local_channel);
-                if(recipient_channel != channel->local_channel){
-                    LOG_ERROR(
-                    "channel number in the reply %d does not match with the "
-                    "original %d",
-                    recipient_channel, channel->local_channel);
-                    continue;
-                }
-                return SSH_OK;
-            case SSH_MSG_CHANNEL_OPEN_FAILURE:
-                // LAB(PT5): insert your code here.
-                rc = ssh_buffer_unpack(session->in_buffer, "ddss", &recipient_channel, 
-                    &reason_code, &description, &language);
-                if(recipient_channel != channel->local_channel){
-                    LOG_ERROR(
-                    "channel number in the reply %d does not match with the "
-                    "original %d",
-                    recipient_channel, channel->local_channel);
-                    continue;
-                }
-                return SSH_ERROR;
-            case SSH_MSG_GLOBAL_REQUEST:
-                /**
-                 * RFC 4254 Section 4
-                 * There are several kinds of requests that affect the state of
-                 * the remote end globally, independent of any channels.  An
-                 * example is a request to start TCP/IP forwarding for a
-                 * specific port.  Note that both the client and server MAY send
-                 * global requests at any time, and the receiver MUST respond
-                 * appropriately.  All such requests use the following format.
-                 *      byte      SSH_MSG_GLOBAL_REQUEST
-                 *      string    request name in US-ASCII only
-                 *      boolean   want reply
-                 *      ....      request-specific data follows
-                 *
-                 * The value of 'request name' follows the DNS extensibility
-                 * naming convention outlined in [SSH-ARCH].
-                 *
-                 */
-                // LAB(PT5): insert your code here.
-                rc = ssh_buffer_unpack(session->in_buffer, "Sb", &req, &want);
-                if(want){
-                    rc = ssh_buffer_pack(session->out_buffer, "b", SSH_MSG_REQUEST_FAILURE);
-                    if (rc != SSH_OK) {
-                        LOG_ERROR("can not create buffer");
-                        return SSH_ERROR;
-                    }
-                    if (ssh_packet_send(session) != SSH_OK) {
-                        return SSH_ERROR;
-                    }
-                }
-                continue;
-            default:
-                // LAB(PT5): insert your code here.
-                LOG_DEBUG("SSH message type not supported yet\n");
-                continue;
-        }
+    /* wait until the channel is opened or an error occurs */
+    while (channel->reply == 0) {
+        if (channel_dispatch_wait(session) != SSH_OK) return SSH_ERROR;
     }
 
+    if (channel->reply != SSH_MSG_CHANNEL_OPEN_CONFIRMATION) {
+        ssh_set_error(SSH_REQUEST_DENIED, "can not open %s channel", type);
+        /* never opened, nothing to close */
+        channel->local_close = channel->remote_close = 1;
+        return SSH_ERROR;
+    }
+    channel->local_close = channel->remote_close = 0;
     return SSH_OK;
 }
 
@@ -180,9 +612,6 @@ static int channel_open(ssh_channel channel, const char *type, uint32_t window,
 static int channel_request(ssh_channel channel, const char *request, int reply,
                            ssh_buffer req_spec) {
     ssh_session session = channel->session;
-    uint8_t type;
-    uint32_t recipient_channel;
-    uint32_t bytes_to_add;
     int rc;
 
     rc = ssh_buffer_pack(session->out_buffer, "bdsb", SSH_MSG_CHANNEL_REQUEST,
@@ -205,38 +634,13 @@ static int channel_request(ssh_channel channel, const char *request, int reply,
 
     if (reply == 0) return SSH_OK;
 
-    while (1) {
-        /* wait for reply or an error occurs */
-        if (ssh_packet_receive(session) != SSH_OK) {
-            return SSH_ERROR;
-        }
-
-        rc = ssh_buffer_unpack(session->in_buffer, "bd", &type,
-                               &recipient_channel);
-        if (recipient_channel != channel->local_channel) {
-            LOG_ERROR(
-                "channel number in the reply does not match with the "
-                "original");
-            return SSH_ERROR;
-        }
-
-        switch (type) {
-            case SSH_MSG_CHANNEL_SUCCESS:
-                return SSH_OK;
-            case SSH_MSG_CHANNEL_FAILURE:
-                return SSH_ERROR;
-            case SSH_MSG_CHANNEL_WINDOW_ADJUST:
-                /* window adjust message could happen here */
-                ssh_buffer_unpack(session->in_buffer, "d", &bytes_to_add);
-                channel->remote_window += bytes_to_add;
-                LOG_NOTICE("remote window adjust to %d",
-                           channel->remote_window);
-                break;
-            default:
-                LOG_ERROR("received type %d during channel open", type);
-                return SSH_ERROR;
-        }
+    /* wait for reply or an error occurs */
+    channel->reply = 0;
+    while (channel->reply == 0) {
+        if (channel->remote_close) return SSH_ERROR;
+        if (channel_dispatch_wait(session) != SSH_OK) return SSH_ERROR;
     }
+    return channel->reply == SSH_MSG_CHANNEL_SUCCESS ? SSH_OK : SSH_ERROR;
 
 error:
     ssh_buffer_reinit(session->out_buffer);
@@ -244,92 +648,40 @@ error:
 }
 
 /**
- * @brief Grow local channel window to at least `minimum_size`.
- * This function sends SSH_MSG_CHANNEL_WINDOW_ADJUST.
+ * @brief Make sure the peer may send at least `minimum_size` bytes on the
+ * channel without waiting for another SSH_MSG_CHANNEL_WINDOW_ADJUST.
+ * Callers that keep several requests in flight use it to open the window
+ * for all the replies they expect.
  *
  * @param channel
  * @param minimum_size
  * @return int
  */
-static int grow_window(ssh_channel channel, uint32_t minimum_size) {
-    ssh_session session;
-    int rc;
-
-    if (channel == NULL) return SSH_ERROR;
-    session = channel->session;
-
-    if (channel->local_window >= minimum_size) return SSH_OK;
-
-    rc = ssh_buffer_pack(session->out_buffer, "bdd",
-                         SSH_MSG_CHANNEL_WINDOW_ADJUST, channel->remote_channel,
-                         minimum_size - channel->local_window);
-    if (rc != SSH_OK) {
-        LOG_ERROR("can not pack buffer");
-        goto error;
-    }
-
-    if (ssh_packet_send(session) != SSH_OK) goto error;
-
-    channel->local_window = minimum_size;
-    return SSH_OK;
-
-error:
-    ssh_buffer_reinit(session->out_buffer);
-    return SSH_ERROR;
+int ssh_channel_grow_window(ssh_channel channel, uint32_t minimum_size) {
+    return grow_window(channel, minimum_size);
 }
 
 /**
- * @brief Wait for WINDOW_ADJUST message to grow remote window.
+ * @brief Wait for WINDOW_ADJUST message to grow remote window. Channel data
+ * arriving meanwhile is kept for `ssh_channel_read`.
  *
  * @param channel
- * @return int
+ * @return SSH_OK once the window is open, SSH_AGAIN if it is not yet on a
+ * non-blocking session, SSH_ERROR on error.
  */
 static int wait_window(ssh_channel channel) {
-    ssh_session session;
-    uint8_t type;
-    uint32_t recipient_channel;
-    uint32_t bytes_to_add;
     int rc;
 
     if (channel == NULL) return SSH_ERROR;
-    session = channel->session;
 
-    type = 0;
-    while (type != SSH_MSG_CHANNEL_WINDOW_ADJUST) {
-        rc = ssh_packet_receive(session);
-        if (rc != SSH_OK || ssh_buffer_unpack(session->in_buffer, "bd", &type,
-                                              &recipient_channel) != SSH_OK)
+    while (channel->remote_window == 0) {
+        if (channel->remote_eof) {
+            LOG_ERROR("channel %d received EOF on window waiting",
+                      channel->local_channel);
             return SSH_ERROR;
-        if (recipient_channel != channel->local_channel) {
-            LOG_ERROR(
-                "channel number in the reply %d does not match with the "
-                "original %d",
-                recipient_channel, channel->local_channel);
-            return SSH_ERROR;
-        }
-
-        switch (type) {
-            case SSH_MSG_CHANNEL_DATA:
-                LOG_ERROR("channel %d received data on window waiting",
-                          channel->local_channel);
-                return SSH_ERROR;
-            case SSH_MSG_CHANNEL_WINDOW_ADJUST:
-                ssh_buffer_unpack(session->in_buffer, "d", &bytes_to_add);
-                LOG_NOTICE("remote window grows: +%d", bytes_to_add);
-                channel->remote_window += bytes_to_add;
-                return SSH_OK;
-            case SSH_MSG_CHANNEL_EOF:
-                LOG_ERROR("channel %d received EOF on window waiting",
-                          channel->local_channel);
-                return SSH_ERROR;
-            case SSH_MSG_CHANNEL_CLOSE:
-                LOG_ERROR("remote channel %d closed on window waiting",
-                          channel->remote_channel);
-                return SSH_ERROR;
-            default:
-                LOG_ERROR("unexpected message type %d on window waiting", type);
-                return SSH_ERROR;
         }
+        rc = channel_dispatch(channel->session);
+        if (rc != SSH_OK) return rc;
     }
 
     return SSH_OK;
@@ -343,6 +695,7 @@ static int wait_window(ssh_channel channel) {
  */
 ssh_channel ssh_channel_new(ssh_session session) {
     ssh_channel channel = NULL;
+    uint32_t id;
 
     if (session == NULL) {
         return NULL;
@@ -357,14 +710,27 @@ ssh_channel ssh_channel_new(ssh_session session) {
     channel->out_buffer = ssh_buffer_new();
     if (channel->out_buffer == NULL) {
         LOG_ERROR("can not create buffer");
-        SAFE_FREE(channel);
-        return NULL;
+        goto error;
+    }
+
+    id = channel_new_id(session);
+    if (id == UINT32_MAX) {
+        LOG_ERROR("can not allocate a channel number");
+        goto error;
     }
 
     channel->session = session;
-    session->channel = channel;
+    channel->local_channel = id;
+    /* not open yet, nothing to close */
+    channel->local_close = channel->remote_close = 1;
+    session->channels[id] = channel;
 
     return channel;
+
+error:
+    ssh_buffer_free(channel->out_buffer);
+    SAFE_FREE(channel);
+    return NULL;
 }
 
 /**
@@ -380,7 +746,10 @@ int ssh_channel_open_session(ssh_channel channel) {
     }
 
     return channel_open(channel, "session", CHANNEL_INITIAL_WINDOW,
-                        CHANNEL_MAX_PACKET, NULL);
+                        channel->session->opts.max_packet > 0
+                            ? channel->session->opts.max_packet
+                            : CHANNEL_MAX_PACKET,
+                        NULL);
 }
 
 /**
@@ -413,14 +782,50 @@ int ssh_channel_request_sftp(ssh_channel channel) {
     return SSH_OK;
 }
 
+/**
+ * @brief Run a command on an opened channel.
+ *
+ * @param channel
+ * @param cmd
+ * @return int
+ */
+int ssh_channel_request_exec(ssh_channel channel, const char *cmd) {
+    ssh_buffer payload = NULL;
+    int rc;
+
+    if (channel == NULL || cmd == NULL) {
+        return SSH_ERROR;
+    }
+
+    payload = ssh_buffer_new();
+    if (payload == NULL) {
+        LOG_ERROR("can not create buffer");
+        return SSH_ERROR;
+    }
+
+    rc = ssh_buffer_pack(payload, "s", cmd);
+    if (rc != SSH_OK) {
+        ssh_buffer_free(payload);
+        return SSH_ERROR;
+    }
+
+    rc = channel_request(channel, "exec", 1, payload);
+    ssh_buffer_free(payload);
+    return rc == SSH_OK ? SSH_OK : SSH_ERROR;
+}
+
 /**
  * @brief Write data to the channel. This function would block until `len` bytes
  * of data are written.
+ * On a non-blocking session, it writes as much as the remote window and the
+ * socket take: it stops at an exhausted window, and once a packet is left
+ * queued on the socket.
  *
  * @param channel
  * @param data
  * @param len
- * @return bytes written, SSH_ERR on error.
+ * @return bytes written, SSH_AGAIN if none could be on a non-blocking
+ * session, SSH_ERR on error.
  */
 int ssh_channel_write(ssh_channel channel, const void *data, uint32_t len) {
     ssh_session session;
@@ -444,16 +849,25 @@ int ssh_channel_write(ssh_channel channel, const void *data, uint32_t len) {
 
     session = channel->session;
     /*
-     * Handle the max packet len from remote side
+     * Handle the max packet len from remote side, and keep to ours so that
+     * the packet buffers are sized for it
      * be nice, 10 bytes for the headers
      */
-    maxpacketlen = channel->remote_maxpacket - 10;
+    maxpacketlen = MIN(channel->remote_maxpacket, channel->local_maxpacket);
+    maxpacketlen = maxpacketlen > 10 ? maxpacketlen - 10 : 1;
 
     while (len > 0) {
+        if (session->socket->nonblocking) {
+            /* do not queue more while the socket does not take it */
+            rc = ssh_socket_flush(session->socket);
+            if (rc == SSH_AGAIN) break;
+            if (rc != SSH_OK) goto error;
+        }
         if (channel->remote_window < len) {
             if (channel->remote_window == 0) {
                 /* can not send, wait for window adjust message */
                 rc = wait_window(channel);
+                if (rc == SSH_AGAIN) break;
                 if (rc != SSH_OK) goto error;
             }
             effectivelen = MIN(len, channel->remote_window);
@@ -478,7 +892,8 @@ int ssh_channel_write(ssh_channel channel, const void *data, uint32_t len) {
         data = ((uint8_t *)data + effectivelen);
     }
 
-    return origlen;
+    if (len > 0 && len == origlen) return SSH_AGAIN;
+    return origlen - len;
 
 error:
     ssh_buffer_reinit(session->out_buffer);
@@ -487,128 +902,94 @@ error:
 
 /**
  * @brief Read data from channel. This function would block until `count` bytes
- * of data is read.
+ * of data is read, or the remote side sent EOF.
+ * Data of the packet just received is copied from the session's in_buffer
+ * straight into `dest`; only data left over when another packet has to be
+ * received, for this channel or another one, goes through the channel's
+ * receive ring.
+ * On a non-blocking session, it returns the data that has arrived, up to
+ * `count` bytes, instead of waiting for more.
  *
- * @todo take care of static `buf`
  * @param channel
  * @param dest
  * @param count
- * @return bytes read, SSH_ERR on error.
+ * @return bytes read, SSH_EOF if the remote side sent EOF before any data
+ * could be read, SSH_AGAIN if none has arrived on a non-blocking session,
+ * SSH_ERR on error.
  */
 int ssh_channel_read(ssh_channel channel, void *dest, uint32_t count) {
     ssh_session session;
-    static ssh_buffer buf = NULL;
-    ssh_string channel_data = NULL;
-    uint8_t type;
-    uint32_t recipient_channel;
-    uint32_t bytes_to_add;
     uint32_t effectivelen;
+    uint32_t queued;
     uint32_t nread = 0;
-    ssh_string req;
-    bool want;
     int rc;
 
     if (channel == NULL) return SSH_ERROR;
     session = channel->session;
 
-    if (channel->remote_eof) return SSH_EOF;
-
-    if (buf == NULL) buf = ssh_buffer_new();
-
-    /* local window should be at least `count` size */
-    if (count >= channel->local_window) {
-        grow_window(channel, count);
+    /* the window must at least let the rest of `count` in */
+    queued = channel_queued(channel);
+    if (count > queued && !channel->remote_eof &&
+        grow_window(channel, count - queued) != SSH_OK) {
+        return SSH_ERROR;
     }
 
     while (count > 0) {
-        if (ssh_buffer_get_len(buf) > 0) {
-            /* try to read channel data from static buffer first */
+        if (channel->ring_len > 0) {
+            /* try to read channel data from the channel ring first */
             // LAB(TP5): insert your code here.
-            rc = ssh_buffer_get_data(buf, dest, count);
-            if(rc == 0) continue;
-            return count;
+            effectivelen =
+                channel_ring_get(channel, (uint8_t *)dest + nread, count);
+            session->stats.copied_bytes += effectivelen;
+            nread += effectivelen;
+            count -= effectivelen;
+        } else if (session->in_channel == channel && session->in_pending > 0) {
+            /* then from the packet in the session buffer */
+            effectivelen = MIN(count, session->in_pending);
+            ssh_buffer_get_data(session->in_buffer, (uint8_t *)dest + nread,
+                                effectivelen);
+            session->stats.copied_bytes += effectivelen;
+            session->in_pending -= effectivelen;
+            nread += effectivelen;
+            count -= effectivelen;
+        } else if (channel->remote_eof) {
+            /* all data before the EOF was read */
+            return nread > 0 ? (int)nread : SSH_EOF;
         } else {
-            /* static buffer has insufficient data, read another
-             * SSH_MSG_CHANNEL_DATA packet */
-            rc = ssh_packet_receive(session);
-            if (rc != SSH_OK) goto error;
-
-            rc = ssh_buffer_unpack(session->in_buffer, "bd", &type,
-                                   &recipient_channel);
-            if (recipient_channel != channel->local_channel) {
-                LOG_ERROR(
-                    "channel number in the reply %d does not match with the "
-                    "original %d",
-                    recipient_channel, channel->local_channel);
-                goto error;
-            }
-            switch (type) {
-                case SSH_MSG_CHANNEL_WINDOW_ADJUST:
-                    /* window adjust message could happen here */
-                    // LAB(PT5): insert your code here.
-                    rc = ssh_buffer_get_u32(session->in_buffer, &bytes_to_add);
-                    if(rc != 0){
-                        channel->local_window += bytes_to_add;
-                    }
-                    break;
-                case SSH_MSG_CHANNEL_DATA:
-                    // LAB(PT5): insert your code here.
-                    rc = ssh_buffer_unpack(session->in_buffer, "S", &channel_data);
-                    if(rc != SSH_OK){
-                        goto error;
-                    }
-                    int data_len = ssh_string_len(channel_data);
-                    rc = ssh_buffer_add_data(buf, channel_data->data, data_len);
-                    if (rc != SSH_OK) {
-                            goto error;
-                    }
-                    break;
-                case SSH_MSG_CHANNEL_EOF:
-                    // LAB(PT5): insert your code here.
-                    goto cleanup;
-                case SSH_MSG_CHANNEL_CLOSE:
-                    // LAB(PT5): insert your code here.
-                    rc = ssh_buffer_pack(session->out_buffer, "bd", SSH_MSG_CHANNEL_CLOSE,
-                         channel->remote_channel);
-                    if (rc != SSH_OK) {
-                        LOG_ERROR("can not create buffer");
-                        goto error;
-                    }
-                    rc = ssh_packet_send(session);
-                    if (rc != SSH_OK) goto error;
-                    break;
-                case SSH_MSG_CHANNEL_REQUEST:
-                    // LAB(PT5): insert your code here.
-                    rc = ssh_buffer_unpack(session->in_buffer, "Sb", &req, &want);
-                    if(want){
-                        rc = ssh_buffer_pack(session->out_buffer, "bd", SSH_MSG_CHANNEL_FAILURE, channel->remote_channel);
-                        if (rc != SSH_OK) {
-                            goto error;
-                        }
-                        if (ssh_packet_send(session) != SSH_OK) {
-                            goto error;
-                        }
-                    }
-                    break;
-                default:
-                    // LAB(PT5): insert your code here.
-                    LOG_DEBUG("SSH message type not supported yet\n");
-                    continue;
-            }
+            /* the channel has insufficient data, read another packet */
+            if (channel_window_update(channel) != SSH_OK) return SSH_ERROR;
+            rc = channel_dispatch(session);
+            if (rc == SSH_AGAIN) break;
+            if (rc != SSH_OK) return SSH_ERROR;
         }
     }
 
+    if (channel_window_update(channel) != SSH_OK) return SSH_ERROR;
+    if (nread == 0 && count > 0) return SSH_AGAIN;
     return nread;
+}
 
-error:
-    if (buf != NULL) ssh_buffer_free(buf);
-    if (channel_data != NULL) ssh_string_free(channel_data);
-    return SSH_ERROR;
+/**
+ * @brief Check whether `ssh_channel_read` can make progress without waiting
+ * for the network. Buffered channel data is reported first; otherwise any
+ * pending data on the socket counts, even if it turns out not to be channel
+ * data, data for another channel, or only part of a packet.
+ *
+ * @param channel
+ * @return bytes available (at least 1), 0 if nothing is pending, SSH_EOF if
+ * the remote side sent EOF, SSH_ERROR on error.
+ */
+int ssh_channel_poll(ssh_channel channel) {
+    uint32_t len;
+
+    if (channel == NULL) return SSH_ERROR;
 
-cleanup:
-    if (buf != NULL) ssh_buffer_free(buf);
-    if (channel_data != NULL) ssh_string_free(channel_data);
-    return SSH_EOF;
+    len = channel_queued(channel);
+    if (len > 0) return len;
+
+    if (channel->remote_eof) return SSH_EOF;
+
+    return ssh_socket_poll(channel->session->socket);
 }
 
 /**
@@ -625,8 +1006,9 @@ int ssh_channel_eof(ssh_channel channel) {
         return SSH_ERROR;
     }
 
-    /* If the EOF has already been sent we're done here. */
-    if (channel->local_eof != 0) {
+    /* If the EOF has already been sent we're done here, and there is no
+     * EOF after the close. */
+    if (channel->local_eof != 0 || channel->local_close != 0) {
         return SSH_OK;
     }
 
@@ -659,11 +1041,11 @@ error:
  * SSH_MSG_CHANNEL_CLOSE without having sent or receive
  * SSH_MSG_CHANNEL_EOF.
  *
+ * On a non-blocking session, it returns SSH_AGAIN until the reply arrived,
+ * and is called again.
  */
 int ssh_channel_close(ssh_channel channel) {
     ssh_session session;
-    uint8_t type;
-    uint32_t recipient_channel;
     int rc;
 
     if (channel == NULL) {
@@ -677,29 +1059,21 @@ int ssh_channel_close(ssh_channel channel) {
         return rc;
     }
 
-    rc = ssh_buffer_pack(session->out_buffer, "bd", SSH_MSG_CHANNEL_CLOSE,
-                         channel->remote_channel);
-    if (rc != SSH_OK) {
-        LOG_ERROR("can not create buffer");
-        goto error;
+    if (!channel->local_close) {
+        rc = ssh_buffer_pack(session->out_buffer, "bd", SSH_MSG_CHANNEL_CLOSE,
+                             channel->remote_channel);
+        if (rc != SSH_OK) {
+            LOG_ERROR("can not create buffer");
+            goto error;
+        }
+        if (ssh_packet_send(session) != SSH_OK) goto error;
+        channel->local_close = 1;
     }
 
-    rc = ssh_packet_send(session);
-
     /* wait for SSH_MSG_CHANNEL_CLOSE reply */
-    type = 0;
-    while (type != SSH_MSG_CHANNEL_CLOSE) {
-        rc = ssh_packet_receive(session);
-        rc = ssh_buffer_unpack(session->in_buffer, "bd", &type,
-                               &recipient_channel);
-        if (recipient_channel != channel->local_channel) {
-            LOG_ERROR(
-                "channel number in the reply %d does not match with the "
-                "original %d",
-                recipient_channel, channel->local_channel);
-            return SSH_ERROR;
-        }
-        LOG_NOTICE("received code %d during channel close", type);
+    while (!channel->remote_close) {
+        rc = channel_dispatch(session);
+        if (rc != SSH_OK) return rc;
     }
 
     return SSH_OK;
@@ -710,13 +1084,43 @@ error:
 }
 
 /**
- * @brief Free the channel and deallocate its resource.
+ * @brief Free the channel and deallocate its resource. A channel that is
+ * still open is closed without waiting for the peer: SSH_MSG_CHANNEL_CLOSE
+ * is sent if it was not, and the channel number is kept from new channels
+ * until the peer answers it, so that what the peer still sends for the
+ * channel is dropped rather than taken for the next channel.
  *
  * @param channel
  */
 void ssh_channel_free(ssh_channel channel) {
+    ssh_session session = channel->session;
+    ssh_channel slot = NULL;
+
+    if (session->in_channel == channel) {
+        ssh_buffer_pass_bytes(session->in_buffer, session->in_pending);
+        session->in_pending = 0;
+        session->in_channel = NULL;
+    }
+
+    if (!channel->local_close) {
+        if (ssh_buffer_pack(session->out_buffer, "bd", SSH_MSG_CHANNEL_CLOSE,
+                            channel->remote_channel) != SSH_OK) {
+            LOG_ERROR("can not create buffer");
+            ssh_buffer_reinit(session->out_buffer);
+        } else if (ssh_packet_send(session) == SSH_OK) {
+            channel->local_close = 1;
+        }
+    }
+    if (channel->local_close && !channel->remote_close) {
+        slot = CHANNEL_CLOSING;
+    }
+    if (channel->local_channel < session->channel_count &&
+        session->channels[channel->local_channel] == channel) {
+        session->channels[channel->local_channel] = slot;
+    }
+
     ssh_buffer_free(channel->out_buffer);
-    channel->session->channel = NULL;
+    SAFE_FREE(channel->ring);
     channel->session = NULL;
     SAFE_FREE(channel);
-}
\ No newline at end of file
+}
@@ -29,6 +29,27 @@
  * byte[m]   mac (Message Authentication Code - MAC); m = mac_length
  */
 
+/* RFC 4253 section 6.1, with room for channel packets up to
+ * SSH_CHANNEL_MAX_PACKET_LIMIT */
+#define MAX_PACKET_LEN (SSH_CHANNEL_MAX_PACKET_LIMIT + SSH_PACKET_OVERHEAD)
+/* bytes kept allocated by the session packet buffers, at least */
+#define PACKET_BUFFER_SIZE 65536
+/* the packet length and padding length fields */
+#define PACKET_HEADER_LEN 5
+
+/**
+ * @brief Bytes the session packet buffers keep allocated between packets:
+ * enough for the largest channel packet, so that they are not shrunk and
+ * grown again for every packet.
+ *
+ * @param session
+ * @return uint32_t
+ */
+static uint32_t packet_buffer_size(ssh_session session) {
+    return MAX(PACKET_BUFFER_SIZE,
+               session->opts.max_packet + SSH_PACKET_OVERHEAD);
+}
+
 /**
  * @brief Encrypt a packet.
  *
@@ -151,7 +172,7 @@ static uint32_t packet_decrypt_len(ssh_session session, uint8_t *destination,
         if (rc != SSH_OK) {
             return 0;
         }
-    } else {
+    } else if (destination != source) {
         memcpy(destination, source, 8);
     }
     memcpy(&packet_len, destination, sizeof(packet_len));
@@ -204,30 +225,64 @@ static int packet_hmac_verify(ssh_session session, const void *data, size_t len,
     return SSH_ERROR;
 }
 
+/**
+ * @brief Read the packet being received into in_buffer until `size` bytes
+ * of it are there. A non-blocking socket only gives what has arrived, the
+ * rest is read by the next call.
+ *
+ * @param session
+ * @param size
+ * @return SSH_OK once `size` bytes are read, SSH_AGAIN if not yet, SSH_ERROR
+ * on error.
+ */
+static int packet_read(ssh_session session, uint32_t size) {
+    uint32_t len = size - session->in_packet_read;
+    uint8_t *ptr;
+    int nread;
+
+    if (len == 0) return SSH_OK;
+
+    ptr = ssh_buffer_allocate(session->in_buffer, len);
+    if (ptr == NULL) return SSH_ERROR;
+
+    if (!session->socket->nonblocking) {
+        if (ssh_socket_read(session->socket, ptr, len) != SSH_OK) {
+            return SSH_ERROR;
+        }
+        nread = len;
+    } else {
+        nread = ssh_socket_read_nonblocking(session->socket, ptr, len);
+        if (nread < 0) return SSH_ERROR;
+        ssh_buffer_pass_bytes_end(session->in_buffer, len - nread);
+    }
+    session->in_packet_read += nread;
+
+    return (uint32_t)nread == len ? SSH_OK : SSH_AGAIN;
+}
+
 /**
  * @brief Read a binary packet from socket and decrypt it if key exchange is
  * completed. Extract the SSH message packet and store it in the session's
- * in_buffer
+ * in_buffer.
+ * The packet is read from the socket straight into in_buffer and decrypted
+ * in place, so each byte is only touched by the cipher once.
+ * In non-blocking mode, a packet that has not fully arrived is kept in
+ * in_buffer, and the next call goes on with it.
  * @param session
- * @return success or not
+ * @return SSH_OK on success, SSH_AGAIN if the packet has not fully arrived
+ * on a non-blocking session, SSH_ERROR on error.
  */
 int ssh_packet_receive(ssh_session session) {
-    uint8_t *data = NULL;
     uint32_t blocksize = 8;
     uint32_t lenfield_blocksize = 8;
     size_t current_macsize = 0;
     uint8_t *ptr = NULL;
     int to_be_read;
     int rc;
-    uint8_t *cleartext_packet = NULL;
-    uint8_t *packet_second_block = NULL;
     uint8_t *mac = NULL;
-    size_t packet_remaining;
     uint32_t packet_len;
     uint8_t padding;
-    size_t processed = 0; /* number of byte processed from the callback */
     struct ssh_crypto_struct *crypto = NULL;
-    bool ok;
 
     crypto = ssh_get_crypto(session, SSH_DIRECTION_IN);
     if (crypto != NULL) {
@@ -240,12 +295,11 @@ int ssh_packet_receive(ssh_session session) {
         lenfield_blocksize = blocksize;
     }
 
-    data = calloc(lenfield_blocksize, sizeof(uint8_t));
-
-    ssh_socket_read(session->socket, data, lenfield_blocksize);
-
-    if (session->in_buffer) {
-        rc = ssh_buffer_reinit(session->in_buffer);
+    if (session->in_packet_read > 0) {
+        /* go on with the packet in in_buffer */
+    } else if (session->in_buffer) {
+        rc = ssh_buffer_reinit_size(session->in_buffer,
+                                    packet_buffer_size(session), 0);
         if (rc < 0) {
             goto error;
         }
@@ -256,24 +310,37 @@ int ssh_packet_receive(ssh_session session) {
         }
     }
 
-    ptr = ssh_buffer_allocate(session->in_buffer, lenfield_blocksize);
-    if (ptr == NULL) {
-        goto error;
+    if (session->in_packet_read < lenfield_blocksize) {
+        rc = packet_read(session, lenfield_blocksize);
+        if (rc == SSH_AGAIN) return SSH_AGAIN;
+        if (rc != SSH_OK) goto error;
+
+        ptr = ssh_buffer_get(session->in_buffer);
+        packet_len = packet_decrypt_len(session, ptr, ptr);
+        to_be_read = packet_len - lenfield_blocksize + sizeof(uint32_t) +
+                     current_macsize;
+        if (packet_len > MAX_PACKET_LEN || to_be_read < (int)current_macsize) {
+            ssh_set_error(SSH_FATAL, "invalid packet length %u", packet_len);
+            goto error;
+        }
+        session->in_packet_size = lenfield_blocksize + to_be_read;
     }
-    packet_len = packet_decrypt_len(session, ptr, data);
-    to_be_read =
-        packet_len - lenfield_blocksize + sizeof(uint32_t) + current_macsize;
 
-    data = realloc(data, to_be_read * sizeof(uint8_t) + 1);
-    ssh_socket_read(session->socket, data, to_be_read);
+    rc = packet_read(session, session->in_packet_size);
+    if (rc == SSH_AGAIN) return SSH_AGAIN;
+    if (rc != SSH_OK) goto error;
+    session->in_packet_read = 0;
 
-    ptr = ssh_buffer_allocate(session->in_buffer, to_be_read - current_macsize);
-    if (ptr == NULL) goto error;
+    ptr = (uint8_t *)ssh_buffer_get(session->in_buffer) + lenfield_blocksize;
+    to_be_read = session->in_packet_size - lenfield_blocksize;
+    memcpy(&packet_len, ssh_buffer_get(session->in_buffer), sizeof(packet_len));
+    packet_len = ntohl(packet_len);
+    session->stats.socket_bytes += session->in_packet_size;
 
     if (crypto != NULL) {
-        mac = data + to_be_read - current_macsize;
+        mac = ptr + to_be_read - current_macsize;
         rc =
-            packet_decrypt(session, ptr, data, 0, to_be_read - current_macsize);
+            packet_decrypt(session, ptr, ptr, 0, to_be_read - current_macsize);
         if (rc != SSH_OK) {
             ssh_set_error(SSH_FATAL, "decryption error");
             goto error;
@@ -282,18 +349,16 @@ int ssh_packet_receive(ssh_session session) {
         // LAB(PT4): insert your code here.
         
 
-		rc = packet_hmac_verify(session, ptr - lenfield_blocksize,
+		rc = packet_hmac_verify(session, ssh_buffer_get(session->in_buffer),
                                 to_be_read - current_macsize + lenfield_blocksize,
 								mac, SSH_HMAC_SHA1);
         if (rc != SSH_OK) {
             ssh_set_error(SSH_FATAL, "hmac error");
             goto error;
         }
-    } else {
-        memcpy(ptr, data, to_be_read - current_macsize);
+        ssh_buffer_pass_bytes_end(session->in_buffer, current_macsize);
     }
 
-    SAFE_FREE(data);
     /* decryption completed */
     /* now decrypted packet is in in_buffer, extract payload and discard others
      */
@@ -325,8 +390,8 @@ int ssh_packet_receive(ssh_session session) {
     return SSH_OK;
 
 error:
-    SAFE_FREE(data);
     LOG_ERROR("packet receive error");
+    session->in_packet_read = 0;
     return SSH_ERROR;
 }
 
@@ -346,7 +411,7 @@ int ssh_packet_send(ssh_session session) {
     uint8_t padding_data[32] = {0};
     uint8_t padding_size;
     uint32_t finallen, payload_size;
-    uint8_t header[5] = {0};
+    uint8_t header[PACKET_HEADER_LEN] = {0};
     uint8_t type, *payload;
     int rc;
 
@@ -409,8 +474,9 @@ int ssh_packet_send(ssh_session session) {
         "payload=%u]",
         type, finallen, padding_size, payload_size);
 
-    /* be ready for next packet */
-    rc = ssh_buffer_reinit(session->out_buffer);
+    /* be ready for next packet, with room for its header in front */
+    rc = ssh_buffer_reinit_size(session->out_buffer,
+                                packet_buffer_size(session), PACKET_HEADER_LEN);
     if (rc < 0) {
         ssh_set_error(SSH_FATAL, "buffer error");
         return SSH_ERROR;
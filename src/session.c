@@ -13,6 +13,7 @@
 
 #include "libsftp/session.h"
 
+#include <poll.h>
 #include <string.h>
 
 #include "libsftp/auth.h"
@@ -21,6 +22,7 @@
 #include "libsftp/kex.h"
 #include "libsftp/knownhosts.h"
 #include "libsftp/logger.h"
+#include "libsftp/packet.h"
 
 /* We name the client identification string as the following in our
  * implementation */
@@ -76,6 +78,7 @@ void ssh_free(ssh_session session) {
 
     ssh_buffer_free(session->in_buffer);
     ssh_buffer_free(session->out_buffer);
+    SAFE_FREE(session->channels);
 
     crypto_free(session->next_crypto);
 }
@@ -143,6 +146,22 @@ int ssh_options_set(ssh_session session, enum ssh_options_e type,
                 }
             }
             break;
+        case SSH_OPTIONS_MAX_WINDOW:
+            if (value == NULL || *(const uint32_t *)value == 0) {
+                return SSH_ERROR;
+            }
+            session->opts.max_window = *(const uint32_t *)value;
+            break;
+        case SSH_OPTIONS_MAX_PACKET:
+            if (value == NULL || *(const uint32_t *)value < 1024 ||
+                *(const uint32_t *)value > SSH_CHANNEL_MAX_PACKET_LIMIT) {
+                ssh_set_error(SSH_REQUEST_DENIED,
+                              "max packet must be within 1024 and %d",
+                              SSH_CHANNEL_MAX_PACKET_LIMIT);
+                return SSH_ERROR;
+            }
+            session->opts.max_packet = *(const uint32_t *)value;
+            break;
         default:
             ssh_set_error(SSH_REQUEST_DENIED, "unknown option %d", type);
             return SSH_ERROR;
@@ -364,4 +383,72 @@ error:
     ssh_socket_close(session->socket);
     ssh_set_error(SSH_REQUEST_DENIED, "ssh connection failed");
     return SSH_ERROR;
-}
\ No newline at end of file
+}
+/**
+ * @brief Make the channel reads and writes of a session blocking, the
+ * default, or not.
+ *
+ * In non-blocking mode, ssh_channel_read() and ssh_channel_write() return
+ * what they could do without waiting for the network, or SSH_AGAIN if that
+ * is nothing, and ssh_channel_close() returns SSH_AGAIN until the peer
+ * closed too. Writes the socket does not take at once are queued, and go
+ * out with the next call on the session or with ssh_flush(). The caller
+ * polls ssh_get_fd() for ssh_get_poll_events() once every channel of the
+ * session it drives has returned SSH_AGAIN: a call on one channel may queue
+ * data for the others.
+ *
+ * Connecting, authenticating, opening channels and sending channel
+ * requests still wait for the peer. The SFTP layer needs blocking mode.
+ *
+ * @param session   a connected session
+ * @param blocking
+ * @return SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_set_blocking(ssh_session session, int blocking) {
+    if (session == NULL) return SSH_ERROR;
+    return ssh_socket_set_blocking(session->socket, blocking);
+}
+
+/**
+ * @brief Whether the channel reads and writes of a session block.
+ *
+ * @param session
+ * @return int
+ */
+int ssh_is_blocking(ssh_session session) {
+    return !session->socket->nonblocking;
+}
+
+/**
+ * @brief Get the socket of a session, to poll it.
+ *
+ * @param session
+ * @return the file descriptor.
+ */
+int ssh_get_fd(ssh_session session) { return session->socket->fd; }
+
+/**
+ * @brief Get the poll() events to wait for on the socket of a session:
+ * POLLIN, and POLLOUT while written data is queued.
+ *
+ * @param session
+ * @return int
+ */
+int ssh_get_poll_events(ssh_session session) {
+    if (ssh_buffer_get_len(session->socket->out_buffer) > 0) {
+        return POLLIN | POLLOUT;
+    }
+    return POLLIN;
+}
+
+/**
+ * @brief Write the data queued on the socket of a non-blocking session.
+ *
+ * @param session
+ * @return SSH_OK once nothing is queued, SSH_AGAIN if some is still,
+ * SSH_ERROR on error.
+ */
+int ssh_flush(ssh_session session) {
+    if (session == NULL) return SSH_ERROR;
+    return ssh_socket_flush(session->socket);
+}
@@ -1,8 +1,11 @@
 /**
  * @file stfp.c
  * @author Zhou Yuhan (zhouyuhan@pku.edu.cn)
- * @brief Implementaiton of SFTP functions, including APIs and helpers.
- * Only open, close, read, write of regular files are supported
+ * @brief Implementaiton of SFTP functions, including APIs and helpers:
+ * file IO with pipelined reads, read-ahead and write-behind, whole file
+ * transfers with resume, stat and a cache of attributes, directories and
+ * batched metadata changes, directory tree transfers, server side copy and
+ * hashing, and asynchronous requests.
  * @version 0.1
  * @date 2022-07-14
  *
@@ -10,8 +13,20 @@
  *
  */
 
+#ifdef LINUX
+/* fallocate() and SEEK_DATA */
+#define _GNU_SOURCE
+#endif
+
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stddef.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
 
 #include "libsftp/buffer.h"
 #include "libsftp/error.h"
@@ -22,13 +37,117 @@
 
 /* Buffer size maximum is 256M */
 #define SFTP_PACKET_SIZE_MAX 0x10000000
-#define SFTP_BUFFER_SIZE_MAX 16384
+
+/* Outstanding READ requests per sftp_read call, 1 disables pipelining */
+#define SFTP_DEFAULT_READ_DEPTH 1
+#define SFTP_MAX_READ_DEPTH 256
+/* length, type, id and data length fields of an SSH_FXP_DATA reply */
+#define SFTP_DATA_HEADER_LEN 13
+/* length, type, id, handle length, offset and data length fields, plus a
+ * handle of at most 256 bytes, of an SSH_FXP_WRITE request */
+#define SFTP_WRITE_HEADER_LEN (25 + 256)
+/* READ and WRITE sizes are raised up to this from SSH_FXP_MAXLEN when the
+ * server offers limits@openssh.com */
+#define SFTP_IO_MAX (256 * 1024)
+
+/* Attribute cache defaults, see sftp_set_attr_cache() */
+#define SFTP_ATTR_CACHE_ENTRIES 64
+#define SFTP_ATTR_CACHE_MAX_ENTRIES 1024
+#define SFTP_ATTR_CACHE_TTL 1000
+
+/* sftp_get_tree() and sftp_put_tree(): files in transfer at once, READ or
+ * WRITE requests in flight per file, and files found ahead of them. Files
+ * that fit in a single request are small, and up to SFTP_TREE_SWARM of them
+ * are in transfer at once besides the others. */
+#define SFTP_TREE_FILES 8
+#define SFTP_TREE_DEPTH 8
+#define SFTP_TREE_SWARM 64
+#define SFTP_TREE_QUEUE 256
+
+/* READ requests in flight, and WRITE requests waiting for their status,
+ * when sftp_copy() relays data through the client */
+#define SFTP_COPY_DEPTH 16
+
+/* Requests sftp_batch() keeps in flight; their status replies fit in the
+ * initial channel window */
+#define SFTP_BATCH_DEPTH 256
+
+/* Bytes a write buffer keeps in flight when the session has no
+ * write-behind, see sftp_set_write_buffer() */
+#define SFTP_WRITE_BUFFER_INFLIGHT (1024 * 1024)
+
+/* Sparse transfers skip zeros in whole blocks of this size, aligned on file
+ * offsets, see SFTP_GET_SPARSE and SFTP_PUT_SPARSE */
+#define SFTP_SPARSE_BLOCK 4096
+
+/* Hash algorithms known to check-file, the `<algorithm>sum` tools and
+ * OpenSSL alike, and the local read size of sftp_hash_local() */
+#define SFTP_HASH_ALGORITHMS \
+    "md5", "sha1", "sha224", "sha256", "sha384", "sha512"
+#define SFTP_HASH_CHUNK (64 * 1024)
+
+/* Block hashes asked for by one check-file request of sftp_put_delta(), in
+ * bytes, and such requests in flight. A reply also names the extension and
+ * the algorithm, within SFTP_DELTA_REPLY_LEN. */
+#define SFTP_DELTA_REPLY (32 * 1024)
+#define SFTP_DELTA_REPLY_LEN (SFTP_DELTA_REPLY + 64)
+#define SFTP_DELTA_DEPTH 4
+
+/* An entry of the pending request table, `req` is NULL once answered */
+struct sftp_pending_entry {
+    uint32_t id;
+    sftp_request req;
+};
+
+/* A cached SSH_FXP_STAT or SSH_FXP_LSTAT result, `attr` is NULL when the
+ * server answered with status `code` */
+struct sftp_attr_cache_entry {
+    char *path;
+    uint8_t type;
+    uint64_t expires; /* CLOCK_MONOTONIC milliseconds */
+    sftp_attributes attr;
+    uint32_t code;
+};
 
 struct sftp_session_struct {
     ssh_session session;
     uint32_t id_counter;
     uint32_t version;
     ssh_channel channel;
+    uint32_t read_depth;
+
+    /* extension pairs of SSH_FXP_VERSION */
+    char **ext_names;
+    char **ext_data;
+    uint32_t ext_count;
+    /* limits@openssh.com reply, zeroes if not offered, and the READ and
+     * WRITE sizes derived from it */
+    struct sftp_limits_struct limits;
+    uint32_t max_read;
+    uint32_t max_write;
+
+    /* requests waiting for a reply, sorted by id */
+    struct sftp_pending_entry *pending;
+    uint32_t pending_head;
+    uint32_t pending_tail;
+    uint32_t pending_alloc;
+
+    /* write-behind: bytes allowed in flight, 0 waits for every status */
+    uint32_t write_behind;
+    uint32_t write_inflight;
+    /* outstanding write-behind requests, oldest first */
+    sftp_request *writes;
+    uint32_t write_head;
+    uint32_t write_count;
+    uint32_t write_alloc;
+    /* fsync@openssh.com after this many bytes of sftp_write(), 0 for never */
+    uint64_t fsync_interval;
+
+    /* attribute cache, unordered, see sftp_stat() */
+    struct sftp_attr_cache_entry *attr_cache;
+    uint32_t attr_cache_count;
+    uint32_t attr_cache_size;
+    uint32_t attr_cache_ttl;
 };
 
 struct sftp_packet_struct {
@@ -37,12 +156,163 @@ struct sftp_packet_struct {
     ssh_buffer payload;
 };
 
+/* A read-ahead request and the bytes it brought, see sftp_set_read_ahead() */
+struct sftp_ra_chunk {
+    sftp_request req; /* for the bytes after `filled`, NULL if none */
+    uint64_t offset;
+    uint32_t size;   /* bytes asked for, cut at the end of file */
+    uint32_t filled; /* bytes received */
+    uint32_t pos;    /* bytes consumed */
+};
+
 /* file handle */
 struct sftp_file_struct {
     sftp_session sftp;
     uint64_t offset;
     ssh_string handle;
+    char *path; /* as passed to sftp_open() */
     uint8_t eof;
+
+    /* first failed write-behind request, reported on the next call */
+    bool write_failed;
+    uint32_t write_error;
+    uint64_t write_error_offset;
+    /* bytes written with sftp_write() since the last fsync request */
+    uint64_t unsynced;
+
+    /* write buffer: `wbuf_len` bytes gathered for `wbuf_offset`, sent once
+     * `wbuf_size` are, see sftp_set_write_buffer() */
+    uint8_t *wbuf;
+    uint32_t wbuf_size;
+    uint32_t wbuf_len;
+    uint64_t wbuf_offset;
+
+    /* read-ahead: a ring of `ra_slots` chunks following the file offset,
+     * oldest first, chunk i reading into ra_data + i * ra_chunk */
+    struct sftp_ra_chunk *ra;
+    uint8_t *ra_data;
+    uint32_t ra_slots;
+    uint32_t ra_chunk;
+    uint32_t ra_head;
+    uint32_t ra_count;
+    uint32_t ra_depth; /* chunks to keep asked for, doubles up to ra_slots */
+    uint64_t ra_next;  /* offset of the next request */
+    bool ra_eof;      /* a reply hit the end of file, stop asking */
+};
+
+/* directory listing, see sftp_opendir() */
+struct sftp_dir_struct {
+    sftp_session sftp;
+    ssh_string handle;
+    /* the next SSH_FXP_READDIR, in flight while `batch` is consumed */
+    sftp_request next;
+    /* the SSH_FXP_NAME reply being consumed and its entries left */
+    sftp_packet batch;
+    uint32_t left;
+    bool eof;
+    /* the current entry; its names are buffers reused for every entry */
+    struct sftp_attributes_struct entry;
+    uint32_t name_alloc;
+    uint32_t longname_alloc;
+};
+
+/* a file of a tree transfer; `size` is UINT64_MAX if unknown */
+struct sftp_tree_item {
+    char *remote;
+    char *local;
+    mode_t mode;
+    uint64_t size;
+};
+
+/* a directory of a tree transfer; on upload, `mkdir` is its SSH_FXP_MKDIR
+ * until the reply has been checked */
+struct sftp_tree_dir {
+    char *remote;
+    char *local;
+    sftp_request mkdir;
+};
+
+enum sftp_tree_state {
+    SFTP_TREE_IDLE,
+    SFTP_TREE_OPENING,
+    SFTP_TREE_DATA,
+    SFTP_TREE_CLOSING
+};
+
+/* a file in transfer, see sftp_tree_run() */
+struct sftp_tree_slot {
+    enum sftp_tree_state state;
+    struct sftp_tree_item item;
+    /* the file fits in a single request, see SFTP_TREE_SWARM */
+    bool small;
+    int fd;
+    sftp_file file;
+    /* the SSH_FXP_OPEN or SSH_FXP_CLOSE in flight */
+    sftp_request req;
+    /* READ or WRITE requests in flight, oldest first */
+    sftp_request reqs[SFTP_TREE_DEPTH];
+    uint32_t head;
+    uint32_t count;
+    /* offset of the next request, and whether the data ends there */
+    uint64_t next;
+    bool eof;
+    /* a read came back short after the CLOSE was sent: the file is opened
+     * again for the rest once it is closed */
+    bool reopen;
+    /* download: the byte at the listed size, read to tell whether the file
+     * grew since it was listed */
+    uint8_t probe;
+    /* download: a buffer of max_read bytes per entry of `reqs`, only one
+     * while the slot has only had small files */
+    uint8_t *bufs;
+    uint32_t bufs_count;
+};
+
+/* state of sftp_get_tree() and sftp_put_tree() */
+struct sftp_tree {
+    sftp_session sftp;
+    bool upload;
+    /* directories still to walk, `dirs[dir_head]` first */
+    struct sftp_tree_dir *dirs;
+    uint32_t dir_head;
+    uint32_t dir_count;
+    uint32_t dir_alloc;
+    /* the directory being walked */
+    struct sftp_tree_dir cur;
+    DIR *local_dir;
+    sftp_dir remote_dir;
+    bool walked;
+    /* files found but not started yet */
+    struct sftp_tree_item queue[SFTP_TREE_QUEUE];
+    uint32_t queue_head;
+    uint32_t queue_count;
+    /* slots in use at most, within the open handle limit of the server, and
+     * those with a file that is not small */
+    struct sftp_tree_slot slots[SFTP_TREE_FILES + SFTP_TREE_SWARM];
+    uint32_t slot_count;
+    uint32_t large;
+    /* READ or WRITE requests in flight over all slots */
+    uint32_t inflight;
+    /* upload: the chunk read from a local file */
+    uint8_t *chunk;
+};
+
+/* an asynchronous request, see sftp_request_wait() */
+struct sftp_request_struct {
+    sftp_session sftp;
+    uint32_t id;
+    uint8_t type;
+    bool cancelled;
+    sftp_packet reply;
+    sftp_file file;
+    uint64_t offset;
+    uint32_t len;
+    /* SSH_FXP_DATA is read from the channel straight into `dest` if set */
+    void *dest;
+    bool delivered;
+    uint32_t nread;
+    /* path of an SSH_FXP_OPEN request */
+    char *path;
 };
 
 /* SSH_FXP_MESSAGE described into .7 page 26 */
@@ -53,31 +323,6 @@ struct sftp_status_struct {
     char *langtag;
 };
 
-struct sftp_attributes_struct {
-    char *name;
-    char *longname; /* ls -l output on openssh, not reliable else */
-    uint32_t flags;
-    uint8_t type;
-    uint64_t size;
-    uint32_t uid;
-    uint32_t gid;
-    char *owner; /* set if openssh and version 4 */
-    char *group; /* set if openssh and version 4 */
-    uint32_t permissions;
-    uint64_t atime64;
-    uint32_t atime;
-    uint32_t atime_nseconds;
-    uint64_t createtime;
-    uint32_t createtime_nseconds;
-    uint64_t mtime64;
-    uint32_t mtime;
-    uint32_t mtime_nseconds;
-    ssh_string acl;
-    uint32_t extended_count;
-    ssh_string extended_type;
-    ssh_string extended_data;
-};
-
 static void sftp_status_free(sftp_status status);
 static sftp_packet sftp_packet_new(sftp_session sftp);
 static void sftp_packet_free(sftp_packet packet);
@@ -85,17 +330,123 @@ static void sftp_file_free(sftp_file file);
 static sftp_status sftp_parse_status(sftp_packet packet);
 static sftp_file sftp_parse_handle(sftp_packet packet, uint32_t orig_id);
 static sftp_packet sftp_packet_read(sftp_session sftp);
+static int sftp_packet_read_payload(sftp_session sftp, sftp_packet packet,
+                                    const void *prefix, uint32_t prefix_len,
+                                    uint32_t size);
 static int32_t sftp_packet_write(sftp_session sftp, uint8_t type,
                                  ssh_buffer payload);
 
+static sftp_request sftp_request_send(sftp_session sftp, uint8_t type,
+                                      uint32_t id, ssh_buffer payload);
+static void sftp_request_free(sftp_request req);
+static sftp_request sftp_pending_take(sftp_session sftp, uint32_t id);
+static int sftp_dispatch(sftp_session sftp);
+static int sftp_request_status(sftp_request req, uint32_t *code);
+static int32_t sftp_read_pipelined(sftp_file file, void *buf,
+                                   uint32_t count);
+static int32_t sftp_write_behind(sftp_file file, const void *buf,
+                                 uint32_t count);
+static int32_t sftp_read_ahead(sftp_file file, void *buf, uint32_t count);
+static void sftp_ra_drop(sftp_file file);
+static int sftp_get_range(sftp_file file, sftp_request *req, void *buf,
+                          uint64_t offset, uint32_t len);
+static sftp_attributes sftp_parse_attr(ssh_buffer buffer);
+static int sftp_parse_attr_into(ssh_buffer buffer, sftp_attributes attr);
+static sftp_request sftp_readdir_send(sftp_dir dir);
+static int sftp_dir_next_batch(sftp_dir dir);
+static int sftp_dir_take_string(ssh_buffer buffer, char **str,
+                                uint32_t *alloc);
+static sftp_attributes sftp_attributes_copy(sftp_attributes attr);
+static sftp_attributes sftp_xstat(sftp_session sftp, const char *path,
+                                  uint8_t type);
+static sftp_attributes sftp_attr_result(sftp_request req, const char *path,
+                                        uint32_t *code);
+static struct sftp_attr_cache_entry *sftp_attr_cache_find(sftp_session sftp,
+                                                          const char *path,
+                                                          uint8_t type);
+static void sftp_attr_cache_store(sftp_session sftp, const char *path,
+                                  uint8_t type, sftp_attributes attr,
+                                  uint32_t code);
+static void sftp_attr_cache_invalidate(sftp_session sftp, const char *path);
+static int sftp_ftruncate(sftp_file file, uint64_t size);
+static int sftp_pack_attr(ssh_buffer buffer, sftp_attributes attr);
+static const char *sftp_batch_name(int op);
+static sftp_request sftp_batch_send(sftp_session sftp,
+                                    const struct sftp_batch_item *item);
+static int sftp_resume_verify(sftp_file file, int fd, uint64_t offset,
+                              bool *match);
+static int sftp_drain_writes(sftp_session sftp);
+static int sftp_check_write_error(sftp_file file);
+static int sftp_write_queue(sftp_session sftp, sftp_request req);
+static int sftp_queue_fsync(sftp_file file, uint64_t offset);
+static int sftp_write_send(sftp_file file, uint64_t offset, const void *buf,
+                           uint32_t len);
+static int32_t sftp_write_buffered(sftp_file file, const void *buf,
+                                   uint32_t count);
+static int sftp_wbuf_flush(sftp_file file);
+static uint32_t sftp_sparse_run(const uint8_t *buf, uint32_t len,
+                                uint64_t offset, bool *zero);
+static int sftp_pwrite_sparse(int fd, const uint8_t *buf, uint32_t len,
+                              uint64_t offset, uint64_t hole_from);
+static char *sftp_path_join(const char *dir, const char *name);
+static int sftp_parse_extensions(sftp_session sftp, ssh_buffer buffer);
+static int sftp_query_limits(sftp_session sftp);
+static int64_t sftp_copy_data(sftp_file from, sftp_file to, uint64_t len);
+static int64_t sftp_copy_relay(sftp_file from, sftp_file to, uint64_t len);
+static const EVP_MD *sftp_hash_digest(const char *algorithm);
+static sftp_request sftp_check_file_send(sftp_session sftp, sftp_file file,
+                                         const char *path,
+                                         const char *algorithm,
+                                         uint64_t offset, uint64_t len,
+                                         uint32_t block_size);
+static int sftp_check_file_reply(sftp_request req, const char *algorithm,
+                                 unsigned char *digest, size_t max_len,
+                                 size_t *digest_len, uint32_t *code);
+static int sftp_check_file(sftp_session sftp, sftp_file file, const char *path,
+                           const char *algorithm, uint64_t offset,
+                           uint64_t len, unsigned char *digest,
+                           size_t *digest_len, uint32_t *code);
+static int sftp_write_range(sftp_file file, uint64_t offset,
+                            const uint8_t *buf, uint64_t len);
+static int sftp_delta_hashed(sftp_file file, int fd, const char *algorithm,
+                             uint32_t block_size, uint64_t end,
+                             uint64_t *sent, uint32_t *code);
+static int sftp_delta_read(sftp_file file, int fd, uint32_t block_size,
+                           uint64_t end, uint64_t *sent);
+static int sftp_hash_exec(sftp_session sftp, const char *path,
+                          const char *algorithm, uint64_t offset,
+                          uint64_t len, unsigned char *digest,
+                          size_t *digest_len);
+static struct sftp_tree *sftp_tree_new(sftp_session sftp, bool upload);
+static void sftp_tree_free(struct sftp_tree *tree);
+static int sftp_tree_push_dir(struct sftp_tree *tree,
+                              const struct sftp_tree_dir *dir);
+static int sftp_tree_run(struct sftp_tree *tree);
+
 static uint32_t sftp_get_new_id(sftp_session sftp) {
     return ++sftp->id_counter;
 }
 
+/**
+ * @brief Refuse a non-blocking session: the sftp calls wait for their
+ * replies and have no way to return SSH_AGAIN halfway through a packet.
+ *
+ * @param session
+ * @return SSH_OK if the session blocks, SSH_ERROR otherwise.
+ */
+static int sftp_check_blocking(ssh_session session) {
+    if (!ssh_is_blocking(session)) {
+        ssh_set_error(SSH_REQUEST_DENIED,
+                      "sftp needs a blocking session, see ssh_set_blocking()");
+        return SSH_ERROR;
+    }
+    return SSH_OK;
+}
+
 sftp_session sftp_new(ssh_session session) {
     sftp_session sftp;
 
-    if (session == NULL) {
+    if (session == NULL || sftp_check_blocking(session) != SSH_OK) {
         return NULL;
     }
 
@@ -105,9 +456,12 @@ sftp_session sftp_new(ssh_session session) {
         return NULL;
     }
 
-    /* Skip: SFTP extended data */
-
     sftp->session = session;
+    sftp->read_depth = SFTP_DEFAULT_READ_DEPTH;
+    sftp->max_read = SSH_FXP_MAXLEN;
+    sftp->max_write = SSH_FXP_MAXLEN;
+    sftp->attr_cache_size = SFTP_ATTR_CACHE_ENTRIES;
+    sftp->attr_cache_ttl = SFTP_ATTR_CACHE_TTL;
     sftp->channel = ssh_channel_new(session);
     if (sftp->channel == NULL) {
         LOG_ERROR("can not create ssh channel");
@@ -138,6 +492,8 @@ int sftp_init(sftp_session sftp) {
     uint32_t version;
     int rc;
 
+    if (sftp_check_blocking(sftp->session) != SSH_OK) return SSH_ERROR;
+
     sftp->version = LIBSFTP_VERSION;
     sftp->id_counter = 0;
 
@@ -196,14 +552,59 @@ int sftp_init(sftp_session sftp) {
         return SSH_ERROR;
     }
 
+    rc = sftp_parse_extensions(sftp, response->payload);
+    sftp_packet_free(response);
+    if (rc != SSH_OK) return SSH_ERROR;
+
+    if (sftp_extension_supported(sftp, "limits@openssh.com", "1")) {
+        if (sftp_query_limits(sftp) != SSH_OK) return SSH_ERROR;
+    }
+
     return SSH_OK;
 }
 
-sftp_file sftp_open(sftp_session sftp, const char *filename, int flags,
-                    mode_t mode) {
-    sftp_packet response = NULL;
-    sftp_status status = NULL;
-    sftp_file handle = NULL;
+unsigned int sftp_extensions_get_count(sftp_session sftp) {
+    if (sftp == NULL) return 0;
+    return sftp->ext_count;
+}
+
+const char *sftp_extensions_get_name(sftp_session sftp, unsigned int idx) {
+    if (sftp == NULL || idx >= sftp->ext_count) return NULL;
+    return sftp->ext_names[idx];
+}
+
+const char *sftp_extensions_get_data(sftp_session sftp, unsigned int idx) {
+    if (sftp == NULL || idx >= sftp->ext_count) return NULL;
+    return sftp->ext_data[idx];
+}
+
+int sftp_extension_supported(sftp_session sftp, const char *name,
+                             const char *data) {
+    uint32_t i;
+
+    if (sftp == NULL || name == NULL) return 0;
+
+    for (i = 0; i < sftp->ext_count; i++) {
+        if (strcmp(sftp->ext_names[i], name) == 0 &&
+            (data == NULL || strcmp(sftp->ext_data[i], data) == 0)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int sftp_get_limits(sftp_session sftp, struct sftp_limits_struct *limits) {
+    if (sftp == NULL || limits == NULL) return SSH_ERROR;
+
+    *limits = sftp->limits;
+    limits->max_read_length = sftp->max_read;
+    limits->max_write_length = sftp->max_write;
+    return SSH_OK;
+}
+
+sftp_request sftp_async_open(sftp_session sftp, const char *filename,
+                             int flags, mode_t mode) {
+    sftp_request req = NULL;
     ssh_buffer buffer = NULL;
     uint32_t perm_flags = 0;
     uint32_t attr_flags =
@@ -239,55 +640,88 @@ sftp_file sftp_open(sftp_session sftp, const char *filename, int flags,
     /* pack a new SFTP packet and send it using `sftp_packet_write` */
     // LAB(PT6): insert your code here.
 
-    if ((rc = ssh_buffer_pack(buffer, "dsddd", id, filename, perm_flags, attr_flags, 0)) != SSH_OK) {
+    if ((rc = ssh_buffer_pack(buffer, "dsddd", id, filename, perm_flags, attr_flags,
+                              (uint32_t)(mode & 07777))) != SSH_OK) {
         LOG_CRITICAL("can not pack buffer");
         ssh_set_error(SSH_FATAL, "buffer error");
         ssh_buffer_free(buffer);
         return NULL;
     }
 
-    if (sftp_packet_write(sftp, SSH_FXP_OPEN, buffer) < 0) {
-        LOG_CRITICAL("can not send open request");
-        ssh_set_error(SSH_FATAL, "open request error");
-        ssh_buffer_free(buffer);
-        return NULL;
+    /* opening for writing may create or truncate the file */
+    if (perm_flags & SSH_FXF_WRITE) {
+        sftp_attr_cache_invalidate(sftp, filename);
     }
+
+    req = sftp_request_send(sftp, SSH_FXP_OPEN, id, buffer);
     ssh_buffer_free(buffer);
+    if (req != NULL) {
+        req->path = strdup(filename);
+        if (req->path == NULL) {
+            ssh_set_error(SSH_FATAL, "out of memory");
+            sftp_request_cancel(req);
+            return NULL;
+        }
+    }
 
-    response = sftp_packet_read(sftp);
-    if (response == NULL) {
-        ssh_set_error(SSH_FATAL, "can not read sftp packet");
-        ssh_buffer_free(buffer);
+    return req;
+}
+
+sftp_file sftp_async_open_result(sftp_request req) {
+    sftp_packet response = NULL;
+    sftp_status status = NULL;
+    sftp_file handle = NULL;
+
+    if (req == NULL) return NULL;
+
+    if (sftp_request_wait(req) != SSH_OK) {
+        sftp_request_cancel(req);
         return NULL;
     }
+    response = req->reply;
 
     switch (response->type) {
         case SSH_FXP_STATUS:
             // LAB(PT6): insert your code here.
             status = sftp_parse_status(response);
-            ssh_set_error(SSH_FATAL, "open response with error code %d, error message %s",
-                status->status, status->errormsg);
-            sftp_packet_free(response);
+            if (status == NULL) {
+                ssh_set_error(SSH_FATAL, "malformed sftp status");
+            } else {
+                ssh_set_error(SSH_FATAL,
+                              "open response with error code %d, error "
+                              "message %s",
+                              status->status, status->errormsg);
+            }
+            sftp_status_free(status);
+            sftp_request_free(req);
             return NULL;
         case SSH_FXP_HANDLE:
             // LAB(PT6): insert your code here.
-            handle = sftp_parse_handle(response, id);
-            sftp_packet_free(response);
+            handle = sftp_parse_handle(response, req->id);
+            if (handle != NULL) {
+                handle->path = req->path;
+                req->path = NULL;
+            }
+            sftp_request_free(req);
             return handle;
         default:
             // LAB(PT6): insert your code here.
             ssh_set_error(SSH_FATAL, "unexpected sftp open response type");
-            sftp_packet_free(response);
+            sftp_request_free(req);
             return NULL;
     }
     return NULL;
 }
 
-int sftp_close(sftp_file file) {
+sftp_file sftp_open(sftp_session sftp, const char *filename, int flags,
+                    mode_t mode) {
+    return sftp_async_open_result(
+        sftp_async_open(sftp, filename, flags, mode));
+}
+
+sftp_request sftp_async_close(sftp_file file) {
     sftp_session sftp = file->sftp;
-    ssh_string handle = file->handle;
-    sftp_packet response = NULL;
-    sftp_status status = NULL;
+    sftp_request req = NULL;
     ssh_buffer buffer = NULL;
     uint32_t id;
     int rc;
@@ -296,398 +730,4993 @@ int sftp_close(sftp_file file) {
     if (buffer == NULL) {
         LOG_CRITICAL("can not create ssh buffer");
         ssh_set_error(SSH_FATAL, "buffer error");
-        return SSH_ERROR;
+        return NULL;
     }
 
     id = sftp_get_new_id(sftp);
 
-    if ((rc = ssh_buffer_pack(buffer, "dS", id, handle)) != SSH_OK) {
+    if ((rc = ssh_buffer_pack(buffer, "dS", id, file->handle)) != SSH_OK) {
         LOG_CRITICAL("can not pack buffer");
         ssh_set_error(SSH_FATAL, "buffer error");
         ssh_buffer_free(buffer);
+        return NULL;
+    }
+
+    sftp_attr_cache_invalidate(sftp, file->path);
+    sftp_ra_drop(file);
+
+    req = sftp_request_send(sftp, SSH_FXP_CLOSE, id, buffer);
+    ssh_buffer_free(buffer);
+    if (req != NULL) req->file = file;
+
+    return req;
+}
+
+int sftp_async_close_result(sftp_request req) {
+    sftp_file file;
+    uint32_t code;
+
+    if (req == NULL) return SSH_ERROR;
+    file = req->file;
+
+    // LAB(PT6): insert your code here.
+    /* the handle is of no use after a CLOSE, whatever the reply */
+    if (sftp_request_status(req, &code) != SSH_OK) {
+        ssh_set_error(SSH_FATAL, "unexpected sftp close response type");
+        sftp_request_cancel(req);
+        sftp_file_free(file);
         return SSH_ERROR;
     }
+    sftp_request_free(req);
+    sftp_file_free(file);
 
-    if (sftp_packet_write(sftp, SSH_FXP_CLOSE, buffer) < 0) {
-        LOG_CRITICAL("can not send close request");
-        ssh_set_error(SSH_FATAL, "close request error");
-        ssh_buffer_free(buffer);
+    if (code != SSH_FX_OK) {
+        ssh_set_error(SSH_FATAL, "close response with error code %d", code);
         return SSH_ERROR;
     }
-    ssh_buffer_free(buffer);
+    return SSH_OK;
+}
 
-    response = sftp_packet_read(sftp);
-    if (response == NULL) {
-        ssh_set_error(SSH_FATAL, "can not read sftp packet");
-        ssh_buffer_free(buffer);
+int sftp_close(sftp_file file) {
+    sftp_session sftp = file->sftp;
+    bool write_failed;
+    int rc;
+
+    /* buffered bytes and the last durability point go out behind the
+     * outstanding writes, unless a write has failed already */
+    if (sftp_wbuf_flush(file) != SSH_OK && !file->write_failed) {
+        return SSH_ERROR;
+    }
+    if (sftp->fsync_interval > 0 && file->unsynced > 0 &&
+        !file->write_failed &&
+        sftp_queue_fsync(file, file->offset) != SSH_OK) {
         return SSH_ERROR;
     }
 
-    switch (response->type) {
-        // LAB(PT6): insert your code here.
-        case SSH_FXP_STATUS:
-            status = sftp_parse_status(response);
-            sftp_packet_free(response);
-            sftp_file_free(file);
-            return SSH_OK;
-        default:
-            ssh_set_error(SSH_FATAL, "unexpected sftp close response type");
-            sftp_packet_free(response);
-            return SSH_ERROR;
+    /* the handle is closed even if a write-behind request failed */
+    if (sftp_drain_writes(sftp) != SSH_OK) return SSH_ERROR;
+    write_failed = sftp_check_write_error(file) != SSH_OK;
+
+    rc = sftp_async_close_result(sftp_async_close(file));
+    if (rc == SSH_OK && write_failed) {
+        /* the file is gone, but the error message is still there */
+        return SSH_ERROR;
     }
+    return rc;
 }
 
-int32_t sftp_read(sftp_file file, void *buf, uint32_t count) {
+sftp_request sftp_async_read(sftp_file file, uint64_t offset, uint32_t len) {
     sftp_session sftp = file->sftp;
-    sftp_packet response = NULL;
-    sftp_status status = NULL;
-    ssh_string data = NULL;
-    uint32_t recvlen;
+    sftp_request req = NULL;
     ssh_buffer buffer = NULL;
     uint32_t id;
-    uint32_t recv_id;
     int rc;
 
-    if (file->eof) return 0;
-
     buffer = ssh_buffer_new();
     if (buffer == NULL) {
         LOG_CRITICAL("can not create ssh buffer");
         ssh_set_error(SSH_FATAL, "buffer error");
-        return SSH_ERROR;
+        return NULL;
     }
 
     id = sftp_get_new_id(sftp);
 
-    rc = ssh_buffer_pack(buffer, "dSqd", id, file->handle, file->offset, count);
+    rc = ssh_buffer_pack(buffer, "dSqd", id, file->handle, offset, len);
     if (rc != SSH_OK) {
         LOG_CRITICAL("can not pack buffer");
         ssh_set_error(SSH_FATAL, "buffer error");
         ssh_buffer_free(buffer);
-        return SSH_ERROR;
+        return NULL;
     }
 
-    if (sftp_packet_write(sftp, SSH_FXP_READ, buffer) < 0) {
-        LOG_CRITICAL("can not send read request");
-        ssh_set_error(SSH_FATAL, "read request error");
-        ssh_buffer_free(buffer);
-        return SSH_ERROR;
-    }
+    req = sftp_request_send(sftp, SSH_FXP_READ, id, buffer);
     ssh_buffer_free(buffer);
+    if (req != NULL) {
+        req->file = file;
+        req->offset = offset;
+        req->len = len;
+    }
 
-    response = sftp_packet_read(sftp);
-    if (response == NULL) {
-        ssh_set_error(SSH_FATAL, "can not read sftp packet");
-        ssh_buffer_free(buffer);
+    return req;
+}
+
+int32_t sftp_async_read_result(sftp_request req, void *buf, uint32_t count) {
+    sftp_packet response = NULL;
+    sftp_status status = NULL;
+    ssh_string data = NULL;
+    uint32_t recvlen;
+    uint32_t recv_id;
+    int rc;
+
+    if (req == NULL) return SSH_ERROR;
+
+    if (sftp_request_wait(req) != SSH_OK) {
+        sftp_request_cancel(req);
         return SSH_ERROR;
     }
+    response = req->reply;
 
     switch (response->type) {
         // LAB(PT6): insert your code here.
         case SSH_FXP_STATUS:
             status = sftp_parse_status(response);
+            if (status == NULL) {
+                ssh_set_error(SSH_FATAL, "malformed sftp status");
+                sftp_request_free(req);
+                return SSH_ERROR;
+            }
             if (status->status == SSH_FX_EOF){
-                sftp_packet_free(response);
+                sftp_status_free(status);
+                sftp_request_free(req);
                 return 0; // special judge
             }
             ssh_set_error(SSH_FATAL, "read response with error code %d, error message %s",
                 status->status, status->errormsg);
-            sftp_packet_free(response);
+            sftp_status_free(status);
+            sftp_request_free(req);
             return SSH_ERROR;
         case SSH_FXP_DATA:
+            if (req->delivered && req->dest == buf) {
+                /* already in place, see `sftp_dispatch` */
+                recvlen = req->nread;
+                sftp_request_free(req);
+                return recvlen;
+            }
             rc = ssh_buffer_unpack(response->payload, "dS", &recv_id, &data);
+            if (rc != SSH_OK) {
+                ssh_set_error(SSH_FATAL, "malformed sftp data");
+                sftp_request_free(req);
+                return SSH_ERROR;
+            }
             recvlen = ssh_string_len(data);
+            if (recvlen > count) {
+                ssh_set_error(SSH_FATAL,
+                              "server sent %u bytes for a %u bytes read",
+                              recvlen, count);
+                SSH_STRING_FREE(data);
+                sftp_request_free(req);
+                return SSH_ERROR;
+            }
             memcpy(buf, ssh_string_get_char(data), recvlen);
-            file->offset += recvlen;
-            sftp_packet_free(response);
+            req->sftp->session->stats.copied_bytes += recvlen;
+            SSH_STRING_FREE(data);
+            sftp_request_free(req);
             return recvlen;
         default:
             ssh_set_error(SSH_FATAL, "unexpected sftp read response type");
-            sftp_packet_free(response);
+            sftp_request_free(req);
             return SSH_ERROR;
     }
     return SSH_ERROR;
 }
 
-int32_t sftp_write(sftp_file file, const void *buf, uint32_t count) {
-    sftp_session sftp = file->sftp;
-    sftp_packet response = NULL;
-    sftp_status status = NULL;
-    ssh_string data = NULL;
-    uint32_t nleft = count;
-    uint32_t nwrite;
-    uint32_t nsend;
-    ssh_buffer buffer = NULL;
-    uint32_t id;
-    int rc;
-
-    while (nleft > 0) {
-        buffer = ssh_buffer_new();
-        if (buffer == NULL) {
-            LOG_CRITICAL("can not create ssh buffer");
-            ssh_set_error(SSH_FATAL, "buffer error");
-            return SSH_ERROR;
-        }
+int32_t sftp_read(sftp_file file, void *buf, uint32_t count) {
+    sftp_request req;
+    int32_t nread;
 
-        id = sftp_get_new_id(sftp);
+    if (file->eof) return 0;
 
-        nwrite = MIN(nleft, SSH_FXP_MAXLEN);
+    /* buffered bytes may be read back */
+    if (sftp_wbuf_flush(file) != SSH_OK) return SSH_ERROR;
 
-        rc = ssh_buffer_pack(buffer, "dSqdP", id, file->handle, file->offset,
-                             nwrite, nwrite, (char *)buf + (count - nleft));
-        if (rc != SSH_OK) {
-            LOG_CRITICAL("can not pack buffer");
-            ssh_set_error(SSH_FATAL, "buffer error");
-            ssh_buffer_free(buffer);
-            return SSH_ERROR;
-        }
+    if (file->ra_slots > 0) return sftp_read_ahead(file, buf, count);
 
-        nsend = sftp_packet_write(sftp, SSH_FXP_WRITE, buffer);
-        ssh_buffer_free(buffer);
+    if (file->sftp->read_depth > 1 && count > file->sftp->max_read) {
+        return sftp_read_pipelined(file, buf, count);
+    }
 
-        response = sftp_packet_read(sftp);
-        if (response == NULL) {
-            ssh_set_error(SSH_FATAL, "can not read sftp packet");
-            ssh_buffer_free(buffer);
-            return SSH_ERROR;
-        }
+    req = sftp_async_read(file, file->offset, count);
+    if (req != NULL) req->dest = buf;
+    nread = sftp_async_read_result(req, buf, count);
+    if (nread > 0) file->offset += nread;
 
-        switch (response->type) {
-            // LAB(PT6): insert your code here.
-            case SSH_FXP_STATUS:
-                status = sftp_parse_status(response);
-                if (status->status == SSH_FX_OK){
-                    file->offset += nwrite;
-                    nleft -= nwrite;
-                    sftp_packet_free(response);
-                    break;
-                }
-                else{
-                    LOG_DEBUG("write response with error code %d, error message %s",
-                        status->status, status->errormsg);
-                    sftp_packet_free(response);
-                    return SSH_ERROR;
-                }
-            default:
-                ssh_set_error(SSH_FATAL, "unexpected sftp write response type");
-                sftp_packet_free(response);
-                return SSH_ERROR;
-        }
-    }
-    return count - nleft;
+    return nread;
 }
 
-void sftp_free(sftp_session sftp) {
-    if (sftp == NULL) return;
-    if (sftp->channel != NULL) {
-        ssh_channel_eof(sftp->channel);
-        ssh_channel_close(sftp->channel);
-        ssh_channel_free(sftp->channel);
-        sftp->channel = NULL;
+int sftp_set_read_depth(sftp_session sftp, uint32_t depth) {
+    if (sftp == NULL) return SSH_ERROR;
+
+    if (depth == 0 || depth > SFTP_MAX_READ_DEPTH) {
+        ssh_set_error(SSH_REQUEST_DENIED, "read depth %u out of range [1, %d]",
+                      depth, SFTP_MAX_READ_DEPTH);
+        return SSH_ERROR;
     }
 
-    SAFE_FREE(sftp);
+    sftp->read_depth = depth;
+    return SSH_OK;
 }
 
-/**
- * @brief Grap an SFTP packet from channel, extracting type and payload.
- *
- * @param sftp
- * @return sftp_packet
- */
-sftp_packet sftp_packet_read(sftp_session sftp) {
-    uint8_t buffer[SFTP_BUFFER_SIZE_MAX];
-    uint32_t size;
-    sftp_packet packet = sftp_packet_new(sftp);
-    int nread;
-    bool is_eof;
-    int rc;
-
-    if (packet == NULL) return NULL;
+uint32_t sftp_get_read_depth(sftp_session sftp) {
+    if (sftp == NULL) return 0;
+    return sftp->read_depth;
+}
 
-    /* read packet length and type */
-    nread = ssh_channel_read(sftp->channel, buffer,
-                             sizeof(uint32_t) + sizeof(uint8_t));
-    if (nread != sizeof(uint32_t) + sizeof(uint8_t) && nread != SSH_EOF) {
-        LOG_ERROR("can not read packet length and type");
-        goto error;
-    }
+int sftp_set_read_ahead(sftp_file file, uint32_t window) {
+    uint32_t chunk;
+    uint32_t slots;
 
-    size = ntohl(*(uint32_t *)buffer) - sizeof(uint8_t);
-    LOG_DEBUG("sftp packet size: %d", size);
+    if (file == NULL) return SSH_ERROR;
 
-    packet->type = buffer[4];
+    sftp_ra_drop(file);
+    SAFE_FREE(file->ra);
+    SAFE_FREE(file->ra_data);
+    file->ra_slots = 0;
+    if (window == 0) return SSH_OK;
 
-    rc = ssh_buffer_allocate_size(packet->payload, size);
-    if (rc != SSH_OK) goto error;
+    chunk = file->sftp->max_read;
+    slots = MIN(SFTP_MAX_READ_DEPTH, (window + (uint64_t)chunk - 1) / chunk);
+    file->ra = calloc(slots, sizeof(struct sftp_ra_chunk));
+    file->ra_data = malloc((size_t)slots * chunk);
+    if (file->ra == NULL || file->ra_data == NULL) {
+        SAFE_FREE(file->ra);
+        SAFE_FREE(file->ra_data);
+        ssh_set_error(SSH_FATAL, "out of memory");
+        return SSH_ERROR;
+    }
+    file->ra_slots = slots;
+    file->ra_chunk = chunk;
+    return SSH_OK;
+}
+
+int sftp_seek(sftp_file file, uint64_t offset) {
+    struct sftp_ra_chunk *chunk;
+
+    if (file == NULL) return SSH_ERROR;
+
+    file->offset = offset;
+    file->eof = 0;
+
+    /* a jump away from the prefetched bytes cancels the read-ahead */
+    if (file->ra_count > 0) {
+        chunk = &file->ra[file->ra_head];
+        if (chunk->offset + chunk->pos != offset) sftp_ra_drop(file);
+    }
+    return SSH_OK;
+}
+
+uint64_t sftp_tell(sftp_file file) {
+    if (file == NULL) return 0;
+    return file->offset;
+}
+
+int64_t sftp_get_file(sftp_file file, int fd, uint64_t size, int flags) {
+    sftp_session sftp = file->sftp;
+    sftp_request *reqs = NULL;
+    uint8_t *bufs = NULL;
+    uint64_t start = file->offset;
+    uint64_t next = start;       /* first byte not requested yet */
+    uint64_t eof_at = UINT64_MAX; /* first byte known to be beyond EOF */
+    uint64_t limit = size > 0 ? start + size : UINT64_MAX;
+    /* with SFTP_GET_SPARSE, where the local file is a hole already */
+    uint64_t hole_from = UINT64_MAX;
+    /* offset of the reply being handled, not written yet */
+    uint64_t handling = UINT64_MAX;
+    uint32_t depth = sftp->read_depth;
+    uint32_t inflight = 0;
+    uint32_t i;
+    uint64_t offset;
+    uint32_t len;
+    int32_t nread;
+    struct stat st;
+    int rc;
+
+    if ((flags & SFTP_GET_PREALLOCATE) && size > 0) {
+        rc = posix_fallocate(fd, start, size);
+        if (rc != 0) {
+            ssh_set_error(SSH_FATAL, "can not preallocate %lu bytes: %s",
+                          (unsigned long)size, strerror(rc));
+            return SSH_ERROR;
+        }
+    }
+    if (flags & SFTP_GET_SPARSE) {
+        if (fstat(fd, &st) < 0) {
+            ssh_set_error(SSH_FATAL, "can not stat local file: %s",
+                          strerror(errno));
+            return SSH_ERROR;
+        }
+        hole_from = st.st_size;
+    }
+
+    reqs = calloc(depth, sizeof(sftp_request));
+    bufs = malloc((size_t)depth * sftp->max_read);
+    if (reqs == NULL || bufs == NULL) {
+        ssh_set_error(SSH_FATAL, "out of memory");
+        goto error;
+    }
+
+    while (1) {
+        /* refill free slots; past the expected size, only probe for EOF
+         * with a single request */
+        for (i = 0; i < depth && next < eof_at; i++) {
+            if (reqs[i] != NULL) continue;
+            if (next >= limit && inflight > 0) break;
+
+            rc = ssh_channel_grow_window(
+                sftp->channel,
+                (inflight + 1) * (sftp->max_read + SFTP_DATA_HEADER_LEN));
+            if (rc != SSH_OK) goto error;
+
+            len = sftp->max_read;
+            if (next < limit) len = MIN(len, limit - next);
+            rc = sftp_get_range(file, &reqs[i], bufs + i * sftp->max_read,
+                                next, len);
+            if (rc != SSH_OK) goto error;
+            inflight++;
+            next += len;
+        }
+
+        if (inflight == 0) break;
+
+        /* handle whichever replies have arrived */
+        for (i = 0; i < depth; i++) {
+            if (reqs[i] == NULL || reqs[i]->reply == NULL) continue;
+
+            offset = reqs[i]->offset;
+            len = reqs[i]->len;
+            handling = offset;
+            nread = sftp_async_read_result(reqs[i], bufs + i * sftp->max_read,
+                                           len);
+            reqs[i] = NULL;
+            inflight--;
+            if (nread < 0) goto error;
+
+            if (nread == 0) {
+                eof_at = MIN(eof_at, offset);
+                continue;
+            }
+            if (sftp_pwrite_sparse(fd, bufs + i * sftp->max_read, nread,
+                                   offset, hole_from) != SSH_OK) {
+                goto error;
+            }
+            if (nread < len && offset + nread < eof_at) {
+                /* short read, ask again for the rest of the range */
+                rc = sftp_get_range(file, &reqs[i],
+                                    bufs + i * sftp->max_read, offset + nread,
+                                    len - nread);
+                if (rc != SSH_OK) goto error;
+                inflight++;
+            }
+            handling = UINT64_MAX;
+        }
+
+        /* wait for the next reply */
+        for (i = 0; i < depth; i++) {
+            if (reqs[i] != NULL && reqs[i]->reply != NULL) break;
+        }
+        if (i == depth && inflight > 0 && sftp_dispatch(sftp) != SSH_OK) {
+            goto error;
+        }
+    }
+
+    SAFE_FREE(reqs);
+    SAFE_FREE(bufs);
+
+    if (eof_at == UINT64_MAX) eof_at = next;
+    if ((flags & SFTP_GET_PREALLOCATE) && eof_at < limit &&
+        ftruncate(fd, eof_at) != 0) {
+        ssh_set_error(SSH_FATAL, "can not truncate local file: %s",
+                      strerror(errno));
+        return SSH_ERROR;
+    }
+    /* zeros skipped at the end still count for the size */
+    if ((flags & SFTP_GET_SPARSE) && eof_at > hole_from &&
+        (fstat(fd, &st) < 0 ||
+         ((uint64_t)st.st_size < eof_at && ftruncate(fd, eof_at) != 0))) {
+        ssh_set_error(SSH_FATAL, "can not extend local file: %s",
+                      strerror(errno));
+        return SSH_ERROR;
+    }
+
+    file->offset = eof_at;
+    return eof_at - start;
+
+error:
+    /* replies complete out of order: keep only the part of the local file
+     * below the first range that is not complete, so that its size tells
+     * how far the download got, see sftp_resume_get() */
+    offset = MIN(MIN(next, eof_at), handling);
+    if (reqs != NULL) {
+        for (i = 0; i < depth; i++) {
+            if (reqs[i] != NULL) offset = MIN(offset, reqs[i]->offset);
+            sftp_request_cancel(reqs[i]);
+        }
+    }
+    if (fstat(fd, &st) == 0 && (uint64_t)st.st_size > offset &&
+        ftruncate(fd, offset) != 0) {
+        LOG_ERROR("can not truncate local file to %lu: %s",
+                  (unsigned long)offset, strerror(errno));
+    }
+    SAFE_FREE(reqs);
+    SAFE_FREE(bufs);
+    return SSH_ERROR;
+}
+
+int64_t sftp_put_file(sftp_file file, int fd, uint64_t size, int flags) {
+    sftp_session sftp;
+    uint8_t *buf = NULL;
+    uint64_t start;
+    uint64_t end;
+    uint64_t offset;
+    uint64_t extent_end;
+    uint64_t sent_end;
+    uint32_t len;
+    uint32_t pos;
+    uint32_t run;
+    ssize_t nread;
+    off_t data;
+    struct stat st;
+    bool zero;
+    bool sparse = (flags & SFTP_PUT_SPARSE) != 0;
+
+    if (file == NULL || fd < 0) return SSH_ERROR;
+    sftp = file->sftp;
+    start = offset = sent_end = file->offset;
+
+    if (fstat(fd, &st) < 0) {
+        ssh_set_error(SSH_FATAL, "can not stat local file: %s",
+                      strerror(errno));
+        return SSH_ERROR;
+    }
+    end = (uint64_t)st.st_size > start ? st.st_size : start;
+    if (size > 0) end = MIN(end, start + size);
+
+    if (sftp_wbuf_flush(file) != SSH_OK) return SSH_ERROR;
+    sftp_ra_drop(file);
+
+    buf = malloc(sftp->max_write);
+    if (buf == NULL) {
+        ssh_set_error(SSH_FATAL, "out of memory");
+        return SSH_ERROR;
+    }
+
+    while (offset < end) {
+        extent_end = end;
+#ifdef SEEK_DATA
+        if (sparse) {
+            /* jump over holes; without support the whole file is data */
+            data = lseek(fd, offset, SEEK_DATA);
+            if (data < 0 && errno == ENXIO) break;
+            if (data >= 0) {
+                offset = data;
+                data = lseek(fd, offset, SEEK_HOLE);
+                if (data >= 0) extent_end = MIN(end, (uint64_t)data);
+            }
+            if (offset >= end) break;
+        }
+#endif
+        len = MIN(extent_end - offset, sftp->max_write);
+        nread = pread(fd, buf, len, offset);
+        if (nread < 0 && errno == EINTR) continue;
+        if (nread < 0) {
+            ssh_set_error(SSH_FATAL, "can not read local file: %s",
+                          strerror(errno));
+            goto error;
+        }
+        if (nread == 0) {
+            /* the local file shrank */
+            end = offset;
+            break;
+        }
+
+        for (pos = 0; pos < nread; pos += run) {
+            run = nread - pos;
+            zero = false;
+            if (sparse) run = sftp_sparse_run(buf + pos, run, offset + pos, &zero);
+            if (zero) continue;
+            if (sftp_write_send(file, offset + pos, buf + pos, run) != SSH_OK) {
+                goto error;
+            }
+            sent_end = offset + pos + run;
+        }
+        offset += nread;
+    }
+
+    /* holes and zeros at the end still count for the size */
+    if (sent_end < end) {
+        buf[0] = 0;
+        if (sftp_write_send(file, end - 1, buf, 1) != SSH_OK) goto error;
+    }
+    SAFE_FREE(buf);
+
+    if (sftp_drain_writes(sftp) != SSH_OK ||
+        sftp_check_write_error(file) != SSH_OK) {
+        return SSH_ERROR;
+    }
+    file->offset = end;
+    return end - start;
+
+error:
+    SAFE_FREE(buf);
+    return SSH_ERROR;
+}
+
+sftp_request sftp_async_write(sftp_file file, uint64_t offset,
+                              const void *buf, uint32_t len) {
+    sftp_session sftp = file->sftp;
+    sftp_request req = NULL;
+    ssh_buffer buffer = NULL;
+    uint32_t id;
+    int rc;
+
+    buffer = ssh_buffer_new();
+    if (buffer == NULL) {
+        LOG_CRITICAL("can not create ssh buffer");
+        ssh_set_error(SSH_FATAL, "buffer error");
+        return NULL;
+    }
+
+    id = sftp_get_new_id(sftp);
+
+    rc = ssh_buffer_pack(buffer, "dSqdP", id, file->handle, offset, len, len,
+                         buf);
+    if (rc != SSH_OK) {
+        LOG_CRITICAL("can not pack buffer");
+        ssh_set_error(SSH_FATAL, "buffer error");
+        ssh_buffer_free(buffer);
+        return NULL;
+    }
+
+    sftp_attr_cache_invalidate(sftp, file->path);
+
+    req = sftp_request_send(sftp, SSH_FXP_WRITE, id, buffer);
+    ssh_buffer_free(buffer);
+    if (req != NULL) {
+        req->file = file;
+        req->offset = offset;
+        req->len = len;
+    }
+
+    return req;
+}
+
+int sftp_async_write_result(sftp_request req) {
+    uint64_t offset;
+    uint32_t code;
+
+    if (req == NULL) return SSH_ERROR;
+    offset = req->offset;
+
+    // LAB(PT6): insert your code here.
+    if (sftp_request_status(req, &code) != SSH_OK) {
+        ssh_set_error(SSH_FATAL, "unexpected sftp write response type");
+        sftp_request_cancel(req);
+        return SSH_ERROR;
+    }
+    sftp_request_free(req);
+
+    if (code != SSH_FX_OK) {
+        LOG_DEBUG("write response with error code %d", code);
+        ssh_set_error(SSH_FATAL,
+                      "write at offset %lu failed with error code %u",
+                      (unsigned long)offset, code);
+        return SSH_ERROR;
+    }
+    return SSH_OK;
+}
+
+int32_t sftp_write(sftp_file file, const void *buf, uint32_t count) {
+    uint32_t nleft = count;
+    uint32_t nwrite;
+
+    if (sftp_check_write_error(file) != SSH_OK) return SSH_ERROR;
+
+    /* prefetched bytes may be overwritten */
+    sftp_ra_drop(file);
+
+    if (file->wbuf_size > 0) return sftp_write_buffered(file, buf, count);
+
+    if (file->sftp->write_behind > 0) {
+        return sftp_write_behind(file, buf, count);
+    }
+
+    while (nleft > 0) {
+        nwrite = MIN(nleft, file->sftp->max_write);
+
+        if (sftp_async_write_result(
+                sftp_async_write(file, file->offset,
+                                 (char *)buf + (count - nleft), nwrite)) !=
+            SSH_OK) {
+            return SSH_ERROR;
+        }
+
+        file->offset += nwrite;
+        nleft -= nwrite;
+
+        file->unsynced += nwrite;
+        if (file->sftp->fsync_interval > 0 &&
+            file->unsynced >= file->sftp->fsync_interval &&
+            sftp_fsync(file) != SSH_OK) {
+            return SSH_ERROR;
+        }
+    }
+    return count - nleft;
+}
+
+int sftp_set_write_behind(sftp_session sftp, uint32_t max_inflight) {
+    if (sftp == NULL) return SSH_ERROR;
+
+    if (max_inflight < sftp->write_inflight &&
+        sftp_drain_writes(sftp) != SSH_OK) {
+        return SSH_ERROR;
+    }
+
+    sftp->write_behind = max_inflight;
+    return SSH_OK;
+}
+
+int sftp_flush(sftp_file file) {
+    if (file == NULL) return SSH_ERROR;
+
+    if (sftp_wbuf_flush(file) != SSH_OK && !file->write_failed) {
+        return SSH_ERROR;
+    }
+    if (sftp_drain_writes(file->sftp) != SSH_OK) return SSH_ERROR;
+
+    return sftp_check_write_error(file);
+}
+
+int sftp_get_write_error(sftp_file file, uint64_t *offset) {
+    if (file == NULL || !file->write_failed) return SSH_FX_OK;
+
+    if (offset != NULL) *offset = file->write_error_offset;
+    return file->write_error;
+}
+
+int sftp_fsync(sftp_file file) {
+    if (file == NULL) return SSH_ERROR;
+
+    if (!sftp_extension_supported(file->sftp, "fsync@openssh.com", "1")) {
+        ssh_set_error(SSH_REQUEST_DENIED,
+                      "server does not support fsync@openssh.com");
+        return SSH_ERROR;
+    }
+
+    /* sent behind the outstanding writes, its status arrives after theirs */
+    if (sftp_wbuf_flush(file) != SSH_OK ||
+        sftp_queue_fsync(file, file->offset) != SSH_OK ||
+        sftp_drain_writes(file->sftp) != SSH_OK) {
+        return SSH_ERROR;
+    }
+    return sftp_check_write_error(file);
+}
+
+int sftp_set_fsync_interval(sftp_session sftp, uint64_t interval) {
+    if (sftp == NULL) return SSH_ERROR;
+
+    if (interval > 0 &&
+        !sftp_extension_supported(sftp, "fsync@openssh.com", "1")) {
+        ssh_set_error(SSH_REQUEST_DENIED,
+                      "server does not support fsync@openssh.com");
+        return SSH_ERROR;
+    }
+
+    sftp->fsync_interval = interval;
+    return SSH_OK;
+}
+
+int sftp_set_write_buffer(sftp_file file, uint32_t size) {
+    if (file == NULL) return SSH_ERROR;
+
+    if (sftp_wbuf_flush(file) != SSH_OK) return SSH_ERROR;
+    SAFE_FREE(file->wbuf);
+    file->wbuf_size = 0;
+    if (size == 0) return SSH_OK;
+
+    size = MIN(size, file->sftp->max_write);
+    file->wbuf = malloc(size);
+    if (file->wbuf == NULL) {
+        ssh_set_error(SSH_FATAL, "out of memory");
+        return SSH_ERROR;
+    }
+    file->wbuf_size = size;
+    return SSH_OK;
+}
+
+int64_t sftp_resume_get(sftp_file file, int fd, int flags) {
+    struct stat st;
+    sftp_attributes attr;
+    uint64_t remote_size;
+    uint64_t offset;
+    bool match = true;
+
+    if (fstat(fd, &st) < 0) {
+        ssh_set_error(SSH_FATAL, "can not stat local file: %s",
+                      strerror(errno));
+        return SSH_ERROR;
+    }
+    attr = sftp_fstat(file);
+    if (attr == NULL) return SSH_ERROR;
+    if (!(attr->flags & SSH_FILEXFER_ATTR_SIZE)) {
+        ssh_set_error(SSH_FATAL, "server did not report the file size");
+        sftp_attributes_free(attr);
+        return SSH_ERROR;
+    }
+    remote_size = attr->size;
+    sftp_attributes_free(attr);
+
+    /* the local file must be a prefix of the remote file */
+    offset = st.st_size;
+    if (offset > remote_size) {
+        offset = 0;
+    } else if ((flags & SFTP_RESUME_VERIFY) && offset > 0) {
+        if (sftp_resume_verify(file, fd, offset, &match) != SSH_OK) {
+            return SSH_ERROR;
+        }
+        if (!match) offset = 0;
+    }
+    LOG_DEBUG("resume download at %lu of %lu bytes", (unsigned long)offset,
+              (unsigned long)remote_size);
+
+    if (ftruncate(fd, offset) < 0 || lseek(fd, offset, SEEK_SET) < 0) {
+        ssh_set_error(SSH_FATAL, "can not resize local file: %s",
+                      strerror(errno));
+        return SSH_ERROR;
+    }
+    file->offset = offset;
+    return offset;
+}
+
+int64_t sftp_resume_put(sftp_file file, int fd, int flags) {
+    struct stat st;
+    sftp_attributes attr;
+    uint64_t remote_size;
+    uint64_t offset;
+    bool match = true;
+
+    if (fstat(fd, &st) < 0) {
+        ssh_set_error(SSH_FATAL, "can not stat local file: %s",
+                      strerror(errno));
+        return SSH_ERROR;
+    }
+    attr = sftp_fstat(file);
+    if (attr == NULL) return SSH_ERROR;
+    if (!(attr->flags & SSH_FILEXFER_ATTR_SIZE)) {
+        ssh_set_error(SSH_FATAL, "server did not report the file size");
+        sftp_attributes_free(attr);
+        return SSH_ERROR;
+    }
+    remote_size = attr->size;
+    sftp_attributes_free(attr);
+
+    /* the remote file must be a prefix of the local file */
+    offset = remote_size;
+    if (offset > (uint64_t)st.st_size) {
+        offset = 0;
+    } else if ((flags & SFTP_RESUME_VERIFY) && offset > 0) {
+        if (sftp_resume_verify(file, fd, offset, &match) != SSH_OK) {
+            return SSH_ERROR;
+        }
+        if (!match) offset = 0;
+    }
+    LOG_DEBUG("resume upload at %lu of %lu bytes", (unsigned long)offset,
+              (unsigned long)st.st_size);
+
+    if (offset < remote_size && sftp_ftruncate(file, offset) != SSH_OK) {
+        return SSH_ERROR;
+    }
+    if (lseek(fd, offset, SEEK_SET) < 0) {
+        ssh_set_error(SSH_FATAL, "can not seek local file: %s",
+                      strerror(errno));
+        return SSH_ERROR;
+    }
+    file->offset = offset;
+    return offset;
+}
+
+int64_t sftp_copy(sftp_file from, sftp_file to, uint64_t len) {
+    sftp_session sftp;
+    sftp_attributes attr;
+    uint64_t left;
+    int64_t copied;
+
+    if (from == NULL || to == NULL || from->sftp != to->sftp) {
+        return SSH_ERROR;
+    }
+    sftp = from->sftp;
+
+    if (sftp_wbuf_flush(from) != SSH_OK || sftp_wbuf_flush(to) != SSH_OK) {
+        return SSH_ERROR;
+    }
+
+    if (!sftp_extension_supported(sftp, "copy-data", "1")) {
+        return sftp_copy_relay(from, to, len);
+    }
+
+    /* copy-data does not tell how much it copied, so ask first */
+    attr = sftp_fstat(from);
+    if (attr == NULL) return SSH_ERROR;
+    if (!(attr->flags & SSH_FILEXFER_ATTR_SIZE)) {
+        sftp_attributes_free(attr);
+        return sftp_copy_relay(from, to, len);
+    }
+    left = attr->size > from->offset ? attr->size - from->offset : 0;
+    sftp_attributes_free(attr);
+    if (len == 0 || len > left) len = left;
+    if (len == 0) return 0;
+
+    copied = sftp_copy_data(from, to, len);
+    if (copied < 0) return SSH_ERROR;
+
+    from->offset += copied;
+    to->offset += copied;
+    return copied;
+}
+
+int sftp_copy_file(sftp_session sftp, const char *from_path,
+                   const char *to_path) {
+    sftp_attributes attr;
+    sftp_file from;
+    sftp_file to;
+    mode_t mode = S_IRUSR | S_IWUSR;
+    int64_t copied;
+    int rc;
+
+    if (sftp == NULL || from_path == NULL || to_path == NULL) {
+        return SSH_ERROR;
+    }
+
+    from = sftp_open(sftp, from_path, O_RDONLY, 0);
+    if (from == NULL) return SSH_ERROR;
+
+    attr = sftp_fstat(from);
+    if (attr != NULL && (attr->flags & SSH_FILEXFER_ATTR_PERMISSIONS)) {
+        mode = attr->permissions & 07777;
+    }
+    sftp_attributes_free(attr);
+
+    to = sftp_open(sftp, to_path, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    if (to == NULL) {
+        sftp_close(from);
+        return SSH_ERROR;
+    }
+
+    copied = sftp_copy(from, to, 0);
+
+    rc = sftp_close(to);
+    if (sftp_close(from) != SSH_OK) rc = SSH_ERROR;
+    return copied < 0 ? SSH_ERROR : rc;
+}
+
+int sftp_hash(sftp_session sftp, const char *path, const char *algorithm,
+              uint64_t offset, uint64_t len, unsigned char *digest,
+              size_t *digest_len) {
+    uint32_t code = SSH_FX_OP_UNSUPPORTED;
+
+    if (sftp == NULL || path == NULL || digest == NULL ||
+        digest_len == NULL || sftp_hash_digest(algorithm) == NULL) {
+        ssh_set_error(SSH_FATAL, "invalid argument to sftp_hash");
+        return SSH_ERROR;
+    }
+
+    if (sftp_extension_supported(sftp, "check-file", NULL) ||
+        sftp_extension_supported(sftp, "check-file-name", NULL)) {
+        if (sftp_check_file(sftp, NULL, path, algorithm, offset, len, digest,
+                            digest_len, &code) == SSH_OK) {
+            return SSH_OK;
+        }
+    }
+    if (code != SSH_FX_OP_UNSUPPORTED) return SSH_ERROR;
+
+    return sftp_hash_exec(sftp, path, algorithm, offset, len, digest,
+                          digest_len);
+}
+
+int sftp_fhash(sftp_file file, const char *algorithm, uint64_t offset,
+               uint64_t len, unsigned char *digest, size_t *digest_len) {
+    uint32_t code = SSH_FX_OP_UNSUPPORTED;
+
+    if (file == NULL) return SSH_ERROR;
+
+    /* buffered and write-behind data must be part of the digest */
+    if (sftp_wbuf_flush(file) != SSH_OK ||
+        sftp_drain_writes(file->sftp) != SSH_OK ||
+        sftp_check_write_error(file) != SSH_OK) {
+        return SSH_ERROR;
+    }
+
+    if (sftp_extension_supported(file->sftp, "check-file", NULL) ||
+        sftp_extension_supported(file->sftp, "check-file-handle", NULL)) {
+        if (digest == NULL || digest_len == NULL ||
+            sftp_hash_digest(algorithm) == NULL) {
+            ssh_set_error(SSH_FATAL, "invalid argument to sftp_fhash");
+            return SSH_ERROR;
+        }
+        if (sftp_check_file(file->sftp, file, NULL, algorithm, offset, len,
+                            digest, digest_len, &code) == SSH_OK) {
+            return SSH_OK;
+        }
+        if (code != SSH_FX_OP_UNSUPPORTED) return SSH_ERROR;
+    }
+
+    return sftp_hash(file->sftp, file->path, algorithm, offset, len, digest,
+                     digest_len);
+}
+
+int sftp_hash_local(int fd, const char *algorithm, uint64_t offset,
+                    uint64_t len, unsigned char *digest, size_t *digest_len) {
+    const EVP_MD *md = sftp_hash_digest(algorithm);
+    EVP_MD_CTX *ctx = NULL;
+    unsigned char *buf = NULL;
+    unsigned int mdlen = 0;
+    uint64_t left = len > 0 ? len : UINT64_MAX;
+    ssize_t nread;
+    int rc = SSH_ERROR;
+
+    if (fd < 0 || md == NULL || digest == NULL || digest_len == NULL) {
+        ssh_set_error(SSH_FATAL, "invalid argument to sftp_hash_local");
+        return SSH_ERROR;
+    }
+
+    buf = malloc(SFTP_HASH_CHUNK);
+    ctx = EVP_MD_CTX_new();
+    if (buf == NULL || ctx == NULL || EVP_DigestInit_ex(ctx, md, NULL) != 1) {
+        ssh_set_error(SSH_FATAL, "can not set up %s digest", algorithm);
+        goto out;
+    }
+
+    while (left > 0) {
+        nread = pread(fd, buf, MIN(left, SFTP_HASH_CHUNK), offset);
+        if (nread < 0 && errno == EINTR) continue;
+        if (nread < 0) {
+            ssh_set_error(SSH_FATAL, "can not read local file: %s",
+                          strerror(errno));
+            goto out;
+        }
+        if (nread == 0) break;
+        EVP_DigestUpdate(ctx, buf, nread);
+        offset += nread;
+        left -= nread;
+    }
+
+    if (EVP_DigestFinal_ex(ctx, digest, &mdlen) != 1) {
+        ssh_set_error(SSH_FATAL, "can not finish %s digest", algorithm);
+        goto out;
+    }
+    *digest_len = mdlen;
+    rc = SSH_OK;
+
+out:
+    EVP_MD_CTX_free(ctx);
+    SAFE_FREE(buf);
+    return rc;
+}
+
+int64_t sftp_put_delta(sftp_file file, int fd, const char *algorithm,
+                       uint32_t block_size) {
+    sftp_session sftp;
+    sftp_attributes attr;
+    struct stat st;
+    uint64_t local_size;
+    uint64_t remote_size;
+    uint64_t common;
+    uint64_t sent = 0;
+    int64_t tail;
+    uint32_t code = SSH_FX_OP_UNSUPPORTED;
+
+    if (file == NULL || fd < 0 ||
+        (algorithm != NULL && sftp_hash_digest(algorithm) == NULL) ||
+        (block_size > 0 && block_size < 256)) {
+        ssh_set_error(SSH_FATAL, "invalid argument to sftp_put_delta");
+        return SSH_ERROR;
+    }
+    sftp = file->sftp;
+    if (block_size == 0) block_size = sftp->max_write;
+
+    if (fstat(fd, &st) < 0) {
+        ssh_set_error(SSH_FATAL, "can not stat local file: %s",
+                      strerror(errno));
+        return SSH_ERROR;
+    }
+    local_size = st.st_size;
+
+    /* the remote size and hashes must include buffered and pending writes */
+    if (sftp_wbuf_flush(file) != SSH_OK ||
+        sftp_drain_writes(sftp) != SSH_OK ||
+        sftp_check_write_error(file) != SSH_OK) {
+        return SSH_ERROR;
+    }
+    sftp_ra_drop(file);
+
+    attr = sftp_fstat(file);
+    if (attr == NULL) return SSH_ERROR;
+    if (!(attr->flags & SSH_FILEXFER_ATTR_SIZE)) {
+        ssh_set_error(SSH_FATAL, "server did not report the file size");
+        sftp_attributes_free(attr);
+        return SSH_ERROR;
+    }
+    remote_size = attr->size;
+    sftp_attributes_free(attr);
+    common = MIN(local_size, remote_size);
+
+    if (algorithm != NULL &&
+        (sftp_extension_supported(sftp, "check-file", NULL) ||
+         sftp_extension_supported(sftp, "check-file-handle", NULL))) {
+        if (sftp_delta_hashed(file, fd, algorithm, block_size, common, &sent,
+                              &code) != SSH_OK &&
+            code != SSH_FX_OP_UNSUPPORTED) {
+            return SSH_ERROR;
+        }
+    }
+    /* nothing is sent before the first check-file reply */
+    if (code == SSH_FX_OP_UNSUPPORTED &&
+        sftp_delta_read(file, fd, MIN(block_size, sftp->max_read), common,
+                        &sent) != SSH_OK) {
+        return SSH_ERROR;
+    }
+    LOG_DEBUG("delta upload: %lu of %lu common bytes differ",
+              (unsigned long)sent, (unsigned long)common);
+
+    /* past the old end, the remote file reads as zeros */
+    if (local_size > common) {
+        file->offset = common;
+        tail = sftp_put_file(file, fd, 0, SFTP_PUT_SPARSE);
+        if (tail < 0) return SSH_ERROR;
+        sent += local_size - common;
+    } else if (remote_size > local_size &&
+               sftp_ftruncate(file, local_size) != SSH_OK) {
+        return SSH_ERROR;
+    }
+
+    if (sftp_drain_writes(sftp) != SSH_OK ||
+        sftp_check_write_error(file) != SSH_OK) {
+        return SSH_ERROR;
+    }
+    file->offset = local_size;
+    return sent;
+}
+
+int sftp_request_poll(sftp_request req) {
+    int rc;
+
+    if (req == NULL) return SSH_ERROR;
+
+    while (req->reply == NULL) {
+        rc = ssh_channel_poll(req->sftp->channel);
+        if (rc == SSH_EOF || rc == SSH_ERROR) {
+            ssh_set_error(SSH_FATAL, "sftp channel closed");
+            return SSH_ERROR;
+        }
+        if (rc == 0) return SSH_AGAIN;
+
+        /* something has arrived, the packet it starts is read to its end,
+         * see sftp_request_poll() in libsftp.h */
+        if (sftp_dispatch(req->sftp) != SSH_OK) return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+int sftp_request_wait(sftp_request req) {
+    if (req == NULL) return SSH_ERROR;
+
+    while (req->reply == NULL) {
+        if (sftp_dispatch(req->sftp) != SSH_OK) return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+void sftp_request_cancel(sftp_request req) {
+    if (req == NULL) return;
+
+    if (req->reply != NULL) {
+        sftp_request_free(req);
+        return;
+    }
+
+    /* still in the pending table, dropped by `sftp_dispatch` */
+    req->cancelled = true;
+}
+
+/**
+ * @brief Close the handle a cancelled SSH_FXP_OPEN or SSH_FXP_OPENDIR got:
+ * nobody else knows about it, and it would stay open on the server. The
+ * reply to the CLOSE is dropped too.
+ *
+ * @param req       the cancelled request, out of the pending table
+ * @param response  its SSH_FXP_HANDLE reply
+ */
+static void sftp_close_orphan(sftp_request req, sftp_packet response) {
+    ssh_string handle = NULL;
+    ssh_buffer buffer = NULL;
+    uint32_t id;
+
+    if (ssh_buffer_unpack(response->payload, "dS", &id, &handle) != SSH_OK) {
+        return;
+    }
+    buffer = ssh_buffer_new();
+    if (buffer != NULL) {
+        id = sftp_get_new_id(req->sftp);
+        if (ssh_buffer_pack(buffer, "dS", id, handle) == SSH_OK) {
+            sftp_request_cancel(
+                sftp_request_send(req->sftp, SSH_FXP_CLOSE, id, buffer));
+        }
+    }
+    ssh_buffer_free(buffer);
+    ssh_string_free(handle);
+}
+
+/**
+ * @brief Read one response from the channel and hand it to the request
+ * waiting for it. The data of an SSH_FXP_DATA reply to a request with a
+ * destination is read from the channel straight into that destination.
+ *
+ * @param sftp
+ * @return int
+ */
+static int sftp_dispatch(sftp_session sftp) {
+    /* length, type and request id */
+    uint8_t header[sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint32_t)];
+    sftp_packet response = NULL;
+    sftp_request req = NULL;
+    uint32_t size;
+    uint32_t id;
+    uint32_t len;
+    int nread;
+
+    if (sftp == NULL) return SSH_ERROR;
+    if (sftp_check_blocking(sftp->session) != SSH_OK) return SSH_ERROR;
+
+    nread = ssh_channel_read(sftp->channel, header, sizeof(header));
+    if (nread != sizeof(header)) {
+        ssh_set_error(SSH_FATAL, "can not read sftp packet");
+        return SSH_ERROR;
+    }
+
+    size = ntohl(*(uint32_t *)header);
+    id = ntohl(*(uint32_t *)(header + 5));
+    if (size < sizeof(header) - sizeof(uint32_t) ||
+        size > SFTP_PACKET_SIZE_MAX) {
+        ssh_set_error(SSH_FATAL, "invalid sftp packet size %u", size);
+        return SSH_ERROR;
+    }
+    /* the rest of the packet after the id */
+    size -= sizeof(header) - sizeof(uint32_t);
+
+    req = sftp_pending_take(sftp, id);
+    if (req == NULL) {
+        LOG_ERROR("sftp response id %u matches no outstanding request", id);
+        ssh_set_error(SSH_FATAL, "unexpected sftp response id %u", id);
+        return SSH_ERROR;
+    }
+
+    response = sftp_packet_new(sftp);
+    if (response == NULL) goto error;
+    response->type = header[4];
+
+    if (response->type == SSH_FXP_DATA && req->dest != NULL &&
+        !req->cancelled && size >= sizeof(uint32_t)) {
+        nread = ssh_channel_read(sftp->channel, &len, sizeof(uint32_t));
+        if (nread != sizeof(uint32_t)) goto error;
+        len = ntohl(len);
+        if (len > req->len || len != size - sizeof(uint32_t)) {
+            ssh_set_error(SSH_FATAL, "server sent %u bytes for a %u bytes read",
+                          len, req->len);
+            goto error;
+        }
+        if (len > 0 && ssh_channel_read(sftp->channel, req->dest, len) != len) {
+            goto error;
+        }
+        req->delivered = true;
+        req->nread = len;
+    } else if (sftp_packet_read_payload(sftp, response, header + 5,
+                                        sizeof(uint32_t), size) != SSH_OK) {
+        goto error;
+    }
+
+    if (req->cancelled) {
+        if ((req->type == SSH_FXP_OPEN || req->type == SSH_FXP_OPENDIR) &&
+            response->type == SSH_FXP_HANDLE) {
+            sftp_close_orphan(req, response);
+        }
+        sftp_packet_free(response);
+        sftp_request_free(req);
+        return SSH_OK;
+    }
+
+    req->reply = response;
+    return SSH_OK;
+
+error:
+    sftp_packet_free(response);
+    /* the request is out of the pending table, fail it */
+    if (req->cancelled) {
+        sftp_request_free(req);
+    } else {
+        req->reply = sftp_packet_new(sftp);
+    }
+    return SSH_ERROR;
+}
+
+void sftp_free(sftp_session sftp) {
+    uint32_t i;
+
+    if (sftp == NULL) return;
+    if (sftp->channel != NULL) {
+        ssh_channel_eof(sftp->channel);
+        ssh_channel_close(sftp->channel);
+        ssh_channel_free(sftp->channel);
+        sftp->channel = NULL;
+    }
+
+    /* answered write-behind requests have left the pending table */
+    for (i = 0; i < sftp->write_count; i++) {
+        sftp_request req =
+            sftp->writes[(sftp->write_head + i) % sftp->write_alloc];
+        if (req->reply != NULL) sftp_request_free(req);
+    }
+    SAFE_FREE(sftp->writes);
+
+    for (i = sftp->pending_head; i < sftp->pending_tail; i++) {
+        sftp_request_free(sftp->pending[i].req);
+    }
+    SAFE_FREE(sftp->pending);
+
+    sftp_attr_cache_invalidate(sftp, NULL);
+    SAFE_FREE(sftp->attr_cache);
+
+    for (i = 0; i < sftp->ext_count; i++) {
+        SAFE_FREE(sftp->ext_names[i]);
+        SAFE_FREE(sftp->ext_data[i]);
+    }
+    SAFE_FREE(sftp->ext_names);
+    SAFE_FREE(sftp->ext_data);
+
+    SAFE_FREE(sftp);
+}
+
+/**
+ * @brief Grap an SFTP packet from channel, extracting type and payload.
+ * The payload is read from the channel straight into `packet->payload`,
+ * which is sized from the packet length first, see
+ * `sftp_packet_read_payload`.
+ *
+ * @param sftp
+ * @return sftp_packet
+ */
+sftp_packet sftp_packet_read(sftp_session sftp) {
+    uint8_t header[sizeof(uint32_t) + sizeof(uint8_t)];
+    uint32_t size;
+    sftp_packet packet = sftp_packet_new(sftp);
+    int nread;
+
+    if (packet == NULL) return NULL;
+
+    /* read packet length and type */
+    nread = ssh_channel_read(sftp->channel, header, sizeof(header));
+    if (nread != sizeof(header)) {
+        LOG_ERROR("can not read packet length and type");
+        goto error;
+    }
+
+    size = ntohl(*(uint32_t *)header);
+    if (size < sizeof(uint8_t) || size > SFTP_PACKET_SIZE_MAX) {
+        LOG_ERROR("invalid sftp packet size %u", size);
+        goto error;
+    }
+    size -= sizeof(uint8_t);
+    LOG_DEBUG("sftp packet size: %d", size);
+
+    packet->type = header[4];
+
+    if (sftp_packet_read_payload(sftp, packet, NULL, 0, size) != SSH_OK) {
+        goto error;
+    }
+
+    return packet;
+
+error:
+    sftp_packet_free(packet);
+    return NULL;
+}
+
+/**
+ * @brief Read `size` bytes of payload from the channel straight into
+ * `packet->payload`, after `prefix_len` bytes of `prefix` already read.
+ *
+ * @param sftp
+ * @param packet
+ * @param prefix
+ * @param prefix_len
+ * @param size
+ * @return int
+ */
+static int sftp_packet_read_payload(sftp_session sftp, sftp_packet packet,
+                                    const void *prefix, uint32_t prefix_len,
+                                    uint32_t size) {
+    uint8_t *payload;
+    int nread;
+
+    if (prefix_len + size == 0) return SSH_OK;
+
+    payload = ssh_buffer_allocate(packet->payload, prefix_len + size);
+    if (payload == NULL) return SSH_ERROR;
+    if (prefix_len > 0) memcpy(payload, prefix, prefix_len);
+    if (size == 0) return SSH_OK;
+
+    nread = ssh_channel_read(sftp->channel, payload + prefix_len, size);
+    if (nread != size) {
+        LOG_ERROR("can not read packet payload");
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+/**
+ * @brief Encapsulate an SFTP packet and write it into the channel.
+ *
+ * @param sftp
+ * @param type
+ * @param payload
+ * @return int32_t
+ */
+int32_t sftp_packet_write(sftp_session sftp, uint8_t type, ssh_buffer payload) {
+    uint8_t header[5] = {0};
+    uint32_t size;
+    int nwrite;
+    int rc;
+
+    size = ssh_buffer_get_len(payload) + sizeof(uint8_t);
+    *(uint32_t *)header = htonl(size);
+    header[4] = type;
+
+    rc = ssh_buffer_prepend_data(payload, header, sizeof(header));
+    if (rc != SSH_OK) {
+        ssh_set_error(SSH_FATAL, "can not create sftp packet");
+        return SSH_ERROR;
+    }
+
+    nwrite = ssh_channel_write(sftp->channel, ssh_buffer_get(payload),
+                               ssh_buffer_get_len(payload));
+    if (nwrite != ssh_buffer_get_len(payload)) {
+        ssh_set_error(SSH_FATAL, "can not write sftp packet");
+        return SSH_ERROR;
+    }
+
+    return nwrite;
+}
+
+/**
+ * @brief Send a request packet and register it in the pending table. The
+ * payload must start with `id`.
+ *
+ * @param sftp
+ * @param type
+ * @param id
+ * @param payload
+ * @return sftp_request, NULL on error.
+ */
+static sftp_request sftp_request_send(sftp_session sftp, uint8_t type,
+                                      uint32_t id, ssh_buffer payload) {
+    struct sftp_pending_entry *entries;
+    sftp_request req = NULL;
+    uint32_t alloc;
+    uint32_t i;
+
+    req = calloc(1, sizeof(struct sftp_request_struct));
+    if (req == NULL) {
+        ssh_set_error(SSH_FATAL, "out of memory");
+        return NULL;
+    }
+    req->sftp = sftp;
+    req->id = id;
+    req->type = type;
+
+    /* make room at the end of the table */
+    if (sftp->pending_tail == sftp->pending_alloc) {
+        if (sftp->pending_head > 0) {
+            memmove(sftp->pending, sftp->pending + sftp->pending_head,
+                    (sftp->pending_tail - sftp->pending_head) *
+                        sizeof(struct sftp_pending_entry));
+            sftp->pending_tail -= sftp->pending_head;
+            sftp->pending_head = 0;
+        } else {
+            alloc = MAX(64, 2 * sftp->pending_alloc);
+            entries = realloc(sftp->pending,
+                              alloc * sizeof(struct sftp_pending_entry));
+            if (entries == NULL) {
+                ssh_set_error(SSH_FATAL, "out of memory");
+                SAFE_FREE(req);
+                return NULL;
+            }
+            sftp->pending = entries;
+            sftp->pending_alloc = alloc;
+        }
+    }
+
+    if (sftp_packet_write(sftp, type, payload) < 0) {
+        LOG_CRITICAL("can not send request type %d", type);
+        ssh_set_error(SSH_FATAL, "request type %d error", type);
+        SAFE_FREE(req);
+        return NULL;
+    }
+
+    /* ids are increasing, so this is an append unless requests were sent
+     * out of order */
+    for (i = sftp->pending_tail;
+         i > sftp->pending_head && sftp->pending[i - 1].id > id; i--) {
+        sftp->pending[i] = sftp->pending[i - 1];
+    }
+    sftp->pending[i].id = id;
+    sftp->pending[i].req = req;
+    sftp->pending_tail++;
+
+    return req;
+}
+
+/**
+ * @brief Remove the request waiting for reply `id` from the pending table.
+ *
+ * @param sftp
+ * @param id
+ * @return sftp_request, NULL if no request waits for `id`.
+ */
+static sftp_request sftp_pending_take(sftp_session sftp, uint32_t id) {
+    sftp_request req;
+    uint32_t lo = sftp->pending_head;
+    uint32_t hi = sftp->pending_tail;
+    uint32_t mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (sftp->pending[mid].id < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == sftp->pending_tail || sftp->pending[lo].id != id) return NULL;
+
+    req = sftp->pending[lo].req;
+    sftp->pending[lo].req = NULL;
+
+    /* replies mostly come in order, so answered entries pile up at the head */
+    while (sftp->pending_head < sftp->pending_tail &&
+           sftp->pending[sftp->pending_head].req == NULL) {
+        sftp->pending_head++;
+    }
+    if (sftp->pending_head == sftp->pending_tail) {
+        sftp->pending_head = sftp->pending_tail = 0;
+    }
+
+    return req;
+}
+
+/**
+ * @brief Free an answered request and its reply.
+ *
+ * @param req
+ */
+static void sftp_request_free(sftp_request req) {
+    if (req == NULL) return;
+    sftp_packet_free(req->reply);
+    SAFE_FREE(req->path);
+    SAFE_FREE(req);
+}
+
+/**
+ * @brief Wait for a request answered by SSH_FXP_STATUS and get the status
+ * code. The request is not freed.
+ *
+ * @param req
+ * @param code
+ * @return SSH_OK if a status was received, SSH_ERROR otherwise.
+ */
+static int sftp_request_status(sftp_request req, uint32_t *code) {
+    sftp_status status = NULL;
+
+    if (sftp_request_wait(req) != SSH_OK) return SSH_ERROR;
+    if (req->reply->type != SSH_FXP_STATUS) return SSH_ERROR;
+
+    status = sftp_parse_status(req->reply);
+    if (status == NULL) return SSH_ERROR;
+
+    *code = status->status;
+    sftp_status_free(status);
+    return SSH_OK;
+}
+
+/**
+ * @brief Read `count` bytes with up to `read_depth` SSH_FXP_READ requests in
+ * flight. Replies are copied to their place in `buf`, whatever order they
+ * arrive in. A short reply is followed by a new request for the missing tail.
+ * On error the outstanding requests are cancelled, so that their replies are
+ * dropped when they arrive.
+ *
+ * @param file
+ * @param buf
+ * @param count
+ * @return bytes read, 0 on EOF, SSH_ERROR on error.
+ */
+static int32_t sftp_read_pipelined(sftp_file file, void *buf,
+                                   uint32_t count) {
+    sftp_session sftp = file->sftp;
+    sftp_request *reqs = NULL;
+    sftp_request req;
+    uint64_t start = file->offset;
+    uint32_t depth = sftp->read_depth;
+    uint32_t head = 0;
+    uint32_t inflight = 0;
+    uint32_t next = 0;       /* first byte of `buf` not requested yet */
+    uint32_t eof_at = count; /* first byte known to be beyond EOF */
+    uint32_t pos;
+    uint32_t len;
+    int32_t nread;
+    int rc;
+
+    reqs = calloc(depth, sizeof(sftp_request));
+    if (reqs == NULL) {
+        ssh_set_error(SSH_FATAL, "out of memory");
+        return SSH_ERROR;
+    }
+
+    while (1) {
+        /* keep `depth` requests in flight */
+        while (inflight < depth && next < eof_at) {
+            len = MIN(sftp->max_read, eof_at - next);
+
+            /* let the server send all the replies we are waiting for */
+            rc = ssh_channel_grow_window(
+                sftp->channel,
+                (inflight + 1) * (sftp->max_read + SFTP_DATA_HEADER_LEN));
+            if (rc != SSH_OK) goto error;
+
+            req = sftp_async_read(file, start + next, len);
+            if (req == NULL) goto error;
+            req->dest = (uint8_t *)buf + next;
+            reqs[(head + inflight++) % depth] = req;
+            next += len;
+        }
+
+        if (inflight == 0) break;
+
+        req = reqs[head];
+        head = (head + 1) % depth;
+        inflight--;
+
+        pos = req->offset - start;
+        len = req->len;
+        nread = sftp_async_read_result(req, (uint8_t *)buf + pos, len);
+        if (nread < 0) goto error;
+
+        if (nread == 0) {
+            eof_at = MIN(eof_at, pos);
+        } else if (nread < len && pos + nread < eof_at) {
+            /* short read, ask again for the missing tail */
+            pos += nread;
+            req = sftp_async_read(file, start + pos,
+                                  MIN(len - nread, eof_at - pos));
+            if (req == NULL) goto error;
+            req->dest = (uint8_t *)buf + pos;
+            reqs[(head + inflight++) % depth] = req;
+        }
+    }
+
+    SAFE_FREE(reqs);
+
+    file->offset += eof_at;
+    return eof_at;
+
+error:
+    while (inflight > 0) {
+        sftp_request_cancel(reqs[head]);
+        head = (head + 1) % depth;
+        inflight--;
+    }
+    SAFE_FREE(reqs);
+    return SSH_ERROR;
+}
+
+/**
+ * @brief Send an SSH_FXP_READ request for a range whose reply goes straight
+ * into `buf`.
+ *
+ * @param file
+ * @param req
+ * @param buf
+ * @param offset
+ * @param len
+ * @return int
+ */
+static int sftp_get_range(sftp_file file, sftp_request *req, void *buf,
+                          uint64_t offset, uint32_t len) {
+    *req = sftp_async_read(file, offset, len);
+    if (*req == NULL) return SSH_ERROR;
+    (*req)->dest = buf;
+    return SSH_OK;
+}
+
+/**
+ * @brief Cancel the read-ahead requests of `file` behind the first `keep`
+ * chunks and forget their chunks.
+ *
+ * @param file
+ * @param keep
+ */
+static void sftp_ra_trim(sftp_file file, uint32_t keep) {
+    struct sftp_ra_chunk *chunk;
+    uint32_t i;
+
+    for (i = keep; i < file->ra_count; i++) {
+        chunk = &file->ra[(file->ra_head + i) % file->ra_slots];
+        sftp_request_cancel(chunk->req);
+        chunk->req = NULL;
+    }
+    file->ra_count = MIN(file->ra_count, keep);
+}
+
+/**
+ * @brief Cancel all read-ahead of `file`, for a jump or a write.
+ *
+ * @param file
+ */
+static void sftp_ra_drop(sftp_file file) {
+    sftp_ra_trim(file, 0);
+    file->ra_head = 0;
+    file->ra_depth = 1;
+}
+
+/**
+ * @brief Keep `ra_depth` chunks of `file` asked for: every free chunk gets
+ * a READ request for the bytes following the last one asked for, with the
+ * channel window grown to take all of their replies.
+ *
+ * @param file
+ * @return int
+ */
+static int sftp_ra_fill(sftp_file file) {
+    struct sftp_ra_chunk *chunk;
+    uint32_t i;
+
+    while (file->ra_count < MIN(file->ra_depth, file->ra_slots) &&
+           !file->ra_eof) {
+        /* let the server send all the chunks asked for */
+        if (ssh_channel_grow_window(
+                file->sftp->channel,
+                (file->ra_count + 1) *
+                    (file->ra_chunk + SFTP_DATA_HEADER_LEN)) != SSH_OK) {
+            return SSH_ERROR;
+        }
+        i = (file->ra_head + file->ra_count) % file->ra_slots;
+        chunk = &file->ra[i];
+        if (sftp_get_range(file, &chunk->req,
+                           file->ra_data + (size_t)i * file->ra_chunk,
+                           file->ra_next, file->ra_chunk) != SSH_OK) {
+            return SSH_ERROR;
+        }
+        chunk->offset = file->ra_next;
+        chunk->size = file->ra_chunk;
+        chunk->filled = 0;
+        chunk->pos = 0;
+        file->ra_next += file->ra_chunk;
+        file->ra_count++;
+    }
+    return SSH_OK;
+}
+
+/**
+ * @brief Serve a sequential read from the read-ahead ring of `file`.
+ *
+ * The ring starts at the file offset, so a jump since the last call cancels
+ * it and prefetching restarts from the new offset with a single chunk. The
+ * depth doubles each time a chunk is used up, and the chunk is asked for
+ * again further ahead, keeping the requests in flight while the caller
+ * works on the data. A short reply is followed by a request for the rest of
+ * its chunk; an empty one marks the end of file and cancels the chunks
+ * behind it.
+ *
+ * @param file
+ * @param buf
+ * @param count
+ * @return bytes read, 0 on EOF, SSH_ERROR on error.
+ */
+static int32_t sftp_read_ahead(sftp_file file, void *buf, uint32_t count) {
+    struct sftp_ra_chunk *chunk;
+    uint8_t *data;
+    uint32_t copied = 0;
+    uint32_t n;
+    int32_t nread;
+
+    if (file->ra_count > 0) {
+        chunk = &file->ra[file->ra_head];
+        if (chunk->offset + chunk->pos != file->offset) sftp_ra_drop(file);
+    }
+    if (file->ra_count == 0) {
+        file->ra_head = 0;
+        file->ra_next = file->offset;
+        file->ra_eof = false;
+        if (file->ra_depth == 0) file->ra_depth = 1;
+    }
+
+    while (copied < count) {
+        if (sftp_ra_fill(file) != SSH_OK) goto error;
+        if (file->ra_count == 0) break;
+
+        chunk = &file->ra[file->ra_head];
+        data = file->ra_data + (size_t)file->ra_head * file->ra_chunk;
+        if (chunk->pos == chunk->filled && chunk->req != NULL) {
+            nread = sftp_async_read_result(chunk->req, data + chunk->filled,
+                                           chunk->size - chunk->filled);
+            chunk->req = NULL;
+            if (nread < 0) goto error;
+            if (nread == 0) {
+                sftp_ra_trim(file, 1);
+                chunk->size = chunk->filled;
+                file->ra_next = chunk->offset + chunk->filled;
+                file->ra_eof = true;
+            }
+            chunk->filled += nread;
+            if (chunk->filled < chunk->size &&
+                sftp_get_range(file, &chunk->req, data + chunk->filled,
+                               chunk->offset + chunk->filled,
+                               chunk->size - chunk->filled) != SSH_OK) {
+                goto error;
+            }
+        }
+
+        n = MIN(count - copied, chunk->filled - chunk->pos);
+        memcpy((uint8_t *)buf + copied, data + chunk->pos, n);
+        file->sftp->session->stats.copied_bytes += n;
+        chunk->pos += n;
+        copied += n;
+        file->offset += n;
+
+        if (chunk->pos == chunk->size) {
+            file->ra_head = (file->ra_head + 1) % file->ra_slots;
+            file->ra_count--;
+            file->ra_depth = MIN(2 * file->ra_depth, file->ra_slots);
+        }
+    }
+    return copied;
+
+error:
+    sftp_ra_drop(file);
+    /* the bytes already copied are returned, the error comes again */
+    return copied > 0 ? (int32_t)copied : SSH_ERROR;
+}
+
+/**
+ * @brief Truncate an opened file with SSH_FXP_FSETSTAT.
+ *
+ * @param file
+ * @param size
+ * @return int
+ */
+static int sftp_ftruncate(sftp_file file, uint64_t size) {
+    sftp_session sftp = file->sftp;
+    sftp_request req;
+    ssh_buffer buffer;
+    uint32_t id;
+    uint32_t code;
+    int rc;
+
+    buffer = ssh_buffer_new();
+    if (buffer == NULL) {
+        ssh_set_error(SSH_FATAL, "buffer error");
+        return SSH_ERROR;
+    }
+    id = sftp_get_new_id(sftp);
+    rc = ssh_buffer_pack(buffer, "dSdq", id, file->handle,
+                         SSH_FILEXFER_ATTR_SIZE, size);
+    if (rc != SSH_OK) {
+        ssh_set_error(SSH_FATAL, "buffer error");
+        ssh_buffer_free(buffer);
+        return SSH_ERROR;
+    }
+    sftp_attr_cache_invalidate(sftp, file->path);
+    req = sftp_request_send(sftp, SSH_FXP_FSETSTAT, id, buffer);
+    ssh_buffer_free(buffer);
+    if (req == NULL) return SSH_ERROR;
+
+    if (sftp_request_status(req, &code) != SSH_OK) {
+        sftp_request_cancel(req);
+        ssh_set_error(SSH_FATAL, "unexpected fsetstat response");
+        return SSH_ERROR;
+    }
+    sftp_request_free(req);
+    if (code != SSH_FX_OK) {
+        ssh_set_error(SSH_REQUEST_DENIED, "truncate failed with error code %u",
+                      code);
+        return SSH_ERROR;
+    }
+    return SSH_OK;
+}
+
+/**
+ * @brief Pack the attributes version 3 knows of, as flagged in
+ * `attr->flags`.
+ *
+ * @param buffer
+ * @param attr
+ * @return int
+ */
+static int sftp_pack_attr(ssh_buffer buffer, sftp_attributes attr) {
+    uint32_t flags = attr->flags &
+                     (SSH_FILEXFER_ATTR_SIZE | SSH_FILEXFER_ATTR_UIDGID |
+                      SSH_FILEXFER_ATTR_PERMISSIONS |
+                      SSH_FILEXFER_ATTR_ACMODTIME);
+    int rc;
+
+    rc = ssh_buffer_pack(buffer, "d", flags);
+    if (rc == SSH_OK && (flags & SSH_FILEXFER_ATTR_SIZE)) {
+        rc = ssh_buffer_pack(buffer, "q", attr->size);
+    }
+    if (rc == SSH_OK && (flags & SSH_FILEXFER_ATTR_UIDGID)) {
+        rc = ssh_buffer_pack(buffer, "dd", attr->uid, attr->gid);
+    }
+    if (rc == SSH_OK && (flags & SSH_FILEXFER_ATTR_PERMISSIONS)) {
+        rc = ssh_buffer_pack(buffer, "d", attr->permissions);
+    }
+    if (rc == SSH_OK && (flags & SSH_FILEXFER_ATTR_ACMODTIME)) {
+        rc = ssh_buffer_pack(buffer, "dd", attr->atime, attr->mtime);
+    }
+    return rc;
+}
+
+/**
+ * @brief Name an operation of sftp_batch() for error messages.
+ *
+ * @param op
+ * @return the name, NULL if `op` is not an operation.
+ */
+static const char *sftp_batch_name(int op) {
+    switch (op) {
+        case SFTP_BATCH_REMOVE:
+            return "remove";
+        case SFTP_BATCH_RENAME:
+            return "rename";
+        case SFTP_BATCH_MKDIR:
+            return "mkdir";
+        case SFTP_BATCH_RMDIR:
+            return "rmdir";
+        case SFTP_BATCH_SETSTAT:
+            return "setstat";
+        default:
+            return NULL;
+    }
+}
+
+/**
+ * @brief Send the request of an sftp_batch() item. Cached attributes of
+ * the paths it changes, and of what is under them, are dropped.
+ *
+ * @param sftp
+ * @param item
+ * @return the request, NULL on error.
+ */
+static sftp_request sftp_batch_send(sftp_session sftp,
+                                    const struct sftp_batch_item *item) {
+    sftp_request req;
+    ssh_buffer buffer;
+    uint32_t id;
+    uint8_t type;
+    int rc;
+
+    if (item->op == SFTP_BATCH_MKDIR) {
+        return sftp_async_mkdir(sftp, item->path, item->mode);
+    }
+
+    buffer = ssh_buffer_new();
+    if (buffer == NULL) {
+        ssh_set_error(SSH_FATAL, "buffer error");
+        return NULL;
+    }
+    id = sftp_get_new_id(sftp);
+    rc = ssh_buffer_pack(buffer, "ds", id, item->path);
+    switch (item->op) {
+        case SFTP_BATCH_REMOVE:
+            type = SSH_FXP_REMOVE;
+            break;
+        case SFTP_BATCH_RENAME:
+            type = SSH_FXP_RENAME;
+            if (rc == SSH_OK) rc = ssh_buffer_pack(buffer, "s", item->target);
+            sftp_attr_cache_invalidate(sftp, item->target);
+            break;
+        case SFTP_BATCH_RMDIR:
+            type = SSH_FXP_RMDIR;
+            break;
+        default:
+            type = SSH_FXP_SETSTAT;
+            if (rc == SSH_OK) rc = sftp_pack_attr(buffer, item->attr);
+            break;
+    }
+    if (rc != SSH_OK) {
+        ssh_set_error(SSH_FATAL, "buffer error");
+        ssh_buffer_free(buffer);
+        return NULL;
+    }
+    sftp_attr_cache_invalidate(sftp, item->path);
+
+    req = sftp_request_send(sftp, type, id, buffer);
+    ssh_buffer_free(buffer);
+    return req;
+}
+
+/**
+ * @brief Compare the last SFTP_RESUME_TAIL bytes before `offset` of the
+ * remote and the local file.
+ *
+ * @param file
+ * @param fd
+ * @param offset
+ * @param match
+ * @return int
+ */
+static int sftp_resume_verify(sftp_file file, int fd, uint64_t offset,
+                              bool *match) {
+    uint32_t tail = MIN(offset, SFTP_RESUME_TAIL);
+    uint8_t *local = NULL;
+    uint8_t *remote = NULL;
+    uint32_t got = 0;
+    int32_t nread;
+
+    local = malloc(tail);
+    remote = malloc(tail);
+    if (local == NULL || remote == NULL) {
+        ssh_set_error(SSH_FATAL, "out of memory");
+        goto error;
+    }
+
+    if (pread(fd, local, tail, offset - tail) != tail) {
+        ssh_set_error(SSH_FATAL, "can not read local file: %s",
+                      strerror(errno));
+        goto error;
+    }
+
+    /* start afresh at the tail, without what a read-ahead prefetched */
+    sftp_ra_drop(file);
+    sftp_seek(file, offset - tail);
+    /* the server may cap reads below `tail` */
+    while (got < tail) {
+        nread = sftp_read(file, remote + got, tail - got);
+        if (nread < 0) goto error;
+        if (nread == 0) break;
+        got += nread;
+    }
+
+    *match = got == tail && memcmp(local, remote, tail) == 0;
+    if (!*match) LOG_NOTICE("resume tail mismatch before %lu",
+                            (unsigned long)offset);
+
+    SAFE_FREE(local);
+    SAFE_FREE(remote);
+    return SSH_OK;
+
+error:
+    SAFE_FREE(local);
+    SAFE_FREE(remote);
+    return SSH_ERROR;
+}
+
+/**
+ * @brief Wait for the oldest outstanding write-behind request and record a
+ * failure in the file it belongs to. When several requests of a file fail,
+ * the lowest offset is kept.
+ *
+ * @param sftp
+ * @return SSH_OK if a status was collected, SSH_ERROR on a session error.
+ */
+static int sftp_collect_write(sftp_session sftp) {
+    sftp_request req;
+    sftp_file file;
+    uint32_t code;
+
+    req = sftp->writes[sftp->write_head];
+    sftp->write_head = (sftp->write_head + 1) % sftp->write_alloc;
+    sftp->write_count--;
+    sftp->write_inflight -= req->len;
+    file = req->file;
+
+    if (sftp_request_wait(req) != SSH_OK) {
+        sftp_request_cancel(req);
+        return SSH_ERROR;
+    }
+    if (sftp_request_status(req, &code) != SSH_OK) {
+        code = SSH_FX_BAD_MESSAGE;
+    }
+
+    if (code != SSH_FX_OK) {
+        LOG_DEBUG("%s at offset %lu failed with error code %u",
+                  req->type == SSH_FXP_EXTENDED ? "fsync" : "write",
+                  (unsigned long)req->offset, code);
+        if (!file->write_failed || req->offset < file->write_error_offset) {
+            file->write_failed = true;
+            file->write_error = code;
+            file->write_error_offset = req->offset;
+        }
+    }
+    sftp_request_free(req);
+
+    return SSH_OK;
+}
+
+/**
+ * @brief Wait until every write-behind request of the session is answered.
+ *
+ * @param sftp
+ * @return int
+ */
+static int sftp_drain_writes(sftp_session sftp) {
+    while (sftp->write_count > 0) {
+        if (sftp_collect_write(sftp) != SSH_OK) return SSH_ERROR;
+    }
+    return SSH_OK;
+}
+
+/**
+ * @brief Report a failed write-behind request of `file` as the current error.
+ *
+ * @param file
+ * @return SSH_OK if all collected writes succeeded, SSH_ERROR otherwise.
+ */
+static int sftp_check_write_error(sftp_file file) {
+    if (!file->write_failed) return SSH_OK;
+
+    ssh_set_error(SSH_FATAL, "write at offset %lu failed with error code %u",
+                  (unsigned long)file->write_error_offset, file->write_error);
+    return SSH_ERROR;
+}
+
+/**
+ * @brief Send SSH_FXP_WRITE requests for `count` bytes at the file offset
+ * without waiting for their statuses, see sftp_write_send().
+ *
+ * @param file
+ * @param buf
+ * @param count
+ * @return bytes accepted, SSH_ERROR on error.
+ */
+static int32_t sftp_write_behind(sftp_file file, const void *buf,
+                                 uint32_t count) {
+    uint32_t nleft = count;
+    uint32_t nwrite;
+
+    while (nleft > 0) {
+        nwrite = MIN(nleft, file->sftp->max_write);
+        if (sftp_write_send(file, file->offset, (char *)buf + (count - nleft),
+                            nwrite) != SSH_OK) {
+            return SSH_ERROR;
+        }
+        file->offset += nwrite;
+        nleft -= nwrite;
+    }
+
+    return count;
+}
+
+/**
+ * @brief Send one SSH_FXP_WRITE request without waiting for its status.
+ * Statuses are only collected while more than `write_behind` bytes, or
+ * SFTP_WRITE_BUFFER_INFLIGHT for a write buffer on a session without
+ * write-behind, would be in flight, or while the channel window is too
+ * small for the request. A failed status is reported by a later call on the
+ * file. The durability points of sftp_set_fsync_interval() follow the
+ * request.
+ *
+ * @param file
+ * @param offset
+ * @param buf
+ * @param len       at most the session write size
+ * @return int
+ */
+static int sftp_write_send(sftp_file file, uint64_t offset, const void *buf,
+                           uint32_t len) {
+    sftp_session sftp = file->sftp;
+    uint32_t limit = sftp->write_behind;
+    sftp_request req;
+
+    if (limit == 0) limit = SFTP_WRITE_BUFFER_INFLIGHT;
+
+    while (sftp->write_count > 0 &&
+           (sftp->write_inflight + len > limit ||
+            sftp->channel->remote_window < len + SFTP_WRITE_HEADER_LEN)) {
+        if (sftp_collect_write(sftp) != SSH_OK) return SSH_ERROR;
+    }
+    if (sftp_check_write_error(file) != SSH_OK) return SSH_ERROR;
+
+    req = sftp_async_write(file, offset, buf, len);
+    if (req == NULL) return SSH_ERROR;
+    if (sftp_write_queue(sftp, req) != SSH_OK) {
+        sftp_request_cancel(req);
+        return SSH_ERROR;
+    }
+    sftp->write_inflight += len;
+
+    file->unsynced += len;
+    if (sftp->fsync_interval > 0 && file->unsynced >= sftp->fsync_interval) {
+        return sftp_queue_fsync(file, offset + len);
+    }
+    return SSH_OK;
+}
+
+/**
+ * @brief Gather adjacent writes in the write buffer of `file`, sent as one
+ * SSH_FXP_WRITE request each time it fills up. A write at another offset
+ * sends what was gathered first, and a write at least the buffer size that
+ * finds it empty skips it for whole requests.
+ *
+ * @param file
+ * @param buf
+ * @param count
+ * @return bytes accepted, SSH_ERROR on error.
+ */
+static int32_t sftp_write_buffered(sftp_file file, const void *buf,
+                                   uint32_t count) {
+    const uint8_t *data = buf;
+    uint32_t nleft = count;
+    uint32_t n;
+
+    if (file->wbuf_len > 0 &&
+        file->wbuf_offset + file->wbuf_len != file->offset &&
+        sftp_wbuf_flush(file) != SSH_OK) {
+        return SSH_ERROR;
+    }
+
+    while (nleft > 0) {
+        if (file->wbuf_len == 0 && nleft >= file->wbuf_size) {
+            n = MIN(nleft, file->sftp->max_write);
+            if (sftp_write_send(file, file->offset, data, n) != SSH_OK) {
+                return SSH_ERROR;
+            }
+        } else {
+            if (file->wbuf_len == 0) file->wbuf_offset = file->offset;
+            n = MIN(nleft, file->wbuf_size - file->wbuf_len);
+            memcpy(file->wbuf + file->wbuf_len, data, n);
+            file->sftp->session->stats.copied_bytes += n;
+            file->wbuf_len += n;
+        }
+        file->offset += n;
+        data += n;
+        nleft -= n;
+
+        if (file->wbuf_len == file->wbuf_size &&
+            sftp_wbuf_flush(file) != SSH_OK) {
+            return SSH_ERROR;
+        }
+    }
+
+    return count;
+}
+
+/**
+ * @brief Send the bytes gathered in the write buffer of `file`, without
+ * waiting for the status.
+ *
+ * @param file
+ * @return int
+ */
+static int sftp_wbuf_flush(sftp_file file) {
+    if (file->wbuf_len == 0) return SSH_OK;
+
+    if (sftp_write_send(file, file->wbuf_offset, file->wbuf,
+                        file->wbuf_len) != SSH_OK) {
+        return SSH_ERROR;
+    }
+    file->wbuf_len = 0;
+    return SSH_OK;
+}
+
+/**
+ * @brief Measure the run of zero or nonzero bytes at the start of `buf`, in
+ * whole SFTP_SPARSE_BLOCK blocks aligned on file offsets. Partial blocks at
+ * either end of `buf` count as nonzero.
+ *
+ * @param buf
+ * @param len
+ * @param offset    file offset of `buf`
+ * @param zero      set if the run is zeros
+ * @return the length of the run, at least 1 if `len` is.
+ */
+static uint32_t sftp_sparse_run(const uint8_t *buf, uint32_t len,
+                                uint64_t offset, bool *zero) {
+    uint32_t pos;
+    uint32_t block;
+    bool block_zero;
+
+    *zero = false;
+    pos = 0;
+    while (pos < len) {
+        block = SFTP_SPARSE_BLOCK - (offset + pos) % SFTP_SPARSE_BLOCK;
+        block = MIN(block, len - pos);
+        /* buf[0] == 0 and buf == buf + 1 means all zeros, and memcmp() is
+         * vectorized where plain loops may not be */
+        block_zero = block == SFTP_SPARSE_BLOCK && buf[pos] == 0 &&
+                     memcmp(buf + pos, buf + pos + 1, block - 1) == 0;
+        if (pos == 0) {
+            *zero = block_zero;
+        } else if (block_zero != *zero) {
+            break;
+        }
+        pos += block;
+    }
+    return pos;
+}
+
+/**
+ * @brief pwrite() the nonzero blocks of `buf` only. Zero blocks from
+ * `hole_from` on are skipped, as a hole reads as zeros there already; below
+ * it, their space is released by punching a hole where the file system
+ * can, or they are written like data.
+ *
+ * @param fd
+ * @param buf
+ * @param len
+ * @param offset
+ * @param hole_from     UINT64_MAX to write every byte
+ * @return int
+ */
+static int sftp_pwrite_sparse(int fd, const uint8_t *buf, uint32_t len,
+                              uint64_t offset, uint64_t hole_from) {
+    uint32_t pos;
+    uint32_t run;
+    bool zero;
+
+    for (pos = 0; pos < len; pos += run) {
+        run = len - pos;
+        zero = false;
+        if (hole_from != UINT64_MAX) {
+            run = sftp_sparse_run(buf + pos, run, offset + pos, &zero);
+        }
+        if (zero && offset + pos >= hole_from) continue;
+#ifdef FALLOC_FL_PUNCH_HOLE
+        if (zero && fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                              offset + pos, run) == 0) {
+            continue;
+        }
+#endif
+        if (pwrite(fd, buf + pos, run, offset + pos) != (ssize_t)run) {
+            ssh_set_error(SSH_FATAL, "local write at offset %lu failed: %s",
+                          (unsigned long)(offset + pos), strerror(errno));
+            return SSH_ERROR;
+        }
+    }
+    return SSH_OK;
+}
+
+/**
+ * @brief Append a request to the write-behind ring, growing it if needed.
+ *
+ * @param sftp
+ * @param req
+ * @return int
+ */
+static int sftp_write_queue(sftp_session sftp, sftp_request req) {
+    sftp_request *writes;
+    uint32_t alloc;
+    uint32_t i;
+
+    if (sftp->write_count == sftp->write_alloc) {
+        /* grow the ring, unwrapping it at the same time */
+        alloc = MAX(16, 2 * sftp->write_alloc);
+        writes = malloc(alloc * sizeof(sftp_request));
+        if (writes == NULL) {
+            ssh_set_error(SSH_FATAL, "out of memory");
+            return SSH_ERROR;
+        }
+        for (i = 0; i < sftp->write_count; i++) {
+            writes[i] =
+                sftp->writes[(sftp->write_head + i) % sftp->write_alloc];
+        }
+        SAFE_FREE(sftp->writes);
+        sftp->writes = writes;
+        sftp->write_alloc = alloc;
+        sftp->write_head = 0;
+    }
+
+    sftp->writes[(sftp->write_head + sftp->write_count) % sftp->write_alloc] =
+        req;
+    sftp->write_count++;
+    return SSH_OK;
+}
+
+/**
+ * @brief Send fsync@openssh.com for `file` without waiting for its status.
+ * It joins the write-behind requests, so the server handles it after the
+ * writes sent before it, and its status is collected and reported like
+ * theirs, at `offset`, the end of the last write it covers.
+ *
+ * @param file
+ * @param offset
+ * @return int
+ */
+static int sftp_queue_fsync(sftp_file file, uint64_t offset) {
+    sftp_session sftp = file->sftp;
+    sftp_request req;
+    ssh_buffer buffer;
+    uint32_t id;
+
+    buffer = ssh_buffer_new();
+    if (buffer == NULL) {
+        ssh_set_error(SSH_FATAL, "buffer error");
+        return SSH_ERROR;
+    }
+    id = sftp_get_new_id(sftp);
+    if (ssh_buffer_pack(buffer, "dsS", id, "fsync@openssh.com",
+                        file->handle) != SSH_OK) {
+        ssh_set_error(SSH_FATAL, "buffer error");
+        ssh_buffer_free(buffer);
+        return SSH_ERROR;
+    }
+    req = sftp_request_send(sftp, SSH_FXP_EXTENDED, id, buffer);
+    ssh_buffer_free(buffer);
+    if (req == NULL) return SSH_ERROR;
+
+    req->file = file;
+    req->offset = offset;
+    req->len = 0;
+    if (sftp_write_queue(sftp, req) != SSH_OK) {
+        sftp_request_cancel(req);
+        return SSH_ERROR;
+    }
+    file->unsynced = 0;
+    return SSH_OK;
+}
+
+static void sftp_status_free(sftp_status status) {
+    if (status == NULL) return;
+    SAFE_FREE(status->errormsg);
+    SAFE_FREE(status->langtag);
+    SAFE_FREE(status);
+}
+
+static sftp_packet sftp_packet_new(sftp_session sftp) {
+    sftp_packet packet = NULL;
+
+    packet = calloc(1, sizeof(struct sftp_packet_struct));
+    if (packet == NULL) return NULL;
+
+    packet->sftp = sftp;
+    packet->payload = ssh_buffer_new();
+    if (packet->payload == NULL) {
+        SAFE_FREE(packet);
+        return NULL;
+    }
+
+    return packet;
+}
+
+static void sftp_packet_free(sftp_packet packet) {
+    if (packet == NULL) return;
+    ssh_buffer_free(packet->payload);
+    SAFE_FREE(packet);
+}
+
+static void sftp_file_free(sftp_file file) {
+    if (file == NULL) return;
+    ssh_string_free(file->handle);
+    SAFE_FREE(file->path);
+    SAFE_FREE(file->ra);
+    SAFE_FREE(file->ra_data);
+    SAFE_FREE(file->wbuf);
+    SAFE_FREE(file);
+}
+
+/**
+ * @brief Parse an SFTP packet with type SSH_FXP_HANDLE. Allocate and initiate a
+ * file structure.
+ *
+ * @param packet
+ * @param orig_id
+ * @return sftp_file
+ */
+static sftp_file sftp_parse_handle(sftp_packet packet, uint32_t orig_id) {
+    sftp_file file;
+    uint32_t id;
+    int rc;
+
+    if (packet->type != SSH_FXP_HANDLE) return NULL;
+
+    file = calloc(1, sizeof(struct sftp_file_struct));
+    if (file == NULL) return NULL;
+
+    rc = ssh_buffer_unpack(packet->payload, "dS", &id, &file->handle);
+    if (rc != SSH_OK || file->handle == NULL) {
+        SAFE_FREE(file);
+        return NULL;
+    }
+
+    if (id != orig_id) {
+        LOG_ERROR("sftp response id %d does not match with origin id %d", id,
+                  orig_id);
+        SAFE_FREE(file);
+        return NULL;
+    }
+
+    file->sftp = packet->sftp;
+    file->offset = 0;
+    file->eof = 0;
+
+    return file;
+}
+
+/**
+ * @brief Parse an SFTP packet with type SSH_FXP_STATUS. Allocate and initiate a
+ * status structure.
+ *
+ * @param packet
+ * @return sftp_status
+ */
+static sftp_status sftp_parse_status(sftp_packet packet) {
+    sftp_status status;
+    int rc;
+
+    if (packet->type != SSH_FXP_STATUS) return NULL;
+
+    status = calloc(1, sizeof(struct sftp_status_struct));
+    if (status == NULL) return NULL;
+
+    rc = ssh_buffer_unpack(packet->payload, "dd", &status->id, &status->status);
+    if (rc != SSH_OK) {
+        SAFE_FREE(status);
+        return NULL;
+    }
+    rc = ssh_buffer_unpack(packet->payload, "ss", &status->errormsg,
+                           &status->langtag);
+
+    if (rc != SSH_OK) {
+        SAFE_FREE(status);
+        return NULL;
+    }
+
+    return status;
+}
+
+/**
+ * @brief Get file attributes from the server, following symbolic links.
+ *
+ * @param session
+ * @param path
+ * @return sftp_attributes
+ */
+sftp_attributes sftp_stat(sftp_session session, const char *path) {
+    return sftp_xstat(session, path, SSH_FXP_STAT);
+}
+
+/**
+ * @brief Get file attributes from the server, of a symbolic link itself
+ * rather than of its target.
+ *
+ * @param session
+ * @param path
+ * @return sftp_attributes
+ */
+sftp_attributes sftp_lstat(sftp_session session, const char *path) {
+    return sftp_xstat(session, path, SSH_FXP_LSTAT);
+}
+
+/**
+ * @brief Get the attributes of an open file from the server. Bytes in the
+ * write buffer are sent first, so that the size includes them.
+ *
+ * @param file
+ * @return sftp_attributes
+ */
+sftp_attributes sftp_fstat(sftp_file file) {
+    sftp_request req;
+    ssh_buffer buffer;
+    uint32_t id;
+    uint32_t code;
+    int rc;
+
+    if (file == NULL) return NULL;
+
+    /* the size includes buffered bytes */
+    if (sftp_wbuf_flush(file) != SSH_OK) return NULL;
+
+    buffer = ssh_buffer_new();
+    if (buffer == NULL) {
+        ssh_set_error(SSH_FATAL, "buffer error");
+        return NULL;
+    }
+    id = sftp_get_new_id(file->sftp);
+    rc = ssh_buffer_pack(buffer, "dS", id, file->handle);
+    if (rc != SSH_OK) {
+        ssh_set_error(SSH_FATAL, "buffer error");
+        ssh_buffer_free(buffer);
+        return NULL;
+    }
+    req = sftp_request_send(file->sftp, SSH_FXP_FSTAT, id, buffer);
+    ssh_buffer_free(buffer);
+
+    return sftp_attr_result(req, file->path, &code);
+}
+
+void sftp_attributes_free(sftp_attributes attr) {
+    if (attr == NULL) return;
+    SAFE_FREE(attr->name);
+    SAFE_FREE(attr->longname);
+    SAFE_FREE(attr->owner);
+    SAFE_FREE(attr->group);
+    SSH_STRING_FREE(attr->acl);
+    SSH_STRING_FREE(attr->extended_type);
+    SSH_STRING_FREE(attr->extended_data);
+    SAFE_FREE(attr);
+}
+
+sftp_dir sftp_opendir(sftp_session sftp, const char *path) {
+    sftp_dir dir = NULL;
+    sftp_request req;
+    ssh_buffer buffer;
+    uint32_t id;
+    uint32_t code;
+    int rc;
+
+    if (sftp == NULL || path == NULL) return NULL;
+
+    buffer = ssh_buffer_new();
+    if (buffer == NULL) {
+        ssh_set_error(SSH_FATAL, "buffer error");
+        return NULL;
+    }
+    id = sftp_get_new_id(sftp);
+    rc = ssh_buffer_pack(buffer, "ds", id, path);
+    if (rc != SSH_OK) {
+        ssh_set_error(SSH_FATAL, "buffer error");
+        ssh_buffer_free(buffer);
+        return NULL;
+    }
+    req = sftp_request_send(sftp, SSH_FXP_OPENDIR, id, buffer);
+    ssh_buffer_free(buffer);
+    if (req == NULL) return NULL;
+
+    if (sftp_request_wait(req) != SSH_OK) {
+        sftp_request_cancel(req);
+        return NULL;
+    }
+
+    if (req->reply->type == SSH_FXP_STATUS) {
+        if (sftp_request_status(req, &code) != SSH_OK) code = SSH_FX_FAILURE;
+        ssh_set_error(SSH_REQUEST_DENIED,
+                      "opendir %s failed with error code %u", path, code);
+        goto error;
+    }
+
+    dir = calloc(1, sizeof(struct sftp_dir_struct));
+    if (dir == NULL) {
+        ssh_set_error(SSH_FATAL, "out of memory");
+        goto error;
+    }
+    dir->sftp = sftp;
+
+    rc = ssh_buffer_unpack(req->reply->payload, "dS", &id, &dir->handle);
+    if (req->reply->type != SSH_FXP_HANDLE || rc != SSH_OK) {
+        ssh_set_error(SSH_FATAL, "unexpected sftp opendir response");
+        goto error;
+    }
+    sftp_request_free(req);
+    req = NULL;
+
+    /* the first batch is on its way before the caller asks for it */
+    dir->next = sftp_readdir_send(dir);
+    if (dir->next == NULL) {
+        sftp_closedir(dir);
+        return NULL;
+    }
+
+    return dir;
+
+error:
+    sftp_request_free(req);
+    if (dir != NULL) {
+        SSH_STRING_FREE(dir->handle);
+        SAFE_FREE(dir);
+    }
+    return NULL;
+}
+
+sftp_attributes sftp_readdir(sftp_dir dir) {
+    sftp_attributes entry;
+    char *name;
+    char *longname;
+
+    if (dir == NULL) return NULL;
+    entry = &dir->entry;
+
+    while (dir->left == 0) {
+        if (dir->eof) return NULL;
+        if (sftp_dir_next_batch(dir) != SSH_OK) return NULL;
+    }
+
+    /* reset the entry, keeping the name buffers */
+    name = entry->name;
+    longname = entry->longname;
+    SSH_STRING_FREE(entry->extended_type);
+    SSH_STRING_FREE(entry->extended_data);
+    memset(entry, 0, sizeof(*entry));
+    entry->name = name;
+    entry->longname = longname;
+
+    if (sftp_dir_take_string(dir->batch->payload, &entry->name,
+                             &dir->name_alloc) != SSH_OK ||
+        sftp_dir_take_string(dir->batch->payload, &entry->longname,
+                             &dir->longname_alloc) != SSH_OK ||
+        sftp_parse_attr_into(dir->batch->payload, entry) != SSH_OK) {
+        ssh_set_error(SSH_FATAL, "malformed sftp name entry");
+        dir->left = 0;
+        return NULL;
+    }
+    dir->left--;
+
+    return entry;
+}
+
+int sftp_dir_eof(sftp_dir dir) {
+    if (dir == NULL) return 1;
+    return dir->eof && dir->left == 0;
+}
+
+int sftp_closedir(sftp_dir dir) {
+    sftp_request req;
+    ssh_buffer buffer;
+    uint32_t id;
+    uint32_t code = SSH_FX_FAILURE;
+    int rc = SSH_ERROR;
+
+    if (dir == NULL) return SSH_ERROR;
+
+    /* a READDIR still in flight is dropped when its reply arrives */
+    sftp_request_cancel(dir->next);
+    sftp_packet_free(dir->batch);
+
+    buffer = ssh_buffer_new();
+    if (buffer != NULL) {
+        id = sftp_get_new_id(dir->sftp);
+        if (ssh_buffer_pack(buffer, "dS", id, dir->handle) == SSH_OK) {
+            req = sftp_request_send(dir->sftp, SSH_FXP_CLOSE, id, buffer);
+            if (req != NULL && sftp_request_status(req, &code) == SSH_OK) {
+                rc = code == SSH_FX_OK ? SSH_OK : SSH_ERROR;
+                sftp_request_free(req);
+            } else {
+                sftp_request_cancel(req);
+            }
+        }
+        ssh_buffer_free(buffer);
+    }
+    if (rc != SSH_OK) {
+        ssh_set_error(SSH_FATAL, "closedir failed with error code %u", code);
+    }
+
+    SSH_STRING_FREE(dir->handle);
+    SAFE_FREE(dir->entry.name);
+    SAFE_FREE(dir->entry.longname);
+    SSH_STRING_FREE(dir->entry.extended_type);
+    SSH_STRING_FREE(dir->entry.extended_data);
+    SAFE_FREE(dir);
+
+    return rc;
+}
+
+sftp_request sftp_async_mkdir(sftp_session sftp, const char *path,
+                              mode_t mode) {
+    sftp_request req;
+    ssh_buffer buffer;
+    uint32_t id;
+
+    if (sftp == NULL || path == NULL) return NULL;
+
+    buffer = ssh_buffer_new();
+    if (buffer == NULL) {
+        ssh_set_error(SSH_FATAL, "buffer error");
+        return NULL;
+    }
+    id = sftp_get_new_id(sftp);
+    if (ssh_buffer_pack(buffer, "dsdd", id, path,
+                        SSH_FILEXFER_ATTR_PERMISSIONS,
+                        (uint32_t)(mode & 07777)) != SSH_OK) {
+        ssh_set_error(SSH_FATAL, "buffer error");
+        ssh_buffer_free(buffer);
+        return NULL;
+    }
+
+    /* drops a cached SSH_FX_NO_SUCH_FILE */
+    sftp_attr_cache_invalidate(sftp, path);
+
+    req = sftp_request_send(sftp, SSH_FXP_MKDIR, id, buffer);
+    ssh_buffer_free(buffer);
+
+    return req;
+}
+
+int sftp_async_mkdir_result(sftp_request req) {
+    uint32_t code;
+
+    if (req == NULL) return SSH_ERROR;
+
+    if (sftp_request_status(req, &code) != SSH_OK) {
+        ssh_set_error(SSH_FATAL, "unexpected sftp mkdir response type");
+        sftp_request_cancel(req);
+        return SSH_ERROR;
+    }
+    sftp_request_free(req);
+
+    if (code != SSH_FX_OK) {
+        ssh_set_error(SSH_REQUEST_DENIED, "mkdir failed with error code %u",
+                      code);
+        return SSH_ERROR;
+    }
+    return SSH_OK;
+}
+
+int sftp_mkdir(sftp_session sftp, const char *path, mode_t mode) {
+    return sftp_async_mkdir_result(sftp_async_mkdir(sftp, path, mode));
+}
+
+int sftp_unlink(sftp_session sftp, const char *path) {
+    struct sftp_batch_item item = {.op = SFTP_BATCH_REMOVE, .path = path};
+
+    return sftp_batch(sftp, &item, 1) == 0 ? SSH_OK : SSH_ERROR;
+}
+
+int sftp_rmdir(sftp_session sftp, const char *path) {
+    struct sftp_batch_item item = {.op = SFTP_BATCH_RMDIR, .path = path};
+
+    return sftp_batch(sftp, &item, 1) == 0 ? SSH_OK : SSH_ERROR;
+}
+
+int sftp_rename(sftp_session sftp, const char *original, const char *newname) {
+    struct sftp_batch_item item = {
+        .op = SFTP_BATCH_RENAME, .path = original, .target = newname};
+
+    return sftp_batch(sftp, &item, 1) == 0 ? SSH_OK : SSH_ERROR;
+}
+
+int sftp_setstat(sftp_session sftp, const char *path, sftp_attributes attr) {
+    struct sftp_batch_item item = {
+        .op = SFTP_BATCH_SETSTAT, .path = path, .attr = attr};
+
+    return sftp_batch(sftp, &item, 1) == 0 ? SSH_OK : SSH_ERROR;
+}
+
+int sftp_batch(sftp_session sftp, struct sftp_batch_item *items,
+               uint32_t count) {
+    sftp_request reqs[SFTP_BATCH_DEPTH];
+    sftp_request req;
+    struct sftp_batch_item *item;
+    uint32_t head = 0;
+    uint32_t inflight = 0;
+    uint32_t next = 0;
+    uint32_t done = 0;
+    uint32_t i;
+    int failed = 0;
+
+    if (sftp == NULL || (items == NULL && count > 0)) return SSH_ERROR;
+
+    /* check every item before any is sent */
+    for (i = 0; i < count; i++) {
+        item = &items[i];
+        if (sftp_batch_name(item->op) == NULL || item->path == NULL ||
+            (item->op == SFTP_BATCH_RENAME && item->target == NULL) ||
+            (item->op == SFTP_BATCH_SETSTAT && item->attr == NULL)) {
+            ssh_set_error(SSH_FATAL, "invalid batch item %u", i);
+            return SSH_ERROR;
+        }
+        item->status = SSH_FX_CONNECTION_LOST;
+    }
+
+    /* replies are taken in order, so the oldest request is item `done` */
+    while (done < count) {
+        while (inflight < SFTP_BATCH_DEPTH && next < count) {
+            req = sftp_batch_send(sftp, &items[next]);
+            if (req == NULL) goto error;
+            reqs[(head + inflight) % SFTP_BATCH_DEPTH] = req;
+            inflight++;
+            next++;
+        }
+
+        item = &items[done];
+        req = reqs[head];
+        head = (head + 1) % SFTP_BATCH_DEPTH;
+        inflight--;
+        if (sftp_request_status(req, &item->status) != SSH_OK) {
+            ssh_set_error(SSH_FATAL, "unexpected sftp %s response type",
+                          sftp_batch_name(item->op));
+            sftp_request_cancel(req);
+            goto error;
+        }
+        sftp_request_free(req);
+
+        if (item->status != SSH_FX_OK && failed++ == 0) {
+            ssh_set_error(SSH_REQUEST_DENIED,
+                          "%s of %s failed with error code %u",
+                          sftp_batch_name(item->op), item->path,
+                          item->status);
+        }
+        done++;
+    }
+    return failed;
+
+error:
+    while (inflight > 0) {
+        sftp_request_cancel(reqs[head]);
+        head = (head + 1) % SFTP_BATCH_DEPTH;
+        inflight--;
+    }
+    return SSH_ERROR;
+}
+
+int sftp_get_tree(sftp_session sftp, const char *remote_dir,
+                  const char *local_dir) {
+    struct sftp_tree *tree;
+    struct sftp_tree_dir root = {0};
+    int rc;
+
+    if (sftp == NULL || remote_dir == NULL || local_dir == NULL) {
+        return SSH_ERROR;
+    }
+
+    if (mkdir(local_dir, S_IRWXU | S_IRWXG | S_IRWXO) != 0 &&
+        errno != EEXIST) {
+        ssh_set_error(SSH_REQUEST_DENIED, "can not create %s: %s", local_dir,
+                      strerror(errno));
+        return SSH_ERROR;
+    }
+
+    tree = sftp_tree_new(sftp, false);
+    if (tree == NULL) return SSH_ERROR;
+
+    root.remote = strdup(remote_dir);
+    root.local = strdup(local_dir);
+    if (root.remote == NULL || root.local == NULL ||
+        sftp_tree_push_dir(tree, &root) != SSH_OK) {
+        ssh_set_error(SSH_FATAL, "out of memory");
+        SAFE_FREE(root.remote);
+        SAFE_FREE(root.local);
+        sftp_tree_free(tree);
+        return SSH_ERROR;
+    }
+
+    rc = sftp_tree_run(tree);
+    sftp_tree_free(tree);
+    return rc;
+}
+
+int sftp_put_tree(sftp_session sftp, const char *local_dir,
+                  const char *remote_dir) {
+    struct sftp_tree *tree;
+    struct sftp_tree_dir root = {0};
+    struct stat st;
+    int rc;
+
+    if (sftp == NULL || remote_dir == NULL || local_dir == NULL) {
+        return SSH_ERROR;
+    }
+
+    if (stat(local_dir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        ssh_set_error(SSH_REQUEST_DENIED, "%s is not a directory", local_dir);
+        return SSH_ERROR;
+    }
+
+    tree = sftp_tree_new(sftp, true);
+    if (tree == NULL) return SSH_ERROR;
+
+    root.remote = strdup(remote_dir);
+    root.local = strdup(local_dir);
+    if (root.remote != NULL) {
+        root.mkdir = sftp_async_mkdir(sftp, remote_dir, st.st_mode | S_IRWXU);
+    }
+    if (root.remote == NULL || root.local == NULL || root.mkdir == NULL ||
+        sftp_tree_push_dir(tree, &root) != SSH_OK) {
+        ssh_set_error(SSH_FATAL, "can not start upload of %s", local_dir);
+        sftp_request_cancel(root.mkdir);
+        SAFE_FREE(root.remote);
+        SAFE_FREE(root.local);
+        sftp_tree_free(tree);
+        return SSH_ERROR;
+    }
+
+    rc = sftp_tree_run(tree);
+    sftp_tree_free(tree);
+    return rc;
+}
+
+int sftp_set_attr_cache(sftp_session sftp, uint32_t entries,
+                        uint32_t ttl_ms) {
+    if (sftp == NULL) return SSH_ERROR;
+
+    if (entries > SFTP_ATTR_CACHE_MAX_ENTRIES) {
+        ssh_set_error(SSH_REQUEST_DENIED,
+                      "attribute cache size %u out of range [0, %d]", entries,
+                      SFTP_ATTR_CACHE_MAX_ENTRIES);
+        return SSH_ERROR;
+    }
+
+    /* start over with the new bounds */
+    sftp_attr_cache_invalidate(sftp, NULL);
+    SAFE_FREE(sftp->attr_cache);
+    sftp->attr_cache_size = entries;
+    sftp->attr_cache_ttl = ttl_ms;
+    return SSH_OK;
+}
+
+/**
+ * @brief Decode the ATTRS structure of SFTP version 3 at the read position of
+ * `buffer`.
+ *
+ * @param buffer
+ * @return sftp_attributes, NULL on malformed input.
+ */
+static sftp_attributes sftp_parse_attr(ssh_buffer buffer) {
+    sftp_attributes attr;
+
+    attr = calloc(1, sizeof(struct sftp_attributes_struct));
+    if (attr == NULL) return NULL;
+
+    if (sftp_parse_attr_into(buffer, attr) != SSH_OK) {
+        sftp_attributes_free(attr);
+        return NULL;
+    }
+
+    return attr;
+}
+
+/**
+ * @brief Decode an ATTRS structure into the fields of `attr`, which must be
+ * zeroed apart from `name` and `longname`.
+ *
+ * @param buffer
+ * @param attr
+ * @return int
+ */
+static int sftp_parse_attr_into(ssh_buffer buffer, sftp_attributes attr) {
+    uint32_t count;
+    ssh_string ext_type = NULL;
+    ssh_string ext_data = NULL;
+    int rc;
+
+    rc = ssh_buffer_unpack(buffer, "d", &attr->flags);
+    if (rc != SSH_OK) goto error;
+
+    if (attr->flags & SSH_FILEXFER_ATTR_SIZE) {
+        rc = ssh_buffer_unpack(buffer, "q", &attr->size);
+        if (rc != SSH_OK) goto error;
+    }
+    if (attr->flags & SSH_FILEXFER_ATTR_UIDGID) {
+        rc = ssh_buffer_unpack(buffer, "dd", &attr->uid, &attr->gid);
+        if (rc != SSH_OK) goto error;
+    }
+    attr->type = SSH_FILEXFER_TYPE_UNKNOWN;
+    if (attr->flags & SSH_FILEXFER_ATTR_PERMISSIONS) {
+        rc = ssh_buffer_unpack(buffer, "d", &attr->permissions);
+        if (rc != SSH_OK) goto error;
+
+        switch (attr->permissions & S_IFMT) {
+            case S_IFREG:
+                attr->type = SSH_FILEXFER_TYPE_REGULAR;
+                break;
+            case S_IFDIR:
+                attr->type = SSH_FILEXFER_TYPE_DIRECTORY;
+                break;
+            case S_IFLNK:
+                attr->type = SSH_FILEXFER_TYPE_SYMLINK;
+                break;
+            case 0:
+                break;
+            default:
+                attr->type = SSH_FILEXFER_TYPE_SPECIAL;
+                break;
+        }
+    }
+    if (attr->flags & SSH_FILEXFER_ATTR_ACMODTIME) {
+        rc = ssh_buffer_unpack(buffer, "dd", &attr->atime, &attr->mtime);
+        if (rc != SSH_OK) goto error;
+        attr->atime64 = attr->atime;
+        attr->mtime64 = attr->mtime;
+    }
+    if (attr->flags & SSH_FILEXFER_ATTR_EXTENDED) {
+        rc = ssh_buffer_unpack(buffer, "d", &attr->extended_count);
+        if (rc != SSH_OK) goto error;
+
+        /* keep the first extension, skip the others */
+        for (count = 0; count < attr->extended_count; count++) {
+            rc = ssh_buffer_unpack(buffer, "SS", &ext_type, &ext_data);
+            if (rc != SSH_OK) goto error;
+            if (count == 0) {
+                attr->extended_type = ext_type;
+                attr->extended_data = ext_data;
+            } else {
+                SSH_STRING_FREE(ext_type);
+                SSH_STRING_FREE(ext_data);
+            }
+        }
+    }
+
+    return SSH_OK;
+
+error:
+    LOG_ERROR("malformed sftp attributes");
+    return SSH_ERROR;
+}
+
+/**
+ * @brief Deep copy of an attributes structure.
+ *
+ * @param attr
+ * @return sftp_attributes, NULL on error.
+ */
+static sftp_attributes sftp_attributes_copy(sftp_attributes attr) {
+    sftp_attributes copy;
+
+    copy = malloc(sizeof(struct sftp_attributes_struct));
+    if (copy == NULL) return NULL;
+    *copy = *attr;
+
+    copy->name = attr->name ? strdup(attr->name) : NULL;
+    copy->longname = attr->longname ? strdup(attr->longname) : NULL;
+    copy->owner = attr->owner ? strdup(attr->owner) : NULL;
+    copy->group = attr->group ? strdup(attr->group) : NULL;
+    copy->acl = attr->acl ? ssh_string_copy(attr->acl) : NULL;
+    copy->extended_type =
+        attr->extended_type ? ssh_string_copy(attr->extended_type) : NULL;
+    copy->extended_data =
+        attr->extended_data ? ssh_string_copy(attr->extended_data) : NULL;
+
+    if ((attr->name && !copy->name) || (attr->longname && !copy->longname) ||
+        (attr->owner && !copy->owner) || (attr->group && !copy->group) ||
+        (attr->acl && !copy->acl) ||
+        (attr->extended_type && !copy->extended_type) ||
+        (attr->extended_data && !copy->extended_data)) {
+        sftp_attributes_free(copy);
+        return NULL;
+    }
+
+    return copy;
+}
+
+/**
+ * @brief SSH_FXP_STAT or SSH_FXP_LSTAT through the attribute cache.
+ *
+ * @param sftp
+ * @param path
+ * @param type
+ * @return sftp_attributes
+ */
+static sftp_attributes sftp_xstat(sftp_session sftp, const char *path,
+                                  uint8_t type) {
+    struct sftp_attr_cache_entry *entry;
+    sftp_attributes attr;
+    sftp_request req;
+    ssh_buffer buffer;
+    uint32_t id;
+    uint32_t code = SSH_FX_OK;
+    int rc;
+
+    if (sftp == NULL || path == NULL) return NULL;
+
+    entry = sftp_attr_cache_find(sftp, path, type);
+    if (entry != NULL) {
+        if (entry->attr == NULL) {
+            ssh_set_error(SSH_REQUEST_DENIED,
+                          "stat %s failed with error code %u", path,
+                          entry->code);
+            return NULL;
+        }
+        attr = sftp_attributes_copy(entry->attr);
+        if (attr == NULL) ssh_set_error(SSH_FATAL, "out of memory");
+        return attr;
+    }
+
+    buffer = ssh_buffer_new();
+    if (buffer == NULL) {
+        ssh_set_error(SSH_FATAL, "buffer error");
+        return NULL;
+    }
+    id = sftp_get_new_id(sftp);
+    rc = ssh_buffer_pack(buffer, "ds", id, path);
+    if (rc != SSH_OK) {
+        ssh_set_error(SSH_FATAL, "buffer error");
+        ssh_buffer_free(buffer);
+        return NULL;
+    }
+    req = sftp_request_send(sftp, type, id, buffer);
+    ssh_buffer_free(buffer);
+
+    attr = sftp_attr_result(req, path, &code);
+    if (attr != NULL) {
+        sftp_attr_cache_store(sftp, path, type, attr, SSH_FX_OK);
+    } else if (code == SSH_FX_NO_SUCH_FILE) {
+        sftp_attr_cache_store(sftp, path, type, NULL, code);
+    }
+
+    return attr;
+}
+
+/**
+ * @brief Wait for the reply of a STAT family request and decode it. The
+ * request is freed.
+ *
+ * @param req
+ * @param path used in error messages
+ * @param code set to the status code if the server answered with a status
+ * @return sftp_attributes
+ */
+static sftp_attributes sftp_attr_result(sftp_request req, const char *path,
+                                        uint32_t *code) {
+    sftp_attributes attr = NULL;
+    uint32_t id;
+
+    if (req == NULL) return NULL;
+
+    if (sftp_request_wait(req) != SSH_OK) {
+        sftp_request_cancel(req);
+        return NULL;
+    }
+
+    switch (req->reply->type) {
+        case SSH_FXP_ATTRS:
+            if (ssh_buffer_unpack(req->reply->payload, "d", &id) == SSH_OK) {
+                attr = sftp_parse_attr(req->reply->payload);
+            }
+            if (attr == NULL) {
+                ssh_set_error(SSH_FATAL, "malformed sftp attributes");
+            }
+            break;
+        case SSH_FXP_STATUS:
+            if (sftp_request_status(req, code) != SSH_OK) {
+                ssh_set_error(SSH_FATAL, "malformed sftp status");
+            } else {
+                ssh_set_error(SSH_REQUEST_DENIED,
+                              "stat %s failed with error code %u",
+                              path ? path : "", *code);
+            }
+            break;
+        default:
+            ssh_set_error(SSH_FATAL, "unexpected sftp stat response type");
+            break;
+    }
+
+    sftp_request_free(req);
+    return attr;
+}
+
+/**
+ * @brief Send SSH_FXP_READDIR for the next batch of a directory.
+ *
+ * @param dir
+ * @return sftp_request, NULL on error.
+ */
+static sftp_request sftp_readdir_send(sftp_dir dir) {
+    sftp_request req;
+    ssh_buffer buffer;
+    uint32_t id;
+
+    buffer = ssh_buffer_new();
+    if (buffer == NULL) {
+        ssh_set_error(SSH_FATAL, "buffer error");
+        return NULL;
+    }
+    id = sftp_get_new_id(dir->sftp);
+    if (ssh_buffer_pack(buffer, "dS", id, dir->handle) != SSH_OK) {
+        ssh_set_error(SSH_FATAL, "buffer error");
+        ssh_buffer_free(buffer);
+        return NULL;
+    }
+    req = sftp_request_send(dir->sftp, SSH_FXP_READDIR, id, buffer);
+    ssh_buffer_free(buffer);
+
+    return req;
+}
+
+/**
+ * @brief Replace the consumed batch with the reply of the READDIR in flight
+ * and send the next READDIR right away.
+ *
+ * @param dir
+ * @return SSH_OK if a batch or the end of the directory was received.
+ */
+static int sftp_dir_next_batch(sftp_dir dir) {
+    sftp_request req = dir->next;
+    uint32_t id;
+    uint32_t code;
+
+    sftp_packet_free(dir->batch);
+    dir->batch = NULL;
+    dir->next = NULL;
+    if (req == NULL) return SSH_ERROR;
+
+    if (sftp_request_wait(req) != SSH_OK) {
+        sftp_request_cancel(req);
+        return SSH_ERROR;
+    }
+
+    switch (req->reply->type) {
+        case SSH_FXP_NAME:
+            dir->batch = req->reply;
+            req->reply = NULL;
+            sftp_request_free(req);
+            if (ssh_buffer_unpack(dir->batch->payload, "dd", &id,
+                                  &dir->left) != SSH_OK) {
+                ssh_set_error(SSH_FATAL, "malformed sftp name reply");
+                dir->left = 0;
+                return SSH_ERROR;
+            }
+            dir->next = sftp_readdir_send(dir);
+            return dir->next != NULL ? SSH_OK : SSH_ERROR;
+        case SSH_FXP_STATUS:
+            if (sftp_request_status(req, &code) != SSH_OK) {
+                code = SSH_FX_BAD_MESSAGE;
+            }
+            sftp_request_free(req);
+            if (code == SSH_FX_EOF) {
+                dir->eof = true;
+                return SSH_OK;
+            }
+            ssh_set_error(SSH_REQUEST_DENIED,
+                          "readdir failed with error code %u", code);
+            return SSH_ERROR;
+        default:
+            ssh_set_error(SSH_FATAL, "unexpected sftp readdir response type");
+            sftp_request_free(req);
+            return SSH_ERROR;
+    }
+}
+
+/**
+ * @brief Read an SSH string from `buffer` into a NUL terminated buffer that
+ * is only grown when the string does not fit.
+ *
+ * @param buffer
+ * @param str
+ * @param alloc size of `*str`
+ * @return int
+ */
+static int sftp_dir_take_string(ssh_buffer buffer, char **str,
+                                uint32_t *alloc) {
+    uint32_t len;
+    char *grown;
+
+    if (ssh_buffer_get_u32(buffer, &len) != sizeof(uint32_t)) {
+        return SSH_ERROR;
+    }
+    len = ntohl(len);
+    if (len > ssh_buffer_get_len(buffer)) return SSH_ERROR;
+
+    if (len + 1 > *alloc) {
+        grown = realloc(*str, len + 1);
+        if (grown == NULL) return SSH_ERROR;
+        *str = grown;
+        *alloc = len + 1;
+    }
+
+    ssh_buffer_get_data(buffer, *str, len);
+    (*str)[len] = '\0';
+    return SSH_OK;
+}
+
+static uint64_t sftp_now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void sftp_attr_cache_drop(sftp_session sftp, uint32_t i) {
+    SAFE_FREE(sftp->attr_cache[i].path);
+    sftp_attributes_free(sftp->attr_cache[i].attr);
+    sftp->attr_cache[i] = sftp->attr_cache[--sftp->attr_cache_count];
+}
+
+/**
+ * @brief Look up a live cache entry, dropping it if it has expired.
+ *
+ * @param sftp
+ * @param path
+ * @param type
+ * @return the entry, NULL on a miss.
+ */
+static struct sftp_attr_cache_entry *sftp_attr_cache_find(sftp_session sftp,
+                                                          const char *path,
+                                                          uint8_t type) {
+    uint32_t i;
+
+    for (i = 0; i < sftp->attr_cache_count; i++) {
+        if (sftp->attr_cache[i].type != type ||
+            strcmp(sftp->attr_cache[i].path, path) != 0) {
+            continue;
+        }
+        if (sftp->attr_cache[i].expires <= sftp_now_ms()) {
+            sftp_attr_cache_drop(sftp, i);
+            return NULL;
+        }
+        return &sftp->attr_cache[i];
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Cache a copy of `attr`, or the status `code` if `attr` is NULL.
+ * When the cache is full, the entry closest to expiry is evicted. Failures
+ * only mean the result is not cached.
+ *
+ * @param sftp
+ * @param path
+ * @param type
+ * @param attr
+ * @param code
+ */
+static void sftp_attr_cache_store(sftp_session sftp, const char *path,
+                                  uint8_t type, sftp_attributes attr,
+                                  uint32_t code) {
+    struct sftp_attr_cache_entry entry;
+    uint32_t victim = 0;
+    uint32_t i;
+
+    if (sftp->attr_cache_size == 0 || sftp->attr_cache_ttl == 0) return;
+
+    if (sftp->attr_cache == NULL) {
+        sftp->attr_cache = calloc(sftp->attr_cache_size,
+                                  sizeof(struct sftp_attr_cache_entry));
+        if (sftp->attr_cache == NULL) return;
+    }
+
+    entry.path = strdup(path);
+    entry.type = type;
+    entry.expires = sftp_now_ms() + sftp->attr_cache_ttl;
+    entry.attr = attr ? sftp_attributes_copy(attr) : NULL;
+    entry.code = code;
+    if (entry.path == NULL || (attr != NULL && entry.attr == NULL)) {
+        SAFE_FREE(entry.path);
+        sftp_attributes_free(entry.attr);
+        return;
+    }
+
+    if (sftp->attr_cache_count == sftp->attr_cache_size) {
+        for (i = 1; i < sftp->attr_cache_count; i++) {
+            if (sftp->attr_cache[i].expires <
+                sftp->attr_cache[victim].expires) {
+                victim = i;
+            }
+        }
+        sftp_attr_cache_drop(sftp, victim);
+    }
+
+    sftp->attr_cache[sftp->attr_cache_count++] = entry;
+}
+
+/**
+ * @brief Drop the cache entries of `path` and of the paths under it, or
+ * every entry if `path` is NULL.
+ *
+ * @param sftp
+ * @param path
+ */
+static void sftp_attr_cache_invalidate(sftp_session sftp, const char *path) {
+    size_t len = path != NULL ? strlen(path) : 0;
+    const char *cached;
+    uint32_t i = 0;
+
+    while (i < sftp->attr_cache_count) {
+        cached = sftp->attr_cache[i].path;
+        /* what is under a renamed or removed directory goes with it */
+        if (path == NULL ||
+            (strncmp(cached, path, len) == 0 &&
+             (cached[len] == '\0' || cached[len] == '/' ||
+              (len > 0 && path[len - 1] == '/')))) {
+            sftp_attr_cache_drop(sftp, i);
+        } else {
+            i++;
+        }
+    }
+}
+
+/**
+ * @brief Join a directory and an entry name with a slash.
+ *
+ * @param dir
+ * @param name
+ * @return char*, NULL if out of memory.
+ */
+static char *sftp_path_join(const char *dir, const char *name) {
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    bool slash = dir_len > 0 && dir[dir_len - 1] != '/';
+    char *path;
+
+    path = malloc(dir_len + slash + name_len + 1);
+    if (path == NULL) return NULL;
+    memcpy(path, dir, dir_len);
+    if (slash) path[dir_len] = '/';
+    memcpy(path + dir_len + slash, name, name_len + 1);
+    return path;
+}
+
+/**
+ * @brief Allocate the state of a tree transfer.
+ *
+ * @param sftp
+ * @param upload
+ * @return struct sftp_tree*, NULL on error.
+ */
+static struct sftp_tree *sftp_tree_new(sftp_session sftp, bool upload) {
+    struct sftp_tree *tree;
+    uint64_t handles = sftp->limits.max_open_handles;
+    uint32_t i;
+
+    tree = calloc(1, sizeof(struct sftp_tree));
+    if (tree == NULL) goto error;
+    tree->sftp = sftp;
+    tree->upload = upload;
+
+    /* keep a handle for the directory being walked */
+    tree->slot_count = SFTP_TREE_FILES + SFTP_TREE_SWARM;
+    if (handles > 0) tree->slot_count = MAX(MIN(tree->slot_count, handles - 1), 1);
+
+    if (upload) {
+        tree->chunk = malloc(sftp->max_write);
+        if (tree->chunk == NULL) goto error;
+    }
+    for (i = 0; i < tree->slot_count; i++) tree->slots[i].fd = -1;
+    return tree;
+
+error:
+    ssh_set_error(SSH_FATAL, "out of memory");
+    sftp_tree_free(tree);
+    return NULL;
+}
+
+/**
+ * @brief Abandon whatever a tree transfer still has in flight and free it.
+ *
+ * @param tree
+ */
+static void sftp_tree_free(struct sftp_tree *tree) {
+    struct sftp_tree_slot *slot;
+    uint32_t i, j;
+
+    if (tree == NULL) return;
+
+    for (i = 0; i < tree->slot_count; i++) {
+        slot = &tree->slots[i];
+        for (j = 0; j < slot->count; j++) {
+            sftp_request_cancel(slot->reqs[(slot->head + j) % SFTP_TREE_DEPTH]);
+        }
+        /* the handle of an OPEN still in flight is closed when the reply
+         * arrives, see `sftp_close_orphan` */
+        sftp_request_cancel(slot->req);
+        if (slot->state == SFTP_TREE_DATA) {
+            /* do not leave the handle open on the server */
+            sftp_request_cancel(sftp_async_close(slot->file));
+        }
+        if (slot->state == SFTP_TREE_DATA || slot->state == SFTP_TREE_CLOSING) {
+            sftp_file_free(slot->file);
+        }
+        if (slot->fd >= 0) close(slot->fd);
+        SAFE_FREE(slot->item.remote);
+        SAFE_FREE(slot->item.local);
+        SAFE_FREE(slot->bufs);
+    }
+
+    for (i = 0; i < tree->queue_count; i++) {
+        j = (tree->queue_head + i) % SFTP_TREE_QUEUE;
+        SAFE_FREE(tree->queue[j].remote);
+        SAFE_FREE(tree->queue[j].local);
+    }
+
+    for (i = tree->dir_head; i < tree->dir_count; i++) {
+        sftp_request_cancel(tree->dirs[i].mkdir);
+        SAFE_FREE(tree->dirs[i].remote);
+        SAFE_FREE(tree->dirs[i].local);
+    }
+    SAFE_FREE(tree->dirs);
+
+    if (tree->local_dir != NULL) closedir(tree->local_dir);
+    if (tree->remote_dir != NULL) sftp_closedir(tree->remote_dir);
+    SAFE_FREE(tree->cur.remote);
+    SAFE_FREE(tree->cur.local);
+
+    SAFE_FREE(tree->chunk);
+    SAFE_FREE(tree);
+}
+
+/**
+ * @brief Append a directory to walk. The tree takes over its paths and
+ * request only on success.
+ *
+ * @param tree
+ * @param dir
+ * @return int
+ */
+static int sftp_tree_push_dir(struct sftp_tree *tree,
+                              const struct sftp_tree_dir *dir) {
+    struct sftp_tree_dir *dirs;
+    uint32_t alloc;
+
+    if (tree->dir_head == tree->dir_count) {
+        tree->dir_head = tree->dir_count = 0;
+    }
+    if (tree->dir_count == tree->dir_alloc) {
+        if (tree->dir_head > 0) {
+            /* reuse the walked part first */
+            tree->dir_count -= tree->dir_head;
+            memmove(tree->dirs, tree->dirs + tree->dir_head,
+                    tree->dir_count * sizeof(struct sftp_tree_dir));
+            tree->dir_head = 0;
+        } else {
+            alloc = MAX(16, 2 * tree->dir_alloc);
+            dirs = realloc(tree->dirs, alloc * sizeof(struct sftp_tree_dir));
+            if (dirs == NULL) return SSH_ERROR;
+            tree->dirs = dirs;
+            tree->dir_alloc = alloc;
+        }
+    }
+
+    tree->dirs[tree->dir_count++] = *dir;
+    return SSH_OK;
+}
+
+/**
+ * @brief Make the next queued directory the one being walked: on upload,
+ * check that it was created on the server, on download, open it there.
+ *
+ * @param tree
+ * @return int
+ */
+static int sftp_tree_enter_dir(struct sftp_tree *tree) {
+    struct sftp_tree_dir *dir = &tree->cur;
+    sftp_attributes attr;
+    DIR *local_dir;
+
+    *dir = tree->dirs[tree->dir_head++];
+
+    if (!tree->upload) {
+        tree->remote_dir = sftp_opendir(tree->sftp, dir->remote);
+        return tree->remote_dir != NULL ? SSH_OK : SSH_ERROR;
+    }
+
+    if (sftp_async_mkdir_result(dir->mkdir) != SSH_OK) {
+        /* fine if it is there already */
+        attr = sftp_stat(tree->sftp, dir->remote);
+        if (attr == NULL || attr->type != SSH_FILEXFER_TYPE_DIRECTORY) {
+            ssh_set_error(SSH_REQUEST_DENIED, "can not create directory %s",
+                          dir->remote);
+            sftp_attributes_free(attr);
+            dir->mkdir = NULL;
+            return SSH_ERROR;
+        }
+        sftp_attributes_free(attr);
+    }
+    dir->mkdir = NULL;
+
+    local_dir = opendir(dir->local);
+    if (local_dir == NULL) {
+        ssh_set_error(SSH_REQUEST_DENIED, "can not open directory %s: %s",
+                      dir->local, strerror(errno));
+        return SSH_ERROR;
+    }
+    tree->local_dir = local_dir;
+    return SSH_OK;
+}
+
+/**
+ * @brief Take the next entry of the directory being walked. At the end of
+ * the directory, it is closed and `*name` is set to NULL.
+ *
+ * @param tree
+ * @param name
+ * @param type  SSH_FILEXFER_TYPE_*
+ * @param mode  permission bits
+ * @param size  UINT64_MAX if unknown
+ * @return int
+ */
+static int sftp_tree_next_entry(struct sftp_tree *tree, const char **name,
+                                uint8_t *type, mode_t *mode, uint64_t *size) {
+    struct dirent *ent;
+    sftp_attributes attr;
+    struct stat st;
+    char *path;
+
+    *name = NULL;
+
+    if (!tree->upload) {
+        attr = sftp_readdir(tree->remote_dir);
+        if (attr == NULL) {
+            if (!sftp_dir_eof(tree->remote_dir)) return SSH_ERROR;
+            sftp_closedir(tree->remote_dir);
+            tree->remote_dir = NULL;
+            return SSH_OK;
+        }
+        *name = attr->name;
+        *type = attr->type;
+        *mode = (attr->flags & SSH_FILEXFER_ATTR_PERMISSIONS)
+                    ? attr->permissions & 07777
+                    : S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+        *size = (attr->flags & SSH_FILEXFER_ATTR_SIZE) ? attr->size
+                                                       : UINT64_MAX;
+        return SSH_OK;
+    }
+
+    errno = 0;
+    ent = readdir(tree->local_dir);
+    if (ent == NULL) {
+        if (errno != 0) {
+            ssh_set_error(SSH_REQUEST_DENIED, "can not read directory %s: %s",
+                          tree->cur.local, strerror(errno));
+            return SSH_ERROR;
+        }
+        closedir(tree->local_dir);
+        tree->local_dir = NULL;
+        return SSH_OK;
+    }
+    *name = ent->d_name;
+
+    path = sftp_path_join(tree->cur.local, ent->d_name);
+    if (path == NULL) {
+        ssh_set_error(SSH_FATAL, "out of memory");
+        return SSH_ERROR;
+    }
+    if (lstat(path, &st) != 0) {
+        ssh_set_error(SSH_REQUEST_DENIED, "can not stat %s: %s", path,
+                      strerror(errno));
+        SAFE_FREE(path);
+        return SSH_ERROR;
+    }
+    SAFE_FREE(path);
+
+    if (S_ISREG(st.st_mode)) {
+        *type = SSH_FILEXFER_TYPE_REGULAR;
+    } else if (S_ISDIR(st.st_mode)) {
+        *type = SSH_FILEXFER_TYPE_DIRECTORY;
+    } else {
+        *type = SSH_FILEXFER_TYPE_SPECIAL;
+    }
+    *mode = st.st_mode & 07777;
+    *size = st.st_size;
+    return SSH_OK;
+}
+
+/**
+ * @brief Walk the tree until the file queue is full or the walk is done.
+ * Subdirectories are created as they are found: locally right away, on the
+ * server with an SSH_FXP_MKDIR that is only checked when the walk enters
+ * them.
+ *
+ * @param tree
+ * @return int
+ */
+static int sftp_tree_walk(struct sftp_tree *tree) {
+    struct sftp_tree_item *item;
+    struct sftp_tree_dir dir;
+    const char *name;
+    uint8_t type;
+    mode_t mode;
+    uint64_t size;
+    char *remote, *local;
+
+    while (!tree->walked && tree->queue_count < SFTP_TREE_QUEUE) {
+        if (tree->local_dir == NULL && tree->remote_dir == NULL) {
+            SAFE_FREE(tree->cur.remote);
+            SAFE_FREE(tree->cur.local);
+            if (tree->dir_head == tree->dir_count) {
+                tree->walked = true;
+                break;
+            }
+            if (sftp_tree_enter_dir(tree) != SSH_OK) return SSH_ERROR;
+            continue;
+        }
+
+        if (sftp_tree_next_entry(tree, &name, &type, &mode, &size) != SSH_OK) {
+            return SSH_ERROR;
+        }
+        if (name == NULL || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+        if (type != SSH_FILEXFER_TYPE_REGULAR &&
+            type != SSH_FILEXFER_TYPE_DIRECTORY) {
+            LOG_NOTICE("skipping %s/%s, not a regular file or directory",
+                       tree->upload ? tree->cur.local : tree->cur.remote,
+                       name);
+            continue;
+        }
+
+        remote = sftp_path_join(tree->cur.remote, name);
+        local = sftp_path_join(tree->cur.local, name);
+        if (remote == NULL || local == NULL) {
+            ssh_set_error(SSH_FATAL, "out of memory");
+            goto error;
+        }
+
+        if (type == SSH_FILEXFER_TYPE_REGULAR) {
+            item = &tree->queue[(tree->queue_head + tree->queue_count) %
+                                SFTP_TREE_QUEUE];
+            item->remote = remote;
+            item->local = local;
+            item->mode = mode;
+            item->size = size;
+            tree->queue_count++;
+            continue;
+        }
+
+        /* keep the directory writable for its own entries */
+        dir.remote = remote;
+        dir.local = local;
+        dir.mkdir = NULL;
+        if (tree->upload) {
+            dir.mkdir = sftp_async_mkdir(tree->sftp, remote, mode | S_IRWXU);
+            if (dir.mkdir == NULL) goto error;
+        } else if (mkdir(local, mode | S_IRWXU) != 0 && errno != EEXIST) {
+            ssh_set_error(SSH_REQUEST_DENIED, "can not create %s: %s", local,
+                          strerror(errno));
+            goto error;
+        }
+        if (sftp_tree_push_dir(tree, &dir) != SSH_OK) {
+            ssh_set_error(SSH_FATAL, "out of memory");
+            sftp_request_cancel(dir.mkdir);
+            goto error;
+        }
+    }
+    return SSH_OK;
+
+error:
+    SAFE_FREE(remote);
+    SAFE_FREE(local);
+    return SSH_ERROR;
+}
+
+/**
+ * @brief Give a download slot the read buffers its file needs: one for a
+ * small file, SFTP_TREE_DEPTH otherwise.
+ *
+ * @param tree
+ * @param slot
+ * @return int
+ */
+static int sftp_tree_bufs(struct sftp_tree *tree, struct sftp_tree_slot *slot) {
+    uint32_t bufs_count = slot->small ? 1 : SFTP_TREE_DEPTH;
+    uint8_t *bufs;
+
+    if (tree->upload || slot->bufs_count >= bufs_count) return SSH_OK;
+
+    bufs = realloc(slot->bufs, (size_t)bufs_count * tree->sftp->max_read);
+    if (bufs == NULL) {
+        ssh_set_error(SSH_FATAL, "out of memory");
+        return SSH_ERROR;
+    }
+    slot->bufs = bufs;
+    slot->bufs_count = bufs_count;
+    return SSH_OK;
+}
+
+/**
+ * @brief Start the next queued file in a free slot: open the local file and
+ * send the SSH_FXP_OPEN.
+ *
+ * @param tree
+ * @param slot
+ * @return int
+ */
+static int sftp_tree_start(struct sftp_tree *tree,
+                           struct sftp_tree_slot *slot) {
+    struct sftp_tree_item *item = &slot->item;
+
+    *item = tree->queue[tree->queue_head];
+    tree->queue_head = (tree->queue_head + 1) % SFTP_TREE_QUEUE;
+    tree->queue_count--;
+
+    slot->small = item->size <= (tree->upload ? tree->sftp->max_write
+                                              : tree->sftp->max_read);
+    if (!slot->small) tree->large++;
+    if (sftp_tree_bufs(tree, slot) != SSH_OK) return SSH_ERROR;
+
+    slot->head = slot->count = 0;
+    slot->next = 0;
+    slot->eof = false;
+    slot->reopen = false;
+    slot->file = NULL;
+
+    if (tree->upload) {
+        slot->fd = open(item->local, O_RDONLY);
+    } else {
+        slot->fd = open(item->local, O_WRONLY | O_CREAT | O_TRUNC,
+                        item->mode | S_IRUSR | S_IWUSR);
+    }
+    if (slot->fd < 0) {
+        ssh_set_error(SSH_REQUEST_DENIED, "can not open %s: %s", item->local,
+                      strerror(errno));
+        return SSH_ERROR;
+    }
+
+    if (tree->upload) {
+        slot->req = sftp_async_open(tree->sftp, item->remote,
+                                    O_WRONLY | O_CREAT | O_TRUNC, item->mode);
+    } else {
+        slot->req = sftp_async_open(tree->sftp, item->remote, O_RDONLY, 0);
+    }
+    if (slot->req == NULL) return SSH_ERROR;
+
+    slot->state = SFTP_TREE_OPENING;
+    return SSH_OK;
+}
+
+/**
+ * @brief Fill the request window of a slot in transfer: read the local file
+ * into SSH_FXP_WRITE requests, or send SSH_FXP_READ requests up to the size
+ * the directory listing reported and one for the byte at that size. A file
+ * that grew since it was listed is copied to its end either way.
+ *
+ * @param tree
+ * @param slot
+ * @return int
+ */
+static int sftp_tree_send(struct sftp_tree *tree, struct sftp_tree_slot *slot) {
+    sftp_session sftp = tree->sftp;
+    ssh_channel channel = sftp->channel;
+    sftp_request req;
+    uint32_t i;
+    uint32_t len;
+    ssize_t n;
+    struct stat st;
+
+    /* a small file has its READ and the probe of its size in flight */
+    while (slot->count < (slot->small ? 2 : SFTP_TREE_DEPTH) && !slot->eof &&
+           slot->next <= slot->item.size) {
+        i = (slot->head + slot->count) % SFTP_TREE_DEPTH;
+
+        if (tree->upload) {
+            /* while replies are due, wait for them rather than for the
+             * window, see `wait_window` */
+            if (tree->inflight > 0 &&
+                channel->remote_window <
+                    sftp->max_write + SFTP_WRITE_HEADER_LEN) {
+                break;
+            }
+            do {
+                n = read(slot->fd, tree->chunk, sftp->max_write);
+            } while (n < 0 && errno == EINTR);
+            if (n < 0) {
+                ssh_set_error(SSH_FATAL, "can not read %s: %s",
+                              slot->item.local, strerror(errno));
+                return SSH_ERROR;
+            }
+            if (n == 0) {
+                slot->eof = true;
+                break;
+            }
+            req = sftp_async_write(slot->file, slot->next, tree->chunk, n);
+            if (req == NULL) return SSH_ERROR;
+            slot->next += n;
+
+            /* at the listed size, go on if the file grew since */
+            if (slot->next >= slot->item.size) {
+                if (fstat(slot->fd, &st) != 0) {
+                    ssh_set_error(SSH_FATAL, "can not stat %s: %s",
+                                  slot->item.local, strerror(errno));
+                    sftp_request_cancel(req);
+                    return SSH_ERROR;
+                }
+                if ((uint64_t)st.st_size > slot->next) {
+                    slot->item.size = st.st_size;
+                    if (slot->small) {
+                        slot->small = false;
+                        tree->large++;
+                    }
+                } else {
+                    slot->eof = true;
+                }
+            }
+        } else if (slot->next == slot->item.size) {
+            if (sftp_get_range(slot->file, &req, &slot->probe, slot->next,
+                               1) != SSH_OK) {
+                return SSH_ERROR;
+            }
+            slot->next++;
+        } else {
+            if (ssh_channel_grow_window(
+                    channel, (tree->inflight + 1) *
+                                 (sftp->max_read + SFTP_DATA_HEADER_LEN)) !=
+                SSH_OK) {
+                return SSH_ERROR;
+            }
+            len = MIN(sftp->max_read, slot->item.size - slot->next);
+            if (sftp_get_range(slot->file, &req,
+                               slot->bufs + i * sftp->max_read, slot->next,
+                               len) != SSH_OK) {
+                return SSH_ERROR;
+            }
+            slot->next += len;
+        }
+
+        slot->reqs[i] = req;
+        slot->count++;
+        tree->inflight++;
+    }
+    return SSH_OK;
+}
+
+/**
+ * @brief Take the answered READ or WRITE requests of a slot, oldest first.
+ * Downloaded data is written to the local file and the rest of a short read
+ * is requested again. A file whose probe found data past its listed size is
+ * read on until EOF.
+ *
+ * @param tree
+ * @param slot
+ * @return int
+ */
+static int sftp_tree_reap(struct sftp_tree *tree, struct sftp_tree_slot *slot) {
+    sftp_session sftp = tree->sftp;
+    sftp_request req;
+    uint8_t *buf;
+    uint64_t offset;
+    uint32_t i;
+    uint32_t len;
+    uint32_t done;
+    int32_t nread;
+    ssize_t n;
+    bool probe;
+
+    while (slot->count > 0 && slot->reqs[slot->head]->reply != NULL) {
+        req = slot->reqs[slot->head];
+        slot->reqs[slot->head] = NULL;
+        slot->head = (slot->head + 1) % SFTP_TREE_DEPTH;
+        slot->count--;
+        tree->inflight--;
+
+        if (tree->upload) {
+            if (sftp_async_write_result(req) != SSH_OK) return SSH_ERROR;
+            continue;
+        }
+
+        offset = req->offset;
+        len = req->len;
+        buf = req->dest;
+        probe = buf == &slot->probe;
+        nread = sftp_async_read_result(req, buf, len);
+        if (nread < 0) return SSH_ERROR;
+        if (nread == 0) {
+            /* the probe finds the listed size, any other read a file that
+             * shrunk since it was listed */
+            if (!probe) slot->eof = true;
+            continue;
+        }
+
+        for (done = 0; done < (uint32_t)nread; done += n) {
+            n = pwrite(slot->fd, buf + done, nread - done, offset + done);
+            if (n < 0 && errno == EINTR) n = 0;
+            if (n < 0) {
+                ssh_set_error(SSH_FATAL, "can not write %s: %s",
+                              slot->item.local, strerror(errno));
+                return SSH_ERROR;
+            }
+        }
+
+        if (probe) {
+            /* grown since it was listed: read on until EOF, opening a small
+             * file again as it is closed already */
+            slot->item.size = UINT64_MAX;
+            if (slot->state == SFTP_TREE_CLOSING && !slot->reopen) {
+                slot->next = offset + nread;
+                slot->reopen = true;
+            }
+            continue;
+        }
+
+        /* a small file is closed along with its read: ask for the rest
+         * once it can be opened again */
+        if ((uint32_t)nread < len && slot->state == SFTP_TREE_CLOSING) {
+            slot->next = offset + nread;
+            slot->reopen = true;
+        } else if ((uint32_t)nread < len) {
+            i = (slot->head + slot->count) % SFTP_TREE_DEPTH;
+            if (sftp_get_range(slot->file, &slot->reqs[i],
+                               slot->bufs + i * sftp->max_read, offset + nread,
+                               len - nread) != SSH_OK) {
+                return SSH_ERROR;
+            }
+            slot->count++;
+            tree->inflight++;
+        }
+    }
+    return SSH_OK;
+}
+
+/**
+ * @brief Advance a slot with answered requests: a file that was opened
+ * starts its transfer, a file that was closed frees the slot once its data
+ * requests are answered too.
+ *
+ * @param tree
+ * @param slot
+ * @return int
+ */
+static int sftp_tree_advance(struct sftp_tree *tree,
+                             struct sftp_tree_slot *slot) {
+    sftp_request req = slot->req;
+    int rc;
+    int fd;
+
+    switch (slot->state) {
+        case SFTP_TREE_OPENING:
+            if (req->reply == NULL) return SSH_OK;
+            slot->req = NULL;
+            slot->file = sftp_async_open_result(req);
+            if (slot->file == NULL) return SSH_ERROR;
+            slot->state = SFTP_TREE_DATA;
+            return SSH_OK;
+        case SFTP_TREE_DATA:
+            return sftp_tree_reap(tree, slot);
+        case SFTP_TREE_CLOSING:
+            if (sftp_tree_reap(tree, slot) != SSH_OK) return SSH_ERROR;
+            if (slot->count > 0 || req->reply == NULL) return SSH_OK;
+            slot->req = NULL;
+            rc = sftp_async_close_result(req);
+            slot->file = NULL;
+            slot->state = SFTP_TREE_IDLE;
+            if (rc == SSH_OK && slot->reopen && !slot->eof) {
+                /* keep the local file and go on like a large file */
+                slot->reopen = false;
+                slot->small = false;
+                tree->large++;
+                slot->head = 0;
+                if (sftp_tree_bufs(tree, slot) != SSH_OK) return SSH_ERROR;
+                slot->req = sftp_async_open(tree->sftp, slot->item.remote,
+                                            O_RDONLY, 0);
+                if (slot->req == NULL) return SSH_ERROR;
+                slot->state = SFTP_TREE_OPENING;
+                return SSH_OK;
+            }
+            if (!slot->small) tree->large--;
+
+            fd = slot->fd;
+            slot->fd = -1;
+            if (close(fd) != 0 && rc == SSH_OK) {
+                ssh_set_error(SSH_FATAL, "can not close %s: %s",
+                              slot->item.local, strerror(errno));
+                rc = SSH_ERROR;
+            }
+            SAFE_FREE(slot->item.remote);
+            SAFE_FREE(slot->item.local);
+            return rc;
+        default:
+            return SSH_OK;
+    }
+}
+
+/**
+ * @brief Whether a slot has a reply to take.
+ *
+ * @param slot
+ * @return bool
+ */
+static bool sftp_tree_answered(struct sftp_tree_slot *slot) {
+    switch (slot->state) {
+        case SFTP_TREE_OPENING:
+            return slot->req->reply != NULL;
+        case SFTP_TREE_CLOSING:
+            if (slot->count > 0) {
+                return slot->reqs[slot->head]->reply != NULL;
+            }
+            return slot->req->reply != NULL;
+        case SFTP_TREE_DATA:
+            return slot->count > 0 && slot->reqs[slot->head]->reply != NULL;
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief Run a tree transfer. Up to SFTP_TREE_FILES files, and up to
+ * SFTP_TREE_SWARM more small files, are in transfer at once, each in its own
+ * slot that goes through OPEN, a window of SFTP_TREE_DEPTH READ or WRITE
+ * requests, and CLOSE. A small file has its single READ or WRITE and its
+ * CLOSE sent together as soon as its handle arrives, so that it takes two
+ * round trips. Slots never wait for each other: while one file is opened,
+ * others move data or are closed, and the walk keeps creating directories
+ * ahead of them. The session only blocks when no slot has a reply to take.
+ *
+ * @param tree
+ * @return int
+ */
+static int sftp_tree_run(struct sftp_tree *tree) {
+    struct sftp_tree_slot *slot;
+    struct sftp_tree_item *next;
+    bool busy, answered;
+    uint32_t i;
+
+    while (1) {
+        if (sftp_tree_walk(tree) != SSH_OK) return SSH_ERROR;
+
+        busy = answered = false;
+        for (i = 0; i < tree->slot_count; i++) {
+            slot = &tree->slots[i];
+
+            /* files that are not small keep to SFTP_TREE_FILES slots */
+            next = &tree->queue[tree->queue_head];
+            if (slot->state == SFTP_TREE_IDLE && tree->queue_count > 0 &&
+                (tree->large < SFTP_TREE_FILES ||
+                 next->size <= (tree->upload ? tree->sftp->max_write
+                                             : tree->sftp->max_read)) &&
+                sftp_tree_start(tree, slot) != SSH_OK) {
+                return SSH_ERROR;
+            }
+
+            if (slot->state == SFTP_TREE_DATA) {
+                if (sftp_tree_send(tree, slot) != SSH_OK) return SSH_ERROR;
+                /* CLOSE follows the last request of a small file, and the
+                 * answered requests of another */
+                if ((slot->small || slot->count == 0) &&
+                    (slot->eof || slot->next >= slot->item.size)) {
+                    slot->req = sftp_async_close(slot->file);
+                    if (slot->req == NULL) return SSH_ERROR;
+                    slot->state = SFTP_TREE_CLOSING;
+                }
+            }
+
+            if (slot->state != SFTP_TREE_IDLE) busy = true;
+            if (sftp_tree_answered(slot)) answered = true;
+        }
+
+        if (!busy) {
+            if (tree->walked && tree->queue_count == 0) return SSH_OK;
+            continue;
+        }
+
+        if (!answered && sftp_dispatch(tree->sftp) != SSH_OK) {
+            return SSH_ERROR;
+        }
+
+        for (i = 0; i < tree->slot_count; i++) {
+            if (sftp_tree_advance(tree, &tree->slots[i]) != SSH_OK) {
+                return SSH_ERROR;
+            }
+        }
+    }
+}
+
+/**
+ * @brief Store the extension pairs that follow the version of an
+ * SSH_FXP_VERSION packet.
+ *
+ * @param sftp
+ * @param buffer  positioned after the version
+ * @return int
+ */
+static int sftp_parse_extensions(sftp_session sftp, ssh_buffer buffer) {
+    char *name = NULL;
+    char *data = NULL;
+    char **grown;
+
+    while (ssh_buffer_get_len(buffer) > 0) {
+        if (ssh_buffer_unpack(buffer, "ss", &name, &data) != SSH_OK) {
+            ssh_set_error(SSH_FATAL, "malformed sftp extension");
+            return SSH_ERROR;
+        }
+
+        grown = realloc(sftp->ext_names,
+                        (sftp->ext_count + 1) * sizeof(char *));
+        if (grown != NULL) {
+            sftp->ext_names = grown;
+            grown = realloc(sftp->ext_data,
+                            (sftp->ext_count + 1) * sizeof(char *));
+        }
+        if (grown == NULL) {
+            ssh_set_error(SSH_FATAL, "out of memory");
+            SAFE_FREE(name);
+            SAFE_FREE(data);
+            return SSH_ERROR;
+        }
+        sftp->ext_data = grown;
+
+        LOG_DEBUG("sftp extension %s, data %s", name, data);
+        sftp->ext_names[sftp->ext_count] = name;
+        sftp->ext_data[sftp->ext_count] = data;
+        sftp->ext_count++;
+    }
+    return SSH_OK;
+}
+
+/**
+ * @brief Ask the server for its limits@openssh.com and size READ and WRITE
+ * requests to them, up to SFTP_IO_MAX. A packet length limit leaves room for
+ * the request or reply header.
+ *
+ * @param sftp
+ * @return int
+ */
+static int sftp_query_limits(sftp_session sftp) {
+    struct sftp_limits_struct *limits = &sftp->limits;
+    sftp_request req;
+    ssh_buffer buffer;
+    uint64_t max_read = SFTP_IO_MAX;
+    uint64_t max_write = SFTP_IO_MAX;
+    uint32_t id;
+    int rc;
+
+    buffer = ssh_buffer_new();
+    if (buffer == NULL) {
+        ssh_set_error(SSH_FATAL, "buffer error");
+        return SSH_ERROR;
+    }
+    id = sftp_get_new_id(sftp);
+    if (ssh_buffer_pack(buffer, "ds", id, "limits@openssh.com") != SSH_OK) {
+        ssh_set_error(SSH_FATAL, "buffer error");
+        ssh_buffer_free(buffer);
+        return SSH_ERROR;
+    }
+    req = sftp_request_send(sftp, SSH_FXP_EXTENDED, id, buffer);
+    ssh_buffer_free(buffer);
+    if (req == NULL) return SSH_ERROR;
+
+    if (sftp_request_wait(req) != SSH_OK) {
+        sftp_request_cancel(req);
+        return SSH_ERROR;
+    }
+    rc = SSH_ERROR;
+    if (req->reply->type == SSH_FXP_EXTENDED_REPLY) {
+        rc = ssh_buffer_unpack(req->reply->payload, "dqqqq", &id,
+                               &limits->max_packet_length,
+                               &limits->max_read_length,
+                               &limits->max_write_length,
+                               &limits->max_open_handles);
+    }
+    sftp_request_free(req);
+    if (rc != SSH_OK) {
+        ssh_set_error(SSH_FATAL, "malformed limits@openssh.com reply");
+        memset(limits, 0, sizeof(*limits));
+        return SSH_ERROR;
+    }
+
+    /* 0 means no limit */
+    if (limits->max_read_length > 0) {
+        max_read = MIN(max_read, limits->max_read_length);
+    }
+    if (limits->max_write_length > 0) {
+        max_write = MIN(max_write, limits->max_write_length);
+    }
+    if (limits->max_packet_length > SFTP_WRITE_HEADER_LEN) {
+        max_read = MIN(max_read,
+                       limits->max_packet_length - SFTP_DATA_HEADER_LEN);
+        max_write = MIN(max_write,
+                        limits->max_packet_length - SFTP_WRITE_HEADER_LEN);
+    }
+    sftp->max_read = MAX(max_read, 1);
+    sftp->max_write = MAX(max_write, 1);
+
+    LOG_NOTICE("sftp limits: packet %lu, read %u, write %u, handles %lu",
+               (unsigned long)limits->max_packet_length, sftp->max_read,
+               sftp->max_write, (unsigned long)limits->max_open_handles);
+    return SSH_OK;
+}
+
+/**
+ * @brief Have the server copy `len` bytes with the copy-data extension,
+ * from the offset of `from` to the offset of `to`. The offsets are left
+ * as they are.
+ *
+ * @param from
+ * @param to
+ * @param len
+ * @return bytes copied, SSH_ERROR on error.
+ */
+static int64_t sftp_copy_data(sftp_file from, sftp_file to, uint64_t len) {
+    sftp_session sftp = from->sftp;
+    sftp_request req;
+    ssh_buffer buffer;
+    uint32_t id;
+    uint32_t code;
+
+    buffer = ssh_buffer_new();
+    if (buffer == NULL) {
+        ssh_set_error(SSH_FATAL, "buffer error");
+        return SSH_ERROR;
+    }
+    id = sftp_get_new_id(sftp);
+    if (ssh_buffer_pack(buffer, "dsSqqSq", id, "copy-data", from->handle,
+                        from->offset, len, to->handle,
+                        to->offset) != SSH_OK) {
+        ssh_set_error(SSH_FATAL, "buffer error");
+        ssh_buffer_free(buffer);
+        return SSH_ERROR;
+    }
+
+    sftp_attr_cache_invalidate(sftp, to->path);
+
+    req = sftp_request_send(sftp, SSH_FXP_EXTENDED, id, buffer);
+    ssh_buffer_free(buffer);
+    if (req == NULL) return SSH_ERROR;
+
+    if (sftp_request_status(req, &code) != SSH_OK) {
+        ssh_set_error(SSH_FATAL, "unexpected sftp copy-data response type");
+        sftp_request_cancel(req);
+        return SSH_ERROR;
+    }
+    sftp_request_free(req);
+
+    if (code != SSH_FX_OK) {
+        ssh_set_error(SSH_REQUEST_DENIED,
+                      "copy-data failed with error code %u", code);
+        return SSH_ERROR;
+    }
+    return len;
+}
+
+/**
+ * @brief Copy through the client: SFTP_COPY_DEPTH reads are kept in flight,
+ * and each reply goes out again as a write while the next reads are on
+ * their way, with up to SFTP_COPY_DEPTH writes waiting for their status.
+ * The offsets of both files are advanced by the bytes copied.
+ *
+ * @param from
+ * @param to
+ * @param len     0 to copy up to the end of `from`
+ * @return bytes copied, SSH_ERROR on error.
+ */
+static int64_t sftp_copy_relay(sftp_file from, sftp_file to, uint64_t len) {
+    sftp_session sftp = from->sftp;
+    sftp_request reads[SFTP_COPY_DEPTH] = {0};
+    sftp_request writes[SFTP_COPY_DEPTH] = {0};
+    uint8_t *bufs;
+    uint64_t start = from->offset;
+    uint64_t next = start;
+    uint64_t end = len > 0 ? start + len : UINT64_MAX;
+    uint64_t copied = 0;
+    uint64_t offset;
+    uint32_t read_head = 0, read_count = 0;
+    uint32_t write_head = 0, write_count = 0;
+    uint32_t i;
+    uint32_t want;
+    int32_t nread;
+    sftp_request req;
+
+    bufs = malloc((size_t)SFTP_COPY_DEPTH * sftp->max_read);
+    if (bufs == NULL) {
+        ssh_set_error(SSH_FATAL, "out of memory");
+        return SSH_ERROR;
+    }
+
+    while (1) {
+        while (read_count < SFTP_COPY_DEPTH && next < end) {
+            if (ssh_channel_grow_window(
+                    sftp->channel, (read_count + 1) * (sftp->max_read +
+                                                       SFTP_DATA_HEADER_LEN)) !=
+                SSH_OK) {
+                goto error;
+            }
+            i = (read_head + read_count) % SFTP_COPY_DEPTH;
+            want = MIN(sftp->max_read, end - next);
+            if (sftp_get_range(from, &reads[i], bufs + i * sftp->max_read,
+                               next, want) != SSH_OK) {
+                goto error;
+            }
+            read_count++;
+            next += want;
+        }
+
+        if (read_count == 0) break;
 
-    /* read packet payload */
-    while (size > 0 && size < SFTP_PACKET_SIZE_MAX) {
-        nread =
-            ssh_channel_read(sftp->channel, buffer, MIN(size, sizeof(buffer)));
-        if (nread == SSH_EOF) break;
+        i = read_head;
+        req = reads[i];
+        reads[i] = NULL;
+        read_head = (read_head + 1) % SFTP_COPY_DEPTH;
+        read_count--;
+
+        offset = req->offset;
+        want = req->len;
+        nread = sftp_async_read_result(req, bufs + i * sftp->max_read,
+                                       sftp->max_read);
         if (nread < 0) goto error;
+        if (nread == 0) {
+            /* the reads beyond are answered with EOF as well */
+            end = MIN(end, offset);
+            continue;
+        }
 
-        rc = ssh_buffer_add_data(packet->payload, buffer, nread);
-        if (rc != SSH_OK) goto error;
+        /* make room for the write, then send it */
+        if (write_count == SFTP_COPY_DEPTH) {
+            if (sftp_async_write_result(writes[write_head]) != SSH_OK) {
+                writes[write_head] = NULL;
+                goto error;
+            }
+            writes[write_head] = NULL;
+            write_head = (write_head + 1) % SFTP_COPY_DEPTH;
+            write_count--;
+        }
+        req = sftp_async_write(to, to->offset + (offset - start),
+                               bufs + i * sftp->max_read, nread);
+        if (req == NULL) goto error;
+        writes[(write_head + write_count++) % SFTP_COPY_DEPTH] = req;
+        copied += nread;
+
+        if ((uint32_t)nread < want && offset + nread < end) {
+            /* short read, ask again for the rest */
+            i = (read_head + read_count) % SFTP_COPY_DEPTH;
+            if (sftp_get_range(from, &reads[i], bufs + i * sftp->max_read,
+                               offset + nread, want - nread) != SSH_OK) {
+                goto error;
+            }
+            read_count++;
+        }
+    }
 
-        size -= nread;
+    while (write_count > 0) {
+        req = writes[write_head];
+        writes[write_head] = NULL;
+        write_head = (write_head + 1) % SFTP_COPY_DEPTH;
+        write_count--;
+        if (sftp_async_write_result(req) != SSH_OK) goto error;
     }
+    SAFE_FREE(bufs);
 
-    return packet;
+    from->offset += copied;
+    to->offset += copied;
+    return copied;
 
 error:
-    sftp_packet_free(packet);
+    for (i = 0; i < SFTP_COPY_DEPTH; i++) {
+        sftp_request_cancel(reads[i]);
+        sftp_request_cancel(writes[i]);
+    }
+    SAFE_FREE(bufs);
+    return SSH_ERROR;
+}
+
+/**
+ * @brief Look up one of the hash algorithms shared by check-file, the
+ * `<algorithm>sum` tools and OpenSSL.
+ *
+ * @param algorithm
+ * @return the digest, NULL if the name is not one of SFTP_HASH_ALGORITHMS.
+ */
+static const EVP_MD *sftp_hash_digest(const char *algorithm) {
+    static const char *const names[] = {SFTP_HASH_ALGORITHMS};
+    size_t i;
+
+    if (algorithm == NULL) return NULL;
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(algorithm, names[i]) == 0) {
+            return EVP_get_digestbyname(algorithm);
+        }
+    }
     return NULL;
 }
 
 /**
- * @brief Encapsulate an SFTP packet and write it into the channel.
+ * @brief Ask the server to hash a file with the check-file extension, by
+ * handle if `file` is set, by name otherwise.
  *
  * @param sftp
- * @param type
- * @param payload
- * @return int32_t
+ * @param file
+ * @param path
+ * @param algorithm
+ * @param offset
+ * @param len         0 to hash up to the end of the file
+ * @param block_size  0 for a single hash of the range, otherwise a hash of
+ *                    each block of the range, at least 256 bytes
+ * @return the request, NULL on error.
  */
-int32_t sftp_packet_write(sftp_session sftp, uint8_t type, ssh_buffer payload) {
-    uint8_t header[5] = {0};
-    uint32_t size;
-    int nwrite;
+static sftp_request sftp_check_file_send(sftp_session sftp, sftp_file file,
+                                         const char *path,
+                                         const char *algorithm,
+                                         uint64_t offset, uint64_t len,
+                                         uint32_t block_size) {
+    sftp_request req;
+    ssh_buffer buffer;
+    uint32_t id;
     int rc;
 
-    size = ssh_buffer_get_len(payload) + sizeof(uint8_t);
-    *(uint32_t *)header = htonl(size);
-    header[4] = type;
+    buffer = ssh_buffer_new();
+    if (buffer == NULL) {
+        ssh_set_error(SSH_FATAL, "buffer error");
+        return NULL;
+    }
+    id = sftp_get_new_id(sftp);
+    if (file != NULL) {
+        rc = ssh_buffer_pack(buffer, "dsS", id, "check-file-handle",
+                             file->handle);
+    } else {
+        rc = ssh_buffer_pack(buffer, "dss", id, "check-file-name", path);
+    }
+    if (rc != SSH_OK || ssh_buffer_pack(buffer, "sqqd", algorithm, offset,
+                                        len, block_size) != SSH_OK) {
+        ssh_set_error(SSH_FATAL, "buffer error");
+        ssh_buffer_free(buffer);
+        return NULL;
+    }
+    req = sftp_request_send(sftp, SSH_FXP_EXTENDED, id, buffer);
+    ssh_buffer_free(buffer);
+    return req;
+}
 
-    rc = ssh_buffer_prepend_data(payload, header, sizeof(header));
-    if (rc != SSH_OK) {
-        ssh_set_error(SSH_FATAL, "can not create sftp packet");
+/**
+ * @brief Wait for a check-file request and take the hashes of its reply.
+ * The request is freed.
+ *
+ * @param req
+ * @param algorithm   the algorithm asked for
+ * @param digest      the hashes, back to back
+ * @param max_len     size of `digest`
+ * @param digest_len  set to the length of the hashes
+ * @param code        set to the status code if the server answered with
+ *                    SSH_FXP_STATUS
+ * @return SSH_OK on success, SSH_ERROR on error.
+ */
+static int sftp_check_file_reply(sftp_request req, const char *algorithm,
+                                 unsigned char *digest, size_t max_len,
+                                 size_t *digest_len, uint32_t *code) {
+    char *name = NULL;
+    char *used = NULL;
+    uint32_t id;
+    uint32_t hash_len;
+    int rc;
+
+    if (sftp_request_wait(req) != SSH_OK) {
+        sftp_request_cancel(req);
+        *code = SSH_FX_CONNECTION_LOST;
         return SSH_ERROR;
     }
-
-    nwrite = ssh_channel_write(sftp->channel, ssh_buffer_get(payload),
-                               ssh_buffer_get_len(payload));
-    if (nwrite != ssh_buffer_get_len(payload)) {
-        ssh_set_error(SSH_FATAL, "can not write sftp packet");
+    if (req->reply->type == SSH_FXP_STATUS) {
+        if (sftp_request_status(req, code) != SSH_OK) *code = SSH_FX_FAILURE;
+        sftp_request_free(req);
+        ssh_set_error(SSH_REQUEST_DENIED, "check-file failed with error code %u",
+                      *code);
         return SSH_ERROR;
     }
 
-    return nwrite;
-}
-
-static void sftp_status_free(sftp_status status) {
-    if (status == NULL) return;
-    SAFE_FREE(status->errormsg);
-    SAFE_FREE(status->langtag);
-    SAFE_FREE(status);
+    rc = SSH_ERROR;
+    if (req->reply->type == SSH_FXP_EXTENDED_REPLY &&
+        ssh_buffer_unpack(req->reply->payload, "ds", &id, &name) == SSH_OK) {
+        /* the reply names the extension first, as in the filexfer draft,
+         * or starts right away with the algorithm used */
+        if (strcmp(name, "check-file") == 0) {
+            rc = ssh_buffer_unpack(req->reply->payload, "s", &used);
+        } else {
+            used = name;
+            name = NULL;
+            rc = SSH_OK;
+        }
+    }
+    hash_len = ssh_buffer_get_len(req->reply->payload);
+    if (rc == SSH_OK && (strcmp(used, algorithm) != 0 || hash_len == 0 ||
+                         hash_len > max_len)) {
+        rc = SSH_ERROR;
+    }
+    if (rc == SSH_OK) {
+        ssh_buffer_get_data(req->reply->payload, digest, hash_len);
+        *digest_len = hash_len;
+        *code = SSH_FX_OK;
+    } else {
+        ssh_set_error(SSH_FATAL, "malformed check-file reply");
+        *code = SSH_FX_BAD_MESSAGE;
+    }
+    SAFE_FREE(name);
+    SAFE_FREE(used);
+    sftp_request_free(req);
+    return rc;
 }
 
-static sftp_packet sftp_packet_new(sftp_session sftp) {
-    sftp_packet packet = NULL;
-
-    packet = calloc(1, sizeof(struct sftp_packet_struct));
-    if (packet == NULL) return NULL;
+/**
+ * @brief Have the server hash a file with the check-file extension, by
+ * handle if `file` is set, by name otherwise. A single hash of the whole
+ * range is asked for (block size 0).
+ *
+ * @param sftp
+ * @param file
+ * @param path
+ * @param algorithm
+ * @param offset
+ * @param len         0 to hash up to the end of the file
+ * @param digest
+ * @param digest_len
+ * @param code        set to the status code if the server answered with
+ *                    SSH_FXP_STATUS
+ * @return SSH_OK on success, SSH_ERROR on error.
+ */
+static int sftp_check_file(sftp_session sftp, sftp_file file, const char *path,
+                           const char *algorithm, uint64_t offset,
+                           uint64_t len, unsigned char *digest,
+                           size_t *digest_len, uint32_t *code) {
+    sftp_request req;
 
-    packet->sftp = sftp;
-    packet->payload = ssh_buffer_new();
-    if (packet->payload == NULL) {
-        SAFE_FREE(packet);
-        return NULL;
+    req = sftp_check_file_send(sftp, file, path, algorithm, offset, len, 0);
+    if (req == NULL) {
+        *code = SSH_FX_FAILURE;
+        return SSH_ERROR;
     }
-
-    return packet;
+    return sftp_check_file_reply(req, algorithm, digest, SFTP_HASH_MAX,
+                                 digest_len, code);
 }
 
-static void sftp_packet_free(sftp_packet packet) {
-    if (packet == NULL) return;
-    ssh_buffer_free(packet->payload);
-    SAFE_FREE(packet);
-}
+/**
+ * @brief Send `len` bytes of `buf` to `offset` of `file` in write-behind
+ * requests of at most the session write size.
+ *
+ * @param file
+ * @param offset
+ * @param buf
+ * @param len
+ * @return int
+ */
+static int sftp_write_range(sftp_file file, uint64_t offset,
+                            const uint8_t *buf, uint64_t len) {
+    uint32_t n;
 
-static void sftp_file_free(sftp_file file) {
-    if (file == NULL) return;
-    ssh_string_free(file->handle);
-    SAFE_FREE(file);
+    while (len > 0) {
+        n = MIN(len, file->sftp->max_write);
+        if (sftp_write_send(file, offset, buf, n) != SSH_OK) return SSH_ERROR;
+        offset += n;
+        buf += n;
+        len -= n;
+    }
+    return SSH_OK;
 }
 
 /**
- * @brief Parse an SFTP packet with type SSH_FXP_HANDLE. Allocate and initiate a
- * file structure.
+ * @brief The check-file pass of sftp_put_delta(): compare the remote hash
+ * of each block below `end` with the hash of the local block, and send the
+ * blocks that differ. SFTP_DELTA_DEPTH requests are kept in flight, so the
+ * server hashes the next batches while the local file is read and hashed.
  *
- * @param packet
- * @param orig_id
- * @return sftp_file
+ * @param file
+ * @param fd
+ * @param algorithm
+ * @param block_size
+ * @param end
+ * @param sent          increased by the bytes sent
+ * @param code          set to the status code of a failed check-file
+ * @return int
  */
-static sftp_file sftp_parse_handle(sftp_packet packet, uint32_t orig_id) {
-    sftp_file file;
-    uint32_t id;
-    int rc;
+static int sftp_delta_hashed(sftp_file file, int fd, const char *algorithm,
+                             uint32_t block_size, uint64_t end,
+                             uint64_t *sent, uint32_t *code) {
+    sftp_session sftp = file->sftp;
+    const EVP_MD *md = sftp_hash_digest(algorithm);
+    size_t md_len = EVP_MD_size(md);
+    uint64_t batch = (uint64_t)(SFTP_DELTA_REPLY / md_len) * block_size;
+    sftp_request reqs[SFTP_DELTA_DEPTH] = {NULL};
+    uint64_t offsets[SFTP_DELTA_DEPTH];
+    unsigned char local[EVP_MAX_MD_SIZE];
+    unsigned char *hashes = NULL;
+    size_t hashes_len;
+    uint8_t *buf = NULL;
+    EVP_MD_CTX *ctx = NULL;
+    uint64_t next = 0;
+    uint64_t offset;
+    uint64_t batch_end;
+    uint32_t head = 0;
+    uint32_t count = 0;
+    uint32_t slot;
+    uint32_t len;
+    size_t k;
+    ssize_t nread;
+    int rc = SSH_ERROR;
 
-    if (packet->type != SSH_FXP_HANDLE) return NULL;
+    *code = SSH_FX_FAILURE;
+    hashes = malloc(SFTP_DELTA_REPLY);
+    buf = malloc(block_size);
+    ctx = EVP_MD_CTX_new();
+    if (hashes == NULL || buf == NULL || ctx == NULL) {
+        ssh_set_error(SSH_FATAL, "out of memory");
+        goto out;
+    }
 
-    file = calloc(1, sizeof(struct sftp_file_struct));
-    if (file == NULL) return NULL;
+    while (next < end || count > 0) {
+        while (count < SFTP_DELTA_DEPTH && next < end) {
+            if (ssh_channel_grow_window(sftp->channel,
+                                        (count + 1) * SFTP_DELTA_REPLY_LEN) !=
+                SSH_OK) {
+                goto out;
+            }
+            slot = (head + count) % SFTP_DELTA_DEPTH;
+            offsets[slot] = next;
+            reqs[slot] = sftp_check_file_send(sftp, file, NULL, algorithm,
+                                              next, MIN(batch, end - next),
+                                              block_size);
+            if (reqs[slot] == NULL) goto out;
+            next += MIN(batch, end - next);
+            count++;
+        }
 
-    rc = ssh_buffer_unpack(packet->payload, "dS", &id, &file->handle);
-    if (rc != SSH_OK || file->handle == NULL) {
-        SAFE_FREE(file);
-        return NULL;
-    }
+        slot = head;
+        head = (head + 1) % SFTP_DELTA_DEPTH;
+        count--;
+        rc = sftp_check_file_reply(reqs[slot], algorithm, hashes,
+                                   SFTP_DELTA_REPLY, &hashes_len, code);
+        reqs[slot] = NULL;
+        if (rc != SSH_OK) goto out;
+        rc = SSH_ERROR;
 
-    if (id != orig_id) {
-        LOG_ERROR("sftp response id %d does not match with origin id %d", id,
-                  orig_id);
-        SAFE_FREE(file);
-        return NULL;
+        /* hashes missing at the end mean the remote file is shorter */
+        offset = offsets[slot];
+        batch_end = MIN(offset + batch, end);
+        for (k = 0; offset < batch_end; k++, offset += len) {
+            len = MIN(block_size, batch_end - offset);
+            nread = pread(fd, buf, len, offset);
+            if (nread != (ssize_t)len) {
+                ssh_set_error(SSH_FATAL, "can not read local file: %s",
+                              nread < 0 ? strerror(errno) : "file shrank");
+                goto out;
+            }
+            if (EVP_DigestInit_ex(ctx, md, NULL) != 1 ||
+                EVP_DigestUpdate(ctx, buf, len) != 1 ||
+                EVP_DigestFinal_ex(ctx, local, NULL) != 1) {
+                ssh_set_error(SSH_FATAL, "can not compute %s digest",
+                              algorithm);
+                goto out;
+            }
+            if ((k + 1) * md_len <= hashes_len &&
+                memcmp(local, hashes + k * md_len, md_len) == 0) {
+                continue;
+            }
+            if (sftp_write_range(file, offset, buf, len) != SSH_OK) goto out;
+            *sent += len;
+        }
     }
+    rc = SSH_OK;
 
-    file->sftp = packet->sftp;
-    file->offset = 0;
-    file->eof = 0;
-
-    return file;
+out:
+    for (k = 0; k < SFTP_DELTA_DEPTH; k++) sftp_request_cancel(reqs[k]);
+    EVP_MD_CTX_free(ctx);
+    SAFE_FREE(buf);
+    SAFE_FREE(hashes);
+    return rc;
 }
 
 /**
- * @brief Parse an SFTP packet with type SSH_FXP_STATUS. Allocate and initiate a
- * status structure.
+ * @brief The pass of sftp_put_delta() without check-file: read the remote
+ * file below `end` with the read depth of the session, and send the ranges
+ * that differ from the local file.
  *
- * @param packet
- * @return sftp_status
+ * @param file
+ * @param fd
+ * @param block_size    at most the session read size
+ * @param end
+ * @param sent          increased by the bytes sent
+ * @return int
  */
-static sftp_status sftp_parse_status(sftp_packet packet) {
-    sftp_status status;
-    int rc;
+static int sftp_delta_read(sftp_file file, int fd, uint32_t block_size,
+                           uint64_t end, uint64_t *sent) {
+    sftp_session sftp = file->sftp;
+    sftp_request *reqs = NULL;
+    uint8_t *bufs = NULL;
+    uint8_t *local = NULL;
+    uint8_t *remote;
+    uint32_t depth = sftp->read_depth;
+    uint32_t inflight = 0;
+    uint64_t next = 0;
+    uint64_t offset;
+    uint32_t len;
+    uint32_t n;
+    uint32_t i;
+    int32_t nread;
+    ssize_t lread;
 
-    if (packet->type != SSH_FXP_STATUS) return NULL;
+    reqs = calloc(depth, sizeof(sftp_request));
+    bufs = malloc((size_t)depth * block_size);
+    local = malloc(block_size);
+    if (reqs == NULL || bufs == NULL || local == NULL) {
+        ssh_set_error(SSH_FATAL, "out of memory");
+        goto error;
+    }
 
-    status = calloc(1, sizeof(struct sftp_status_struct));
-    if (status == NULL) return NULL;
+    while (1) {
+        for (i = 0; i < depth && next < end; i++) {
+            if (reqs[i] != NULL) continue;
+            if (ssh_channel_grow_window(
+                    sftp->channel,
+                    (inflight + 1) * (block_size + SFTP_DATA_HEADER_LEN)) !=
+                SSH_OK) {
+                goto error;
+            }
+            len = MIN(block_size, end - next);
+            if (sftp_get_range(file, &reqs[i], bufs + i * block_size, next,
+                               len) != SSH_OK) {
+                goto error;
+            }
+            inflight++;
+            next += len;
+        }
 
-    rc = ssh_buffer_unpack(packet->payload, "dd", &status->id, &status->status);
-    if (rc != SSH_OK) {
-        SAFE_FREE(status);
-        return NULL;
+        if (inflight == 0) break;
+
+        for (i = 0; i < depth; i++) {
+            if (reqs[i] == NULL || reqs[i]->reply == NULL) continue;
+
+            remote = bufs + i * block_size;
+            offset = reqs[i]->offset;
+            len = reqs[i]->len;
+            nread = sftp_async_read_result(reqs[i], remote, len);
+            reqs[i] = NULL;
+            inflight--;
+            if (nread < 0) goto error;
+
+            /* past the remote end of file, the rest is sent as is */
+            n = nread > 0 ? (uint32_t)nread : len;
+            lread = pread(fd, local, n, offset);
+            if (lread != (ssize_t)n) {
+                ssh_set_error(SSH_FATAL, "can not read local file: %s",
+                              lread < 0 ? strerror(errno) : "file shrank");
+                goto error;
+            }
+            if (nread == 0 || memcmp(local, remote, n) != 0) {
+                if (sftp_write_range(file, offset, local, n) != SSH_OK) {
+                    goto error;
+                }
+                *sent += n;
+            }
+            if (nread > 0 && n < len) {
+                /* short read, ask again for the rest of the range */
+                if (sftp_get_range(file, &reqs[i], remote, offset + n,
+                                   len - n) != SSH_OK) {
+                    goto error;
+                }
+                inflight++;
+            }
+        }
+
+        for (i = 0; i < depth; i++) {
+            if (reqs[i] != NULL && reqs[i]->reply != NULL) break;
+        }
+        if (i == depth && inflight > 0 && sftp_dispatch(sftp) != SSH_OK) {
+            goto error;
+        }
     }
-    rc = ssh_buffer_unpack(packet->payload, "ss", &status->errormsg,
-                           &status->langtag);
 
-    if (rc != SSH_OK) {
-        SAFE_FREE(status);
-        return NULL;
+    SAFE_FREE(reqs);
+    SAFE_FREE(bufs);
+    SAFE_FREE(local);
+    return SSH_OK;
+
+error:
+    if (reqs != NULL) {
+        for (i = 0; i < depth; i++) sftp_request_cancel(reqs[i]);
     }
+    SAFE_FREE(reqs);
+    SAFE_FREE(bufs);
+    SAFE_FREE(local);
+    return SSH_ERROR;
+}
 
-    return status;
+/**
+ * @brief Quote `str` for a POSIX shell by enclosing it in single quotes.
+ *
+ * @param str
+ * @return the quoted string, to be freed, NULL on error.
+ */
+static char *sftp_shell_quote(const char *str) {
+    size_t len = 2;
+    const char *p;
+    char *quoted, *q;
+
+    for (p = str; *p != '\0'; p++) len += *p == '\'' ? 4 : 1;
+    quoted = malloc(len + 1);
+    if (quoted == NULL) return NULL;
+
+    q = quoted;
+    *q++ = '\'';
+    for (p = str; *p != '\0'; p++) {
+        if (*p == '\'') {
+            /* close the quote, add an escaped quote, reopen */
+            memcpy(q, "'\\''", 4);
+            q += 4;
+        } else {
+            *q++ = *p;
+        }
+    }
+    *q++ = '\'';
+    *q = '\0';
+    return quoted;
 }
 
 /**
- * @brief Get file attributes from the server.
- * @todo Not implemented since we only want to read and write (excluding append)
+ * @brief Hash a file by running `<algorithm>sum` on the server in a session
+ * channel of its own, for servers without check-file. The server needs a
+ * POSIX shell with `tail`, `head` and the coreutils hash tools.
  *
- * @param session
+ * SFTP requests may stay in flight meanwhile, their replies are queued on
+ * the SFTP channel. Write-behind requests are collected first so that the
+ * hash covers their data.
+ *
+ * @param sftp
  * @param path
- * @return sftp_attributes
+ * @param algorithm
+ * @param offset
+ * @param len         0 to hash up to the end of the file
+ * @param digest
+ * @param digest_len
+ * @return SSH_OK on success, SSH_ERROR on error.
  */
-sftp_attributes sftp_stat(sftp_session session, const char *path) {
-    return NULL;
+static int sftp_hash_exec(sftp_session sftp, const char *path,
+                          const char *algorithm, uint64_t offset,
+                          uint64_t len, unsigned char *digest,
+                          size_t *digest_len) {
+    ssh_channel channel = NULL;
+    const EVP_MD *md = sftp_hash_digest(algorithm);
+    char out[2 * SFTP_HASH_MAX + 2];
+    char *quoted = NULL;
+    char *cmd = NULL;
+    size_t cmd_len;
+    size_t out_len = 0;
+    size_t hex_len;
+    size_t i;
+    unsigned int byte;
+    bool opened = false;
+    char c;
+    int nread;
+    int rc = SSH_ERROR;
+
+    if (sftp_drain_writes(sftp) != SSH_OK) return SSH_ERROR;
+
+    quoted = sftp_shell_quote(path);
+    if (quoted == NULL) {
+        ssh_set_error(SSH_FATAL, "out of memory");
+        return SSH_ERROR;
+    }
+    /* `test` first, or a missing file hashes as empty input */
+    cmd_len = 2 * strlen(quoted) + strlen(algorithm) + 96;
+    cmd = malloc(cmd_len);
+    if (cmd == NULL) {
+        ssh_set_error(SSH_FATAL, "out of memory");
+        goto out;
+    }
+    if (len > 0) {
+        snprintf(cmd, cmd_len,
+                 "test -r %s && tail -c +%llu %s | head -c %llu | %ssum",
+                 quoted, (unsigned long long)offset + 1, quoted,
+                 (unsigned long long)len, algorithm);
+    } else {
+        snprintf(cmd, cmd_len, "test -r %s && tail -c +%llu %s | %ssum",
+                 quoted, (unsigned long long)offset + 1, quoted, algorithm);
+    }
+
+    channel = ssh_channel_new(sftp->session);
+    if (channel == NULL) {
+        ssh_set_error(SSH_FATAL, "can not create ssh channel");
+        goto out;
+    }
+    opened = ssh_channel_open_session(channel) == SSH_OK;
+    if (!opened || ssh_channel_request_exec(channel, cmd) != SSH_OK) {
+        ssh_set_error(SSH_REQUEST_DENIED, "can not run %ssum on the server",
+                      algorithm);
+        goto out;
+    }
+
+    /* "<hex digest>  -\n", read up to EOF as a partial read would leave
+     * the rest in the channel */
+    while ((nread = ssh_channel_read(channel, &c, 1)) == 1) {
+        if (out_len < sizeof(out) - 1) out[out_len++] = c;
+    }
+    out[out_len] = '\0';
+    if (nread != SSH_EOF) goto out;
+
+    hex_len = strspn(out, "0123456789abcdefABCDEF");
+    if (hex_len == 0 || hex_len != 2 * (size_t)EVP_MD_size(md) ||
+        (out[hex_len] != ' ' && out[hex_len] != '\n')) {
+        ssh_set_error(SSH_FATAL, "%ssum failed on %s", algorithm, path);
+        goto out;
+    }
+    for (i = 0; i < hex_len / 2; i++) {
+        sscanf(out + 2 * i, "%2x", &byte);
+        digest[i] = byte;
+    }
+    *digest_len = hex_len / 2;
+    rc = SSH_OK;
+
+out:
+    if (channel != NULL) {
+        if (opened) ssh_channel_close(channel);
+        ssh_channel_free(channel);
+    }
+    SAFE_FREE(cmd);
+    SAFE_FREE(quoted);
+    return rc;
 }
@@ -12,7 +12,9 @@
 #include "libsftp/socket.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <stdio.h>
 #include <unistd.h>
 
@@ -46,6 +48,7 @@ static int getai(const char *host, int port, struct addrinfo **ai) {
 ssh_socket ssh_socket_new() {
     ssh_socket s = calloc(1, sizeof(struct ssh_socket_struct));
     s->in_buffer = ssh_buffer_new();
+    s->out_buffer = ssh_buffer_new();
     return s;
 }
 
@@ -58,6 +61,7 @@ void ssh_socket_close(ssh_socket s) {
 void ssh_socket_free(ssh_socket s) {
     if (s == NULL) return;
     ssh_buffer_free(s->in_buffer);
+    ssh_buffer_free(s->out_buffer);
 }
 
 int ssh_socket_connect(ssh_socket s, const char *host, uint16_t port,
@@ -95,24 +99,259 @@ int ssh_socket_connect(ssh_socket s, const char *host, uint16_t port,
 
 void ssh_socket_set_fd(ssh_socket s, int fd) { s->fd = fd; }
 
+/**
+ * @brief Make the socket blocking or not. Writes that do not fit in the
+ * socket are queued in non-blocking mode, and flushed before the socket is
+ * made blocking again.
+ *
+ * @param s
+ * @param blocking
+ * @return SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_socket_set_blocking(ssh_socket s, int blocking) {
+    int flags;
+
+    flags = fcntl(s->fd, F_GETFL);
+    if (flags >= 0) {
+        flags = blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK;
+        flags = fcntl(s->fd, F_SETFL, flags);
+    }
+    if (flags < 0) {
+        ssh_set_error(SSH_FATAL, "socket %d fcntl error: %s", s->fd,
+                      strerror(errno));
+        return SSH_ERROR;
+    }
+    s->nonblocking = !blocking;
+
+    return blocking ? ssh_socket_flush(s) : SSH_OK;
+}
+
+/**
+ * @brief Wait for `events` on the socket, for a non-blocking socket used by
+ * a blocking call.
+ *
+ * @param s
+ * @param events  poll() events
+ * @return poll() revents, SSH_ERROR on error.
+ */
+static int socket_poll_wait(ssh_socket s, short events) {
+    struct pollfd pfd;
+    int rc;
+
+    pfd.fd = s->fd;
+    pfd.events = events;
+    pfd.revents = 0;
+
+    do {
+        rc = poll(&pfd, 1, -1);
+    } while (rc < 0 && errno == EINTR);
+    if (rc < 0) {
+        LOG_ERROR("poll error on fd %d", s->fd);
+        ssh_set_error(SSH_FATAL, "socket %d poll error", s->fd);
+        return SSH_ERROR;
+    }
+    return pfd.revents;
+}
+
+/**
+ * @brief Write as much of `buffer` as the socket takes, all of it unless
+ * the socket is non-blocking.
+ *
+ * @param s
+ * @param buffer
+ * @param len
+ * @return bytes written, SSH_ERROR on error.
+ */
+static ssize_t socket_send(ssh_socket s, const uint8_t *buffer, size_t len) {
+    size_t nwritten = 0;
+    ssize_t writen;
+
+    while (nwritten < len) {
+        writen = write(s->fd, buffer + nwritten, len - nwritten);
+        if (writen < 0 && errno == EINTR) continue;
+        if (writen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (s->nonblocking) break;
+            if (socket_poll_wait(s, POLLOUT) < 0) return SSH_ERROR;
+            continue;
+        }
+        if (writen < 0) {
+            LOG_ERROR("write error on fd %d", s->fd);
+            ssh_set_error(SSH_FATAL, "socket %d write error", s->fd);
+            return SSH_ERROR;
+        }
+        nwritten += writen;
+    }
+
+    return nwritten;
+}
+
+/**
+ * @brief Write `len` bytes. A non-blocking socket queues what it does not
+ * take at once, behind what is queued already, see `ssh_socket_flush`.
+ *
+ * @param s
+ * @param buffer
+ * @param len
+ * @return SSH_OK on success, SSH_ERROR on error.
+ */
 int ssh_socket_write(ssh_socket s, const void *buffer, size_t len) {
-    return write(s->fd, buffer, len);
+    ssize_t nwritten = 0;
+    int rc;
+
+    rc = ssh_socket_flush(s);
+    if (rc == SSH_ERROR) return SSH_ERROR;
+    if (rc == SSH_OK) {
+        nwritten = socket_send(s, buffer, len);
+        if (nwritten < 0) return SSH_ERROR;
+    }
+
+    if ((size_t)nwritten < len &&
+        ssh_buffer_add_data(s->out_buffer, (const uint8_t *)buffer + nwritten,
+                            len - nwritten) < 0) {
+        ssh_set_error(SSH_FATAL, "out of memory");
+        return SSH_ERROR;
+    }
+
+    return SSH_OK;
+}
+
+/**
+ * @brief Write the bytes queued by `ssh_socket_write`.
+ *
+ * @param s
+ * @return SSH_OK once nothing is queued, SSH_AGAIN if a non-blocking socket
+ * did not take all of it, SSH_ERROR on error.
+ */
+int ssh_socket_flush(ssh_socket s) {
+    ssize_t nwritten;
+
+    if (ssh_buffer_get_len(s->out_buffer) == 0) return SSH_OK;
+
+    nwritten = socket_send(s, ssh_buffer_get(s->out_buffer),
+                           ssh_buffer_get_len(s->out_buffer));
+    if (nwritten < 0) return SSH_ERROR;
+    ssh_buffer_pass_bytes(s->out_buffer, nwritten);
+
+    return ssh_buffer_get_len(s->out_buffer) > 0 ? SSH_AGAIN : SSH_OK;
 }
 
+/**
+ * @brief Read exactly `len` bytes. Bytes left in the socket buffer are
+ * returned first, the rest is read straight into `buffer`.
+ *
+ * @param s
+ * @param buffer
+ * @param len
+ * @return SSH_OK on success, SSH_ERROR on error or end of stream.
+ */
 int ssh_socket_read(ssh_socket s, void *buffer, size_t len) {
-    int readn;
+    size_t nread;
+    ssize_t readn;
 
-    while (ssh_buffer_get_len(s->in_buffer) < len) {
-        char tmp[256];
-        readn = read(s->fd, tmp, sizeof(tmp));
-        if (readn < 0) {
+    nread = MIN(len, ssh_buffer_get_len(s->in_buffer));
+    if (nread > 0) {
+        ssh_buffer_get_data(s->in_buffer, buffer, nread);
+    }
+
+    while (nread < len) {
+        readn = read(s->fd, (uint8_t *)buffer + nread, len - nread);
+        if (readn < 0 && errno == EINTR) continue;
+        if (readn < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (ssh_socket_wait(s) != SSH_OK) return SSH_ERROR;
+            continue;
+        }
+        if (readn <= 0) {
             LOG_ERROR("read error on fd %d", s->fd);
             ssh_set_error(SSH_FATAL, "socket %d read error", s->fd);
             return SSH_ERROR;
         }
-        ssh_buffer_add_data(s->in_buffer, tmp, readn);
+        nread += readn;
     }
 
-    ssh_buffer_get_data(s->in_buffer, buffer, len);
     return SSH_OK;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Read up to `len` bytes from a non-blocking socket, as many as
+ * have arrived.
+ *
+ * @param s
+ * @param buffer
+ * @param len
+ * @return bytes read, 0 if none has arrived, SSH_ERROR on error or end of
+ * stream.
+ */
+int ssh_socket_read_nonblocking(ssh_socket s, void *buffer, size_t len) {
+    size_t nread;
+    ssize_t readn;
+
+    nread = MIN(len, ssh_buffer_get_len(s->in_buffer));
+    if (nread > 0) {
+        ssh_buffer_get_data(s->in_buffer, buffer, nread);
+    }
+
+    while (nread < len) {
+        readn = read(s->fd, (uint8_t *)buffer + nread, len - nread);
+        if (readn < 0 && errno == EINTR) continue;
+        if (readn < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        if (readn <= 0) {
+            LOG_ERROR("read error on fd %d", s->fd);
+            ssh_set_error(SSH_FATAL, "socket %d read error", s->fd);
+            return SSH_ERROR;
+        }
+        nread += readn;
+    }
+
+    return nread;
+}
+
+/**
+ * @brief Check whether `ssh_socket_read` has data without blocking.
+ *
+ * @param s
+ * @return bytes buffered, 1 if the socket is readable, 0 if nothing is
+ * pending, SSH_ERROR on error.
+ */
+int ssh_socket_poll(ssh_socket s) {
+    struct pollfd pfd;
+    int rc;
+
+    if (ssh_buffer_get_len(s->in_buffer) > 0) {
+        return ssh_buffer_get_len(s->in_buffer);
+    }
+
+    pfd.fd = s->fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    rc = poll(&pfd, 1, 0);
+    if (rc < 0) {
+        LOG_ERROR("poll error on fd %d", s->fd);
+        ssh_set_error(SSH_FATAL, "socket %d poll error", s->fd);
+        return SSH_ERROR;
+    }
+
+    return rc > 0 ? 1 : 0;
+}
+
+/**
+ * @brief Wait until the socket is readable, writing queued bytes as the
+ * socket takes them meanwhile, as the peer may be waiting for them.
+ *
+ * @param s
+ * @return SSH_OK on success, SSH_ERROR on error.
+ */
+int ssh_socket_wait(ssh_socket s) {
+    int revents;
+
+    for (;;) {
+        revents = socket_poll_wait(
+            s, ssh_buffer_get_len(s->out_buffer) > 0 ? POLLIN | POLLOUT
+                                                     : POLLIN);
+        if (revents < 0) return SSH_ERROR;
+        if ((revents & POLLOUT) && ssh_socket_flush(s) == SSH_ERROR) {
+            return SSH_ERROR;
+        }
+        if (revents & ~POLLOUT) return SSH_OK;
+    }
+}